@@ -39,12 +39,15 @@
 #include <bqthingfactory/ThingFactory.h>
 #include <bqvec/RingBuffer.h>
 
+#include "AudioStreamStatistics.h"
+
 #include <string>
 #include <vector>
 
 namespace breakfastquay {
 
 class Resampler;
+class AudioStreamSummary;
 
 /* Not thread-safe -- one per thread please. */
 
@@ -84,8 +87,9 @@ public:
 
     /**
      * Return an estimate of the number of frames in the stream, at
-     * its native sample rate, or zero if the stream can't provide
-     * that information.
+     * its retrieval sample rate (which is the native rate unless
+     * setRetrievalSampleRate() has been called), or zero if the
+     * stream can't provide that information.
      *
      * There is no way to distinguish between a stream that can't
      * provide this estimate and a stream of truly zero
@@ -97,6 +101,16 @@ public:
      * For seekable streams (see isSeekable()), any non-zero return
      * value is guaranteed to be a true frame count. For other streams
      * it may be approximate, hence the name.
+     *
+     * Some seekable streams only learn their true frame count by
+     * scanning the whole file, which they put off until it is needed
+     * for seeking, and so return zero here until then. In particular
+     * an MP3 file with no Xing, Info or VBRI header (as written by
+     * some older or streaming encoders) reports zero until the first
+     * seek to a position other than the start, or the first read
+     * using parallel decoding (see setDecodeThreadCount()), unless
+     * its seek index has been cached (see
+     * AudioReadStreamFactory::setSeekIndexCacheDirectory()).
      */
     size_t getEstimatedFrameCount() const;
 
@@ -105,6 +119,12 @@ public:
      * stream. The stream will resample if this differs from the
      * native rate of the stream (reported by getSampleRate()). The
      * default is to use the native rate of the stream.
+     *
+     * Some readers are able to decode directly at certain rates
+     * other than their native one (e.g. Opus at 8, 12, 16, or 24
+     * kHz), which is much cheaper than decoding at the native rate
+     * and resampling. They will do so if this is called before any
+     * audio has been read.
      */
     void setRetrievalSampleRate(size_t);
 
@@ -114,14 +134,47 @@ public:
      * native rate of the stream (reported by getSampleRate()).
      */
     size_t getRetrievalSampleRate() const;
+
+    /**
+     * Set the channels that audio should be read as. There is one
+     * entry in the map per channel to be retrieved, listing the
+     * stream channels that are averaged to make it. For example,
+     * {{0, 1}} mixes a stereo stream down to mono, and {{2}, {3}}
+     * retrieves only the third and fourth channels. An empty map
+     * (the default) retrieves all channels unchanged.
+     *
+     * The map is applied before any resampling, so that channels
+     * that are not wanted are not resampled, and some readers apply
+     * it during decoding or sample conversion, so that unwanted
+     * channels are not converted either. Call this before reading
+     * any audio.
+     *
+     * Throws std::invalid_argument if the map refers to a channel
+     * the stream does not have.
+     */
+    void setRetrievalChannelMap(const std::vector<std::vector<int>> &map);
+
+    /**
+     * Return the retrieval channel map, as last set with
+     * setRetrievalChannelMap, or an empty map if none has been set.
+     */
+    const std::vector<std::vector<int>> &getRetrievalChannelMap() const;
+
+    /**
+     * Return the number of channels in the audio returned by
+     * getInterleavedFrames. This is the number of entries in the
+     * retrieval channel map, if one has been set, or the number of
+     * channels in the stream otherwise.
+     */
+    size_t getRetrievalChannelCount() const;
     
     /**
      * Retrieve \count frames of audio data (that is, \count *
-     * getChannelCount() samples) from the source and store in
-     * \frames.  Return the number of frames actually retrieved; this
-     * will differ from \count only when the end of stream is reached.
-     * The region pointed to by \frames must contain enough space for
-     * \count * getChannelCount() values.
+     * getRetrievalChannelCount() samples) from the source and store
+     * in \frames.  Return the number of frames actually retrieved;
+     * this will differ from \count only when the end of stream is
+     * reached.  The region pointed to by \frames must contain enough
+     * space for \count * getRetrievalChannelCount() values.
      *
      * If a retrieval sample rate has been set, the audio will be
      * resampled to that rate (and \count refers to the number of
@@ -182,25 +235,155 @@ public:
      * total duration of retries. Both are zero by default.
      */
     void setIncrementalTimeouts(int retryTimeoutMs, int totalTimeoutMs);
+
+    /**
+     * Return true if this reader can decode using more than one
+     * thread (see setDecodeThreadCount). Few readers can, and it may
+     * depend on the file as well as the reader.
+     */
+    virtual bool hasParallelDecodeSupport() const;
+
+    /**
+     * Set the number of threads a reader that has parallel decode
+     * support may use to decode a single large read request. The
+     * default is 1. The audio returned is identical whatever the
+     * thread count; only the time taken to read a long stretch of it
+     * (e.g. a whole file in one call to getInterleavedFrames) changes.
+     */
+    void setDecodeThreadCount(int threads);
+
+    /**
+     * Attach a summary to be filled in as audio is read from the
+     * stream, so that a waveform overview can be had without reading
+     * the file a second time. The summary is reset for this stream's
+     * channel count and retrieval sample rate (so set the retrieval
+     * rate first), receives every frame subsequently returned by
+     * getInterleavedFrames, and is completed when a read at the end
+     * of the stream returns no frames. A stream with incremental
+     * support (see hasIncrementalSupport) may still be growing, so
+     * never completes the summary: call AudioStreamSummary::finish
+     * when the stream is known to be done. Seeking the stream, or
+     * changing its
+     * retrieval sample rate or channel map, detaches the summary,
+     * since it would no longer describe the audio in order or in
+     * the format it was reset for. Pass 0 to detach it explicitly.
+     *
+     * The stream does not take ownership of the summary.
+     */
+    void setSummarySink(AudioStreamSummary *summary);
+
+    /**
+     * Return true if getInterleavedFrames is safe to call from a
+     * real-time thread, such as an audio callback: that is, if it
+     * will not allocate memory, wait for I/O or for another thread,
+     * or throw an exception, once the stream is set up. Readers that
+     * decode on the calling thread are not, and nor is any stream
+     * that is resampling or mapping channels itself, or filling a
+     * summary (see setSummarySink). For real-time use, wrap a reader
+     * in a PrefetchingAudioReadStream in real-time mode.
+     */
+    bool isRealTimeSafe() const;
+
+    /**
+     * Start or stop collecting performance statistics for this
+     * stream. Collection is off by default. Switching it on resets
+     * the statistics.
+     */
+    void setStatisticsEnabled(bool enabled);
+
+    /**
+     * Return the statistics collected since collection was switched
+     * on or last reset, or all zeros if it is off.
+     */
+    AudioStreamStatistics getStatistics() const;
+
+    /**
+     * Reset the statistics to zero, if collection is on.
+     */
+    void resetStatistics();
     
 protected:
     AudioReadStream();
     virtual size_t getFrames(size_t count, float *frames) = 0;
     virtual bool performSeek(size_t) { return false; }
+
+    /**
+     * Called when the retrieval sample rate is set, with the rate
+     * requested (or the native rate, if the retrieval rate is being
+     * reset). A reader that can decode directly at or near that rate
+     * more cheaply than at its native rate may reconfigure itself to
+     * do so. Return the rate at which getFrames will deliver audio
+     * from now on; any further conversion to the retrieval rate is
+     * done by resampling. The default implementation returns the
+     * native rate.
+     */
+    virtual size_t performSetDecodeSampleRate(size_t) { return m_sampleRate; }
+
+    /**
+     * Called when the retrieval channel map is set, with the map
+     * (which is empty if it is being reset). A reader that can apply
+     * the map more cheaply itself, for example by converting only
+     * the channels it needs, may do so and return true, in which case
+     * getFrames will deliver map.size() channels from now on. The
+     * default implementation returns false, and the map is then
+     * applied to the output of getFrames.
+     */
+    virtual bool performSetDecodeChannelMap(const std::vector<std::vector<int>> &) {
+        return false;
+    }
+
+    /**
+     * Return true if getFrames in this reader meets the requirements
+     * described for isRealTimeSafe. The default implementation
+     * returns false.
+     */
+    virtual bool isGetFramesRealTimeSafe() const { return false; }
+    
+    /**
+     * Helpers for readers to record statistics, which do nothing
+     * unless collection is on. For timings, construct an
+     * AudioStreamStatistics::Timer with m_statistics.
+     */
+    void countIO(size_t bytes) {
+        if (m_statistics) { m_statistics->bytes += bytes; ++m_statistics->ioCalls; }
+    }
+    void countRetry() {
+        if (m_statistics) ++m_statistics->retries;
+    }
+    void countBuffer(size_t bytes) {
+        if (m_statistics && bytes > m_statistics->peakBufferBytes) {
+            m_statistics->peakBufferBytes = bytes;
+        }
+    }
+
+    AudioStreamStatistics *m_statistics; // null unless collection is on
+    
     size_t m_channelCount;
     size_t m_sampleRate;
     size_t m_estimatedFrameCount;
     bool m_seekable;
     int m_retryTimeoutMs;
     int m_totalTimeoutMs;
+    int m_decodeThreads;
 
 private:
+    size_t retrieveInterleavedFrames(size_t count, float *frames);
+    size_t getMappedFrames(size_t count, float *frames);
     int getResampledChunk(int count, float *frames);
+    void growResampleBuffer(int size);
+    size_t getDecodeSampleRate() const;
     size_t m_retrievalRate;
+    size_t m_decodeRate;
     size_t m_totalFileFrames;
     size_t m_totalRetrievedFrames;
     Resampler *m_resampler;
     RingBuffer<float> *m_resampleBuffer;
+    std::vector<float> m_resampleIn;
+    std::vector<float> m_resampleOut;
+    AudioStreamSummary *m_summary;
+    std::vector<std::vector<int>> m_channelMap;
+    bool m_channelMapInDecoder;
+    std::vector<float> m_channelMapBuffer;
 };
 
 template <typename T>
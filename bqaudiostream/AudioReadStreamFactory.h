@@ -91,6 +91,104 @@ public:
      * Return the extension of a given filename (e.g. "wav" for "A.WAV").
      */
     static std::string extensionOf(std::string fileName);
+
+    /**
+     * Read frameCount frames, starting at startFrame, from the given
+     * audio file into the interleaved buffer frames, which must have
+     * room for frameCount * channels samples. Return the number of
+     * frames actually read, which will be smaller than frameCount
+     * only if the file ends sooner. To read a whole file, open it
+     * with createReadStream first to find its channel count and
+     * length (see AudioReadStream::getEstimatedFrameCount).
+     *
+     * If the file's reader is seekable, the range is split into
+     * contiguous parts which are read concurrently by up to
+     * threadCount threads, each with its own read stream seeked to
+     * the start of its part. Otherwise it is read sequentially on the
+     * calling thread.
+     *
+     * May throw any of the exceptions createReadStream may throw, or
+     * that a read stream may throw while reading.
+     */
+    static size_t readInterleavedFrames(std::string fileName,
+                                        size_t startFrame,
+                                        size_t frameCount,
+                                        float *frames,
+                                        int threadCount);
+
+    /**
+     * Set a directory in which readers may cache the seek indexes
+     * they build for files that cannot otherwise be seeked without
+     * scanning them (such as MP3 files, with or without a VBR
+     * header), so that the scan need not be repeated when the same
+     * file is opened again. Cached indexes are keyed by file size,
+     * modification time and a hash of the start of the file, so are
+     * not used if a file changes.
+     *
+     * The directory must already exist. Pass an empty string (the
+     * default) to disable caching. This setting is shared by all
+     * threads and affects streams created after it is made.
+     */
+    static void setSeekIndexCacheDirectory(std::string directory);
+
+    /**
+     * Return the directory set with setSeekIndexCacheDirectory(), or
+     * an empty string if seek index caching is disabled.
+     */
+    static std::string getSeekIndexCacheDirectory();
+
+    /**
+     * Set a directory in which to cache the decoded audio of files
+     * in compressed formats (such as MP3, Ogg, Opus and FLAC), so
+     * that opening the same file again is much cheaper. When a file
+     * is opened, if the cache holds its audio at the requested
+     * retrieval rate, the returned stream reads from the cache file
+     * (which is memory-mapped, and always seekable) instead of
+     * decoding. Otherwise the returned stream decodes as usual and
+     * writes the audio through to a new cache file, which is kept if
+     * the stream is read from start to end without seeking.
+     *
+     * Cache files are keyed by the source file's path, size and
+     * modification time and by the retrieval rate (so set the rate
+     * before reading). The least recently used files are removed
+     * when the cache exceeds maxBytes.
+     *
+     * The directory must already exist. Pass an empty string (the
+     * default) to disable caching. This setting is shared by all
+     * threads and affects streams created after it is made. The
+     * cache is not available on Windows.
+     */
+    static void setDecodedAudioCache(std::string directory, size_t maxBytes);
+
+    /**
+     * Return the directory set with setDecodedAudioCache(), or an
+     * empty string if decoded audio caching is disabled.
+     */
+    static std::string getDecodedAudioCacheDirectory();
+
+    /**
+     * Enable a cache, shared by all streams in the process, of
+     * decoded audio in blocks, with a budget of maxBytes. When it is
+     * enabled, streams returned by createReadStream obtain their
+     * audio from the cache, keyed by file identity (path, size and
+     * modification time), retrieval rate and position, and only
+     * decode the blocks they can't find there. Streams reading the
+     * same popular file at the same time, or one after another,
+     * therefore decode it only once between them. The least recently
+     * used blocks are discarded when the budget is exceeded.
+     *
+     * Pass 0 (the default) to disable the cache and release the
+     * memory it holds, other than blocks still being read by
+     * existing streams. This setting affects streams created after
+     * it is made.
+     */
+    static void setSharedBlockCacheSize(size_t maxBytes);
+
+    /**
+     * Return the budget set with setSharedBlockCacheSize(), or 0 if
+     * the shared block cache is disabled.
+     */
+    static size_t getSharedBlockCacheSize();
 };
 
 }
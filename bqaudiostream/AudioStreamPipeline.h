@@ -0,0 +1,97 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    bqaudiostream
+
+    A small library wrapping various audio file read/write
+    implementations in C++.
+
+    Copyright 2007-2022 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#ifndef BQ_AUDIO_STREAM_PIPELINE_H
+#define BQ_AUDIO_STREAM_PIPELINE_H
+
+#include <cstddef>
+
+namespace breakfastquay {
+
+class AudioReadStream;
+class AudioWriteStream;
+
+/**
+ * Copies all remaining audio from a read stream to a write stream,
+ * with decoding, sample rate conversion (if the streams' rates
+ * differ) and encoding each running on its own thread. The stages
+ * pass blocks of audio to one another through bounded lock-free
+ * queues, drawing them from fixed pools, so nothing is allocated
+ * once the pipeline is running.
+ *
+ * This is useful for long files, where a conventional read/write
+ * loop runs all three stages in series on one thread. For many
+ * short files, running them concurrently (see AudioTranscoder) is
+ * usually better.
+ *
+ * The read stream is read at its retrieval rate, which should
+ * normally be left at its native rate so that the resampling happens
+ * in the pipeline's own stage. The read stream's retrieval channel
+ * count must match the write stream's channel count.
+ */
+class AudioStreamPipeline
+{
+public:
+    /**
+     * Create a pipeline from source to target, neither of which it
+     * takes ownership of, moving blockFrames frames at a time with
+     * up to queueBlocks blocks in flight between each pair of
+     * stages.
+     */
+    AudioStreamPipeline(AudioReadStream *source,
+                        AudioWriteStream *target,
+                        int blockFrames = 16384,
+                        int queueBlocks = 4);
+    ~AudioStreamPipeline();
+
+    /**
+     * Run the pipeline until the source is exhausted, and return
+     * the number of frames written to the target. If any stage
+     * throws an exception, the pipeline stops and the exception is
+     * rethrown here.
+     */
+    size_t run();
+
+private:
+    AudioStreamPipeline(const AudioStreamPipeline &) =delete;
+    AudioStreamPipeline &operator=(const AudioStreamPipeline &) =delete;
+
+    class D;
+    D *m_d;
+};
+
+}
+
+#endif
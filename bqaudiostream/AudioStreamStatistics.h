@@ -0,0 +1,143 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    bqaudiostream
+
+    A small library wrapping various audio file read/write
+    implementations in C++.
+
+    Copyright 2007-2022 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#ifndef BQ_AUDIO_STREAM_STATISTICS_H
+#define BQ_AUDIO_STREAM_STATISTICS_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+namespace breakfastquay {
+
+/**
+ * Performance counters for a read or write stream, for finding out
+ * where a stream spends its time. Collection is off by default, and
+ * costs no more than a test of a null pointer at each counting point
+ * when it is off. See AudioReadStream::setStatisticsEnabled and
+ * AudioWriteStream::setStatisticsEnabled.
+ *
+ * Not every reader or writer can supply every figure: those that
+ * read or write through a codec library that does its own I/O
+ * cannot count bytes or I/O calls, for example, and leave them at
+ * zero.
+ */
+struct AudioStreamStatistics {
+
+    /** Bytes read from, or written to, the file. */
+    uint64_t bytes;
+
+    /**
+     * Read or write calls made on the file. For readers and writers
+     * that use buffered I/O, these are calls made on the buffered
+     * stream rather than system calls.
+     */
+    uint64_t ioCalls;
+
+    /**
+     * Frames returned to the caller by a read stream, or accepted
+     * from it by a write stream.
+     */
+    uint64_t frames;
+
+    /** Successful seeks. */
+    uint64_t seeks;
+
+    /** Waits for more data during incremental reading. */
+    uint64_t retries;
+
+    /**
+     * Syncs made by a write stream according to its durability
+     * policy, including those on flush() and any background
+     * writeback started in place of a sync, but not the final one
+     * on close. For writers that cannot sync, these are the times
+     * they pushed their buffered data out to the operating system
+     * instead.
+     */
+    uint64_t syncs;
+
+    /**
+     * Time spent decoding or encoding, including the reader's or
+     * writer's own I/O and sample conversion.
+     */
+    double codecSeconds;
+
+    /**
+     * Time spent converting sample formats and mapping channels
+     * (included in codecSeconds where the reader or writer does it).
+     */
+    double conversionSeconds;
+
+    /** Time spent resampling. */
+    double resampleSeconds;
+
+    /** Largest buffer allocated by the stream, in bytes. */
+    size_t peakBufferBytes;
+
+    AudioStreamStatistics() :
+        bytes(0), ioCalls(0), frames(0), seeks(0), retries(0), syncs(0),
+        codecSeconds(0.0), conversionSeconds(0.0), resampleSeconds(0.0),
+        peakBufferBytes(0) { }
+
+    /**
+     * Adds the time from its construction to its destruction to one
+     * of the time fields of a statistics object, if it is given one,
+     * and does nothing if it is given null.
+     */
+    class Timer {
+    public:
+        Timer(AudioStreamStatistics *stats,
+              double AudioStreamStatistics::*field) :
+            m_target(stats ? &(stats->*field) : 0) {
+            if (m_target) m_start = std::chrono::steady_clock::now();
+        }
+        ~Timer() {
+            if (m_target) {
+                std::chrono::duration<double> elapsed =
+                    std::chrono::steady_clock::now() - m_start;
+                *m_target += elapsed.count();
+            }
+        }
+    private:
+        Timer(const Timer &) =delete;
+        Timer &operator=(const Timer &) =delete;
+        double *m_target;
+        std::chrono::steady_clock::time_point m_start;
+    };
+};
+
+}
+
+#endif
@@ -0,0 +1,160 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    bqaudiostream
+
+    A small library wrapping various audio file read/write
+    implementations in C++.
+
+    Copyright 2007-2022 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#ifndef BQ_AUDIO_STREAM_SUMMARY_H
+#define BQ_AUDIO_STREAM_SUMMARY_H
+
+#include <string>
+#include <vector>
+#include <cstddef>
+
+namespace breakfastquay {
+
+/**
+ * A multi-resolution summary of an audio stream, of the sort used
+ * to draw a waveform overview: per-channel min, max and RMS values
+ * over bins of a fixed number of frames, at several levels of
+ * resolution.
+ *
+ * Level 0 has baseBinFrames frames per bin, and each subsequent
+ * level has levelFactor times as many. All levels are built in a
+ * single pass as frames are added.
+ *
+ * A summary is usually filled by attaching it to an AudioReadStream
+ * with AudioReadStream::setSummarySink, so that it is computed as
+ * the stream is read, and then saved to a sidecar file with save()
+ * so that it can be reloaded without decoding the audio again.
+ */
+class AudioStreamSummary
+{
+public:
+    struct Bin {
+        float min;
+        float max;
+        float rms;
+    };
+
+    AudioStreamSummary(int baseBinFrames = 256,
+                       int levelFactor = 8,
+                       int levelCount = 4);
+
+    /**
+     * Discard any existing summary and prepare to summarise a new
+     * stream with the given channel count and sample rate.
+     */
+    void reset(int channelCount, int sampleRate);
+
+    /**
+     * Add count frames of interleaved audio to the summary.
+     */
+    void addInterleavedFrames(const float *frames, size_t count);
+
+    /**
+     * Complete the summary, adding the final partial bin at each
+     * level. No further frames can be added after this until
+     * reset() is called.
+     */
+    void finish();
+
+    /**
+     * Return true if finish() has been called.
+     */
+    bool isComplete() const { return m_complete; }
+    
+    int getChannelCount() const { return m_channelCount; }
+    int getSampleRate() const { return m_sampleRate; }
+    size_t getFrameCount() const { return m_frameCount; }
+    int getLevelCount() const { return m_levelCount; }
+
+    /**
+     * Return the number of frames summarised in each bin of the
+     * given level.
+     */
+    size_t getBinFrames(int level) const;
+
+    /**
+     * Return the number of bins at the given level.
+     */
+    size_t getBinCount(int level) const;
+
+    /**
+     * Return a single bin for a single channel.
+     */
+    Bin getBin(int level, int channel, size_t index) const;
+
+    /**
+     * Save the summary to the given file, in a compact format that
+     * stores each value with 16-bit resolution relative to the
+     * largest magnitude in the summary (or to 1.0 if no value
+     * exceeds it). Peak values are rounded outwards so that a
+     * reloaded summary never understates them. Throws
+     * FailedToWriteFile on failure.
+     */
+    void save(std::string path) const;
+
+    /**
+     * Load a summary previously written with save(). Throws
+     * FileNotFound if the file does not exist or InvalidFileFormat
+     * if it is not a summary file.
+     */
+    static AudioStreamSummary load(std::string path);
+    
+private:
+    struct Accumulator {
+        float min;
+        float max;
+        double sumsq;
+        size_t frames;
+    };
+
+    void emit(int level);
+    void clear(Accumulator &);
+    
+    int m_baseBinFrames;
+    int m_levelFactor;
+    int m_levelCount;
+    int m_channelCount;
+    int m_sampleRate;
+    size_t m_frameCount;
+    bool m_complete;
+    std::vector<std::vector<Bin> > m_bins; // per level, channels interleaved
+    std::vector<Accumulator> m_acc; // per level and channel
+    std::vector<int> m_accBins; // per level, lower-level bins accumulated
+    std::vector<float> m_scratch;
+};
+
+}
+
+#endif
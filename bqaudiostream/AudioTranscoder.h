@@ -0,0 +1,154 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    bqaudiostream
+
+    A small library wrapping various audio file read/write
+    implementations in C++.
+
+    Copyright 2007-2022 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#ifndef BQ_AUDIO_TRANSCODER_H
+#define BQ_AUDIO_TRANSCODER_H
+
+#include "AudioWriteStream.h"
+
+#include <string>
+#include <vector>
+
+namespace breakfastquay {
+
+/**
+ * Converts audio files from one format (or sample rate, or channel
+ * layout) to another, using the read and write stream factories.
+ *
+ * Jobs are run concurrently on a pool of worker threads, each of
+ * which takes jobs from its own queue and, when that is empty, steals
+ * from the others'. Within each job, encoding runs on a separate
+ * thread from decoding, so that the encoder is working on one block
+ * while the next is decoded.
+ */
+class AudioTranscoder
+{
+public:
+    struct Job {
+        /** Audio file to read. */
+        std::string source;
+
+        /**
+         * Audio file to write. The format is deduced from the
+         * extension, as with AudioWriteStreamFactory.
+         */
+        std::string destination;
+
+        /**
+         * Sample rate to write at, or 0 to use the source's rate.
+         */
+        size_t sampleRate;
+
+        /**
+         * Channel layout to write, or empty to keep the source's.
+         * Otherwise there is one entry per output channel, listing
+         * the source channels that are averaged to make it (so {{0},
+         * {1}} keeps the first two channels of the source, and {{0,
+         * 1}} mixes a stereo source down to mono).
+         */
+        std::vector<std::vector<int>> channelMap;
+
+        /** Options for the write stream. */
+        AudioWriteStream::Options options;
+
+        Job() : sampleRate(0) { }
+        Job(std::string src, std::string dst) :
+            source(src), destination(dst), sampleRate(0) { }
+    };
+
+    struct Result {
+        Job job;
+
+        /**
+         * True if the job completed. If not, error contains the
+         * message from the exception that stopped it.
+         */
+        bool succeeded;
+        std::string error;
+
+        /** Number of frames written. */
+        size_t frames;
+
+        /** Wall-clock time the job took, in seconds. */
+        double seconds;
+
+        /**
+         * Throughput, as seconds of audio written per second of
+         * wall-clock time.
+         */
+        double realTimeFactor;
+
+        Result() : succeeded(false), frames(0), seconds(0.0),
+                   realTimeFactor(0.0) { }
+    };
+
+    /**
+     * Create a transcoder that runs up to threadCount jobs at once,
+     * or (if threadCount is 0) as many as there are hardware
+     * threads.
+     */
+    AudioTranscoder(int threadCount = 0);
+    ~AudioTranscoder();
+
+    /**
+     * Run the given jobs and return their results, in the same
+     * order. Does not throw: failures are reported in the results.
+     */
+    std::vector<Result> run(const std::vector<Job> &jobs);
+
+    /**
+     * Run a single job on the calling thread (plus an encoding
+     * thread), reading and writing blockSize frames at a time, and
+     * return its result.
+     */
+    static Result transcode(const Job &job, int blockSize = 16384);
+
+    /**
+     * Set the number of frames read and written at a time. The
+     * default is 16384.
+     */
+    void setBlockSize(int frames);
+    
+private:
+    AudioTranscoder(const AudioTranscoder &) =delete;
+    AudioTranscoder &operator=(const AudioTranscoder &) =delete;
+
+    class D;
+    D *m_d;
+};
+
+}
+
+#endif
@@ -38,7 +38,10 @@
 
 #include "bqthingfactory/ThingFactory.h"
 
+#include "AudioStreamStatistics.h"
+
 #include <string>
+#include <chrono>
 
 namespace breakfastquay {
 
@@ -47,29 +50,233 @@ namespace breakfastquay {
 class AudioWriteStream
 {
 public:
+    /**
+     * Optional encoding parameters for a write stream. Each writer
+     * uses those that are relevant to its format and ignores the
+     * rest. The defaults leave every choice to the writer and its
+     * encoder library, so a stream created with default Options is
+     * the same as one created without.
+     */
+    struct Options {
+
+        enum BitrateMode {
+            DefaultBitrateMode,
+            ConstantBitrate,
+            VariableBitrate,
+            ConstrainedVariableBitrate
+        };
+
+        enum SignalType {
+            DefaultSignalType,
+            VoiceSignal,
+            MusicSignal
+        };
+
+        /**
+         * When a writer should force the data it has written through
+         * to the storage device (e.g. with fsync), as opposed to just
+         * handing it to the operating system. Syncing more often
+         * loses less on a power failure or system crash, but costs
+         * I/O bandwidth, especially with many concurrent writers.
+         *
+         * SyncByFrameCount syncs every syncFrameCount frames written;
+         * SyncByTime syncs at most once every syncIntervalMs; both
+         * also sync on explicit flush(). SyncOnFlushOnly syncs only
+         * when flush() is called. All three also sync once more when
+         * the stream is closed (deleted), after the file has been
+         * finalised. SyncNever does not sync at all, and flush() then
+         * only makes sure that the file is complete and consistent
+         * for concurrent readers.
+         *
+         * Writers that cannot sync (e.g. because they write through a
+         * library or stream that doesn't allow it) interpret this as
+         * a policy for pushing data out of their own buffers.
+         */
+        enum DurabilityPolicy {
+            SyncByFrameCount,
+            SyncByTime,
+            SyncOnFlushOnly,
+            SyncNever
+        };
+
+        /**
+         * Target bitrate for lossy encoders, in bits per second, or
+         * 0 for the encoder's default.
+         */
+        int bitrate;
+
+        /**
+         * Encoder complexity for lossy encoders, from 0 (fastest) to
+         * 10 (slowest and best), or -1 for the encoder's default.
+         * The Opus default is 10; lower values encode several times
+         * faster at some cost in quality.
+         */
+        int complexity;
+
+        /**
+         * Duration of each encoded frame in milliseconds, or 0 for
+         * the encoder's default. For Opus this must be one of 2.5, 5,
+         * 10, 20, 40, 60, 80, 100, or 120. Longer frames have less
+         * overhead but higher latency.
+         */
+        double frameDurationMs;
+
+        BitrateMode bitrateMode;
+
+        /**
+         * A hint to the encoder about the kind of audio being encoded.
+         */
+        SignalType signalType;
+
+        /**
+         * Compression level for lossless encoders (currently FLAC),
+         * from 0.0 (fastest, largest files) to 1.0 (slowest,
+         * smallest files), or -1 for the encoder's default.
+         */
+        double compressionLevel;
+
+        /**
+         * Maximum time, in milliseconds of audio, that an encoder
+         * writing a paged format (such as Ogg Opus) may buffer
+         * before writing a page, or 0 for the encoder's default
+         * (about two seconds for Opus). Lower values make the file
+         * available to concurrent readers sooner, and lose less on a
+         * crash, at the cost of slightly more container overhead.
+         */
+        double maxPageLatencyMs;
+
+        DurabilityPolicy durability;
+
+        /**
+         * Number of frames between syncs with SyncByFrameCount. The
+         * default is 4096.
+         */
+        int syncFrameCount;
+
+        /**
+         * Minimum time between syncs with SyncByTime. The default is
+         * 1000ms.
+         */
+        double syncIntervalMs;
+
+        /**
+         * If true, a writer that supports it will, instead of
+         * blocking on a full sync whenever the durability policy
+         * calls for one, start writeback of the data written since
+         * the last one and return without waiting for it (e.g. with
+         * sync_file_range on Linux). This paces the flow of dirty
+         * pages to disc without stalling the writing thread, but
+         * makes no guarantee about durability; an explicit flush()
+         * still syncs fully. Currently only the libsndfile-based WAV
+         * writer on Linux supports this.
+         */
+        bool backgroundWriteback;
+        
+        /**
+         * Expected duration of the audio to be written, in seconds,
+         * or 0 if not known. Both the libsndfile-based writer (for
+         * WAV, AIFF, W64, RF64 and FLAC) and the built-in WAV writer
+         * use this on Linux to preallocate space for the file, so
+         * that a long recording is laid out contiguously rather than
+         * growing in small appends. The file is truncated to its
+         * real length when closed, so an overestimate costs nothing
+         * afterwards.
+         */
+        double expectedDurationSeconds;
+
+        /**
+         * If true, write WAV files with O_DIRECT (on Linux),
+         * bypassing the page cache so that a long recording does not
+         * evict other data from it. Writes go through a pair of
+         * page-aligned staging buffers, one filling while the other
+         * is written by a background thread. This is supported only
+         * by the built-in 24-bit WAV writer, which is used for .wav
+         * files when this is set even if libsndfile is available. In
+         * this mode flush() writes out only complete staging
+         * buffers, so a concurrent reader may lag behind by up to a
+         * buffer's worth of audio.
+         */
+        bool directIO;
+        
+        /**
+         * Number of threads to encode with, for writers that can
+         * encode in parallel (currently Opus). The default of 1
+         * encodes synchronously in putInterleavedFrames. With more
+         * than one thread, the audio is split into segments of
+         * segmentDurationSeconds which are encoded concurrently, and
+         * the writer buffers up to encodeThreads segments of audio in
+         * memory.
+         *
+         * An Opus file written this way is a chained Ogg stream with
+         * one link (with its own serial number and headers) per
+         * segment, so a long encode produces many links: a three
+         * hour recording at the default segment duration has 180.
+         * Each link after the first starts with a short overlap from
+         * the end of the previous segment, covered by its pre-skip,
+         * so that the file decodes gaplessly with any decoder that
+         * follows the Ogg Opus specification. Tools that handle only
+         * the first link of a chained file will see just the first
+         * segment.
+         */
+        int encodeThreads;
+
+        /**
+         * Duration of each segment when encoding in parallel (see
+         * encodeThreads).
+         */
+        double segmentDurationSeconds;
+
+        Options() :
+            bitrate(0),
+            complexity(-1),
+            frameDurationMs(0.0),
+            bitrateMode(DefaultBitrateMode),
+            signalType(DefaultSignalType),
+            compressionLevel(-1.0),
+            maxPageLatencyMs(0.0),
+            durability(SyncByFrameCount),
+            syncFrameCount(4096),
+            syncIntervalMs(1000.0),
+            backgroundWriteback(false),
+            expectedDurationSeconds(0.0),
+            directIO(false),
+            encodeThreads(1),
+            segmentDurationSeconds(60.0)
+        { }
+    };
+    
     class Target {
     public:
         Target(std::string path, size_t channelCount, size_t sampleRate) :
             m_path(path), m_channelCount(channelCount), m_sampleRate(sampleRate)
         { }
 
+        Target(std::string path, size_t channelCount, size_t sampleRate,
+               Options options) :
+            m_path(path), m_channelCount(channelCount), m_sampleRate(sampleRate),
+            m_options(options)
+        { }
+
         std::string getPath() const { return m_path; }
         size_t getChannelCount() const { return m_channelCount; }
         size_t getSampleRate() const { return m_sampleRate; }
+        const Options &getOptions() const { return m_options; }
 
     private:
         std::string m_path;
         size_t m_channelCount;
         size_t m_sampleRate;
+        Options m_options;
     };
 
-    virtual ~AudioWriteStream() { }
+    virtual ~AudioWriteStream();
 
     virtual std::string getError() const { return ""; }
 
     std::string getPath() const { return m_target.getPath(); }
     size_t getChannelCount() const { return m_target.getChannelCount(); }
     size_t getSampleRate() const { return m_target.getSampleRate(); }
+    const Options &getOptions() const { return m_target.getOptions(); }
     
     /**
      * Write some frames to the file. The frames pointer must point to
@@ -86,10 +293,71 @@ public:
      * the file will also be flushed when the writer is deleted.
      */
     virtual void flush() = 0;
+
+    /**
+     * Start or stop collecting performance statistics for this
+     * stream. Collection is off by default. Switching it on resets
+     * the statistics.
+     */
+    void setStatisticsEnabled(bool enabled);
+
+    /**
+     * Return the statistics collected since collection was switched
+     * on or last reset, or all zeros if it is off.
+     */
+    AudioStreamStatistics getStatistics() const;
+
+    /**
+     * Reset the statistics to zero, if collection is on.
+     */
+    void resetStatistics();
     
 protected:
-    AudioWriteStream(Target t) : m_target(t) { }
+    AudioWriteStream(Target t);
     Target m_target;
+
+    /**
+     * Helpers for writers to record statistics, which do nothing
+     * unless collection is on. For timings, construct an
+     * AudioStreamStatistics::Timer with m_statistics.
+     */
+    void countFrames(size_t count) {
+        if (m_statistics) m_statistics->frames += count;
+    }
+    void countIO(size_t bytes) {
+        if (m_statistics) { m_statistics->bytes += bytes; ++m_statistics->ioCalls; }
+    }
+    void countBuffer(size_t bytes) {
+        if (m_statistics && bytes > m_statistics->peakBufferBytes) {
+            m_statistics->peakBufferBytes = bytes;
+        }
+    }
+
+    AudioStreamStatistics *m_statistics; // null unless collection is on
+
+    /**
+     * Called by a writer after writing count frames. Returns true if
+     * the writer should now sync its file, according to the
+     * durability policy in its options. If it returns true, the
+     * writer should sync and then call syncDone().
+     */
+    bool isSyncDue(size_t count);
+
+    /**
+     * Return true if an explicit flush() should sync the file,
+     * according to the durability policy.
+     */
+    bool shouldSyncOnFlush() const;
+
+    /**
+     * Called by a writer when it has synced its file, to reset the
+     * frame count and timer used by isSyncDue().
+     */
+    void syncDone();
+
+private:
+    size_t m_framesSinceSync;
+    std::chrono::steady_clock::time_point m_lastSync;
 };
 
 template <typename T>
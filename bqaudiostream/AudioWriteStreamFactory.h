@@ -36,13 +36,13 @@
 #ifndef BQ_AUDIO_WRITE_STREAM_FACTORY_H
 #define BQ_AUDIO_WRITE_STREAM_FACTORY_H
 
+#include "AudioWriteStream.h"
+
 #include <string>
 #include <vector>
 
 namespace breakfastquay {
 
-class AudioWriteStream;
-
 class AudioWriteStreamFactory
 {
 public:
@@ -68,6 +68,21 @@ public:
                                                size_t channelCount,
                                                size_t sampleRate);
 
+    /**
+     * Create and return a write stream object for the given audio
+     * file name, as above, passing the given encoding options to the
+     * writer. Options that are not relevant to the writer selected
+     * for the file's format are ignored.
+     *
+     * May throw FailedToWriteFile, FileOperationFailed (for example
+     * if the options are not acceptable to the encoder), or
+     * UnknownFileType.
+     */
+    static AudioWriteStream *createWriteStream(std::string fileName,
+                                               size_t channelCount,
+                                               size_t sampleRate,
+                                               const AudioWriteStream::Options &options);
+
     /**
      * Return a list of the file extensions supported by registered
      * writers (e.g. "wav", "aiff", "opus").
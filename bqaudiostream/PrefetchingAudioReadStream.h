@@ -0,0 +1,160 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    bqaudiostream
+
+    A small library wrapping various audio file read/write
+    implementations in C++.
+
+    Copyright 2007-2022 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#ifndef BQ_PREFETCHING_AUDIO_READ_STREAM_H
+#define BQ_PREFETCHING_AUDIO_READ_STREAM_H
+
+#include "AudioReadStream.h"
+
+namespace breakfastquay {
+
+/**
+ * An AudioReadStream that wraps another one, reading from it on a
+ * background thread into a buffer that it keeps filled a given time
+ * ahead of the consumer. Reads from the PrefetchingAudioReadStream
+ * then usually only copy from memory, so a consumer with deadlines
+ * (such as a playback thread) is insulated from the decoder's
+ * occasional slow moments. If the buffer runs dry, a read waits for
+ * the background thread to catch up.
+ *
+ * The sample rate and channel count of a PrefetchingAudioReadStream
+ * are the retrieval rate and channel count of the wrapped stream at
+ * the time it is wrapped, so a stream that already has a retrieval
+ * rate or channel map set may be wrapped as it is.
+ *
+ * Prefetching begins with the first read or seek, or when real-time
+ * mode is switched on. A retrieval sample rate set before then is
+ * handed to the wrapped stream, which resamples on the background
+ * thread; one set later is applied by this stream as it reads, so
+ * that nothing already prefetched is lost. The same goes for a
+ * retrieval channel map, except that one which would need channels
+ * the wrapped stream already mixes down to be mixed again is always
+ * applied by this stream.
+ *
+ * Seeking (if the wrapped stream is seekable) discards the buffer
+ * and restarts prefetching from the new position.
+ *
+ * An exception thrown by the wrapped stream on the background thread
+ * is rethrown from the read that reaches the point at which it
+ * happened.
+ *
+ * In real-time mode (see setRealTimeMode) reads never wait, and may
+ * be made from a real-time thread such as an audio callback.
+ */
+class PrefetchingAudioReadStream : public AudioReadStream
+{
+public:
+    /**
+     * Wrap the given stream, which the PrefetchingAudioReadStream
+     * takes ownership of, to prefetch from it prefetchSeconds ahead
+     * once reading begins.
+     */
+    PrefetchingAudioReadStream(AudioReadStream *source,
+                               double prefetchSeconds = 2.0);
+    virtual ~PrefetchingAudioReadStream();
+
+    virtual std::string getTrackName() const;
+    virtual std::string getArtistName() const;
+    virtual std::string getError() const;
+
+    /**
+     * Return the number of frames currently buffered ahead of the
+     * read position.
+     */
+    size_t getBufferedFrameCount() const;
+
+    /**
+     * Switch real-time mode on or off. It is off by default.
+     *
+     * In real-time mode, getInterleavedFrames only copies from the
+     * buffer: it does not allocate, wait for the background thread,
+     * or throw. If the buffer does not hold enough audio, the rest of
+     * the request is filled with silence, the full count is returned,
+     * and the shortfall is reported through getLastReadStatus as an
+     * underrun. Fewer frames than requested are returned only at the
+     * end of the stream, or after the wrapped stream has failed (in
+     * which case getLastReadStatus reports the failure instead of an
+     * exception being thrown).
+     *
+     * Seeking is also non-blocking in real-time mode: the seek is
+     * handed to the background thread, and reads return silence (as
+     * underruns) until audio from the new position arrives. A seek
+     * returns false if the requested frame is beyond the end of the
+     * stream; otherwise it returns true, and if the wrapped stream
+     * then fails to seek, the next read reports ReadFailed.
+     *
+     * Switching real-time mode on begins prefetching, so any
+     * retrieval sample rate or channel map to be handled on the
+     * background thread should be set up beforehand.
+     */
+    void setRealTimeMode(bool realTime);
+
+    /**
+     * Return true if real-time mode is on.
+     */
+    bool isRealTimeMode() const;
+
+    enum ReadStatus {
+        ReadComplete,   // all of the requested audio was returned
+        ReadUnderrun,   // some or all of it was silence (real-time mode)
+        ReadEnded,      // the end of the stream was reached
+        ReadFailed      // the wrapped stream failed (real-time mode)
+    };
+
+    /**
+     * Return the outcome of the most recent read.
+     */
+    ReadStatus getLastReadStatus() const;
+
+    /**
+     * Return the number of reads that have underrun in real-time
+     * mode since the stream was created.
+     */
+    size_t getUnderrunCount() const;
+    
+protected:
+    virtual size_t getFrames(size_t count, float *frames);
+    virtual bool performSeek(size_t frame);
+    virtual size_t performSetDecodeSampleRate(size_t rate);
+    virtual bool performSetDecodeChannelMap(const std::vector<std::vector<int>> &map);
+    virtual bool isGetFramesRealTimeSafe() const;
+
+    class D;
+    D *m_d;
+};
+
+}
+
+#endif
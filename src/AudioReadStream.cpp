@@ -33,10 +33,12 @@
 */
 
 #include "../bqaudiostream/AudioReadStream.h"
+#include "../bqaudiostream/AudioStreamSummary.h"
 
 #include "bqresample/Resampler.h"
 
 #include <cmath>
+#include <stdexcept>
 
 using namespace std;
 
@@ -44,17 +46,22 @@ namespace breakfastquay
 {
 	
 AudioReadStream::AudioReadStream() :
+    m_statistics(0),
     m_channelCount(0),
     m_sampleRate(0),
     m_estimatedFrameCount(0),
     m_seekable(false),
     m_retryTimeoutMs(0),
     m_totalTimeoutMs(0),
+    m_decodeThreads(1),
     m_retrievalRate(0),
+    m_decodeRate(0),
     m_totalFileFrames(0),
     m_totalRetrievedFrames(0),
     m_resampler(0),
-    m_resampleBuffer(0)
+    m_resampleBuffer(0),
+    m_summary(0),
+    m_channelMapInDecoder(false)
 {
 }
 
@@ -62,13 +69,14 @@ AudioReadStream::~AudioReadStream()
 {
     delete m_resampler;
     delete m_resampleBuffer;
+    delete m_statistics;
 }
 
 bool
 AudioReadStream::isSeekable() const
 {
     if (m_retrievalRate != 0 &&
-        m_retrievalRate != m_sampleRate) {
+        m_retrievalRate != getDecodeSampleRate()) {
         return false;
     }
     if (m_channelCount == 0) {
@@ -83,8 +91,8 @@ AudioReadStream::getEstimatedFrameCount() const
     if (m_retrievalRate == 0 || m_retrievalRate == m_sampleRate) {
         return m_estimatedFrameCount;
     } else {
-        return size_t(round(double(m_estimatedFrameCount) * double(m_sampleRate) /
-                            double(m_retrievalRate)));
+        return size_t(round(double(m_estimatedFrameCount) * double(m_retrievalRate) /
+                            double(m_sampleRate)));
     }
 }
 
@@ -98,6 +106,11 @@ AudioReadStream::setRetrievalSampleRate(size_t rate)
         rate = max;
     }
     m_retrievalRate = rate;
+    m_summary = 0;
+    if (m_sampleRate != 0) {
+        m_decodeRate = performSetDecodeSampleRate
+            (rate == 0 ? m_sampleRate : rate);
+    }
 }
 
 size_t
@@ -107,13 +120,61 @@ AudioReadStream::getRetrievalSampleRate() const
     else return m_retrievalRate;
 }
 
+size_t
+AudioReadStream::getDecodeSampleRate() const
+{
+    if (m_decodeRate == 0) return m_sampleRate;
+    else return m_decodeRate;
+}
+
+void
+AudioReadStream::setRetrievalChannelMap(const std::vector<std::vector<int>> &map)
+{
+    for (const auto &sources: map) {
+        for (int c: sources) {
+            if (c < 0 || c >= int(m_channelCount)) {
+                throw std::invalid_argument
+                    ("channel map refers to nonexistent stream channel");
+            }
+        }
+    }
+
+    m_channelMap = map;
+    m_summary = 0;
+    m_channelMapInDecoder = performSetDecodeChannelMap(map) && !map.empty();
+
+    // Any resampler we already have is for the old channel count
+    delete m_resampler;
+    m_resampler = 0;
+    delete m_resampleBuffer;
+    m_resampleBuffer = 0;
+}
+
+const std::vector<std::vector<int>> &
+AudioReadStream::getRetrievalChannelMap() const
+{
+    return m_channelMap;
+}
+
+size_t
+AudioReadStream::getRetrievalChannelCount() const
+{
+    if (m_channelMap.empty()) return m_channelCount;
+    else return m_channelMap.size();
+}
+
 bool
 AudioReadStream::seek(size_t frame)
 {
     if (!isSeekable()) {
         return false;
     }
-    return performSeek(frame);
+    m_summary = 0;
+    if (!performSeek(frame)) {
+        return false;
+    }
+    if (m_statistics) ++m_statistics->seeks;
+    return true;
 }
 
 bool
@@ -129,13 +190,92 @@ AudioReadStream::setIncrementalTimeouts(int retryTimeoutMs, int totalTimeoutMs)
     m_totalTimeoutMs = totalTimeoutMs;
 }
 
+bool
+AudioReadStream::hasParallelDecodeSupport() const
+{
+    return false;
+}
+
+void
+AudioReadStream::setDecodeThreadCount(int threads)
+{
+    m_decodeThreads = (threads < 1 ? 1 : threads);
+}
+
+void
+AudioReadStream::setSummarySink(AudioStreamSummary *summary)
+{
+    m_summary = summary;
+    if (m_summary) {
+        m_summary->reset(int(getRetrievalChannelCount()),
+                         int(getRetrievalSampleRate()));
+    }
+}
+
+bool
+AudioReadStream::isRealTimeSafe() const
+{
+    if (m_summary) {
+        return false;
+    }
+    if (m_retrievalRate != 0 &&
+        m_retrievalRate != getDecodeSampleRate()) {
+        return false;
+    }
+    if (!m_channelMap.empty() && !m_channelMapInDecoder) {
+        return false;
+    }
+    return isGetFramesRealTimeSafe();
+}
+
+void
+AudioReadStream::setStatisticsEnabled(bool enabled)
+{
+    delete m_statistics;
+    m_statistics = (enabled ? new AudioStreamStatistics : 0);
+}
+
+AudioStreamStatistics
+AudioReadStream::getStatistics() const
+{
+    if (m_statistics) return *m_statistics;
+    else return AudioStreamStatistics();
+}
+
+void
+AudioReadStream::resetStatistics()
+{
+    if (m_statistics) *m_statistics = AudioStreamStatistics();
+}
+
 size_t
 AudioReadStream::getInterleavedFrames(size_t count, float *frames)
+{
+    size_t got = retrieveInterleavedFrames(count, frames);
+
+    if (m_statistics) m_statistics->frames += got;
+    
+    if (m_summary) {
+        m_summary->addInterleavedFrames(frames, got);
+        // A short read can be followed by more audio, for example
+        // from a reader retrying after a decode error, so only a read
+        // that returns nothing marks the end - and not even that for
+        // a stream that may still be growing
+        if (got == 0 && count > 0 && !hasIncrementalSupport()) {
+            m_summary->finish();
+        }
+    }
+
+    return got;
+}
+
+size_t
+AudioReadStream::retrieveInterleavedFrames(size_t count, float *frames)
 {
     if (m_retrievalRate == 0 ||
-        m_retrievalRate == m_sampleRate ||
+        m_retrievalRate == getDecodeSampleRate() ||
         m_channelCount == 0) {
-        return getFrames(count, frames);
+        return getMappedFrames(count, frames);
     }
     
     // The resampler API works in ints - so we may have to do this in
@@ -143,7 +283,8 @@ AudioReadStream::getInterleavedFrames(size_t count, float *frames)
     // way to do it anyway. 
     static size_t chunkSizeSamples = 1000000;
 
-    size_t chunkFrames = chunkSizeSamples / m_channelCount;
+    size_t channels = getRetrievalChannelCount();
+    size_t chunkFrames = chunkSizeSamples / channels;
     size_t frameOffset = 0;
 
     while (frameOffset < count) {
@@ -152,7 +293,7 @@ AudioReadStream::getInterleavedFrames(size_t count, float *frames)
         if (n > chunkFrames) n = chunkFrames;
         
         int framesObtained = getResampledChunk
-            (int(n), frames + m_channelCount * frameOffset);
+            (int(n), frames + channels * frameOffset);
         
         if (framesObtained <= 0) {
             return frameOffset;
@@ -168,24 +309,96 @@ AudioReadStream::getInterleavedFrames(size_t count, float *frames)
     return count;
 }
 
+size_t
+AudioReadStream::getMappedFrames(size_t count, float *frames)
+{
+    if (m_channelMap.empty() || m_channelMapInDecoder) {
+        AudioStreamStatistics::Timer timer
+            (m_statistics, &AudioStreamStatistics::codecSeconds);
+        return getFrames(count, frames);
+    }
+
+    size_t inChannels = m_channelCount;
+    if (m_channelMapBuffer.size() < count * inChannels) {
+        m_channelMapBuffer.resize(count * inChannels);
+        countBuffer(m_channelMapBuffer.size() * sizeof(float));
+    }
+    const float *in = m_channelMapBuffer.data();
+    size_t got = 0;
+    {
+        AudioStreamStatistics::Timer timer
+            (m_statistics, &AudioStreamStatistics::codecSeconds);
+        got = getFrames(count, m_channelMapBuffer.data());
+    }
+
+    AudioStreamStatistics::Timer timer
+        (m_statistics, &AudioStreamStatistics::conversionSeconds);
+
+    size_t outChannels = m_channelMap.size();
+    for (size_t c = 0; c < outChannels; ++c) {
+        const std::vector<int> &sources = m_channelMap[c];
+        float *out = frames + c;
+        if (sources.empty()) {
+            for (size_t i = 0; i < got; ++i) {
+                out[i * outChannels] = 0.f;
+            }
+        } else if (sources.size() == 1) {
+            const float *src = in + sources[0];
+            for (size_t i = 0; i < got; ++i) {
+                out[i * outChannels] = src[i * inChannels];
+            }
+        } else {
+            float gain = 1.f / float(sources.size());
+            for (size_t i = 0; i < got; ++i) {
+                const float *src = in + i * inChannels;
+                float sum = 0.f;
+                for (int s: sources) {
+                    sum += src[s];
+                }
+                out[i * outChannels] = sum * gain;
+            }
+        }
+    }
+    
+    return got;
+}
+
+void
+AudioReadStream::growResampleBuffer(int size)
+{
+    RingBuffer<float> *grown = m_resampleBuffer->resized(size);
+    delete m_resampleBuffer;
+    m_resampleBuffer = grown;
+    countBuffer(m_resampleBuffer->getSize() * sizeof(float));
+}
+
 int
 AudioReadStream::getResampledChunk(int frameCount, float *frames)
 {
-    int channels = int(m_channelCount);
+    int channels = int(getRetrievalChannelCount());
 
     if (!m_resampler) {
         Resampler::Parameters params;
         params.quality = Resampler::FastestTolerable;
-        params.initialSampleRate = int(m_sampleRate);
+        params.initialSampleRate = int(getDecodeSampleRate());
         m_resampler = new Resampler(params, channels);
         m_resampleBuffer = new RingBuffer<float>(frameCount * channels);
+        countBuffer(m_resampleBuffer->getSize() * sizeof(float));
     }
 
-    double ratio = double(m_retrievalRate) / double(m_sampleRate);
+    double ratio = double(m_retrievalRate) / double(getDecodeSampleRate());
     int fileFrames = int(ceil(frameCount / ratio));
     
-    float *in  = allocate<float>(fileFrames * channels);
-    float *out = allocate<float>((frameCount + 1) * channels);
+    // Scratch buffers are kept between calls, and only grow, so that
+    // reading in blocks of a steady size does not allocate
+    if (m_resampleIn.size() < size_t(fileFrames * channels)) {
+        m_resampleIn.resize(fileFrames * channels);
+    }
+    if (m_resampleOut.size() < size_t((frameCount + 1) * channels)) {
+        m_resampleOut.resize((frameCount + 1) * channels);
+    }
+    float *in = m_resampleIn.data();
+    float *out = m_resampleOut.data();
 
     int samples = frameCount * channels;
     bool finished = false;
@@ -195,8 +408,7 @@ AudioReadStream::getResampledChunk(int frameCount, float *frames)
         if (finished) {
             int zeros = samples - m_resampleBuffer->getReadSpace();
             if (m_resampleBuffer->getWriteSpace() < zeros) {
-                m_resampleBuffer = m_resampleBuffer->resized
-                    (m_resampleBuffer->getSize() + samples);
+                growResampleBuffer(m_resampleBuffer->getSize() + samples);
             }
             m_resampleBuffer->zero(zeros);
             continue;
@@ -209,7 +421,7 @@ AudioReadStream::getResampledChunk(int frameCount, float *frames)
         int got = 0;
 
         if (!finished) {
-            got = int(getFrames(fileFramesToGet, in));
+            got = int(getMappedFrames(fileFramesToGet, in));
             m_totalFileFrames += got;
             if (got < fileFramesToGet) {
                 finished = true;
@@ -220,20 +432,21 @@ AudioReadStream::getResampledChunk(int frameCount, float *frames)
         }
         
         if (got > 0) {
-            int resampled = m_resampler->resampleInterleaved
-                (out, frameCount + 1, in, got, ratio, finished);
+            int resampled = 0;
+            {
+                AudioStreamStatistics::Timer timer
+                    (m_statistics, &AudioStreamStatistics::resampleSeconds);
+                resampled = m_resampler->resampleInterleaved
+                    (out, frameCount + 1, in, got, ratio, finished);
+            }
             if (m_resampleBuffer->getWriteSpace() < resampled * channels) {
-                int resizeTo = (m_resampleBuffer->getSize() +
-                                resampled * channels);
-                m_resampleBuffer = m_resampleBuffer->resized(resizeTo);
+                growResampleBuffer(m_resampleBuffer->getSize() +
+                                   resampled * channels);
             }
             m_resampleBuffer->write(out, resampled * channels);
         }
     }
 
-    deallocate(in);
-    deallocate(out);
-
     int toReturn = samples;
     int available = int(double(m_totalFileFrames) * ratio -
                         double(m_totalRetrievedFrames)) * channels;
@@ -35,9 +35,17 @@
 #include "../bqaudiostream/AudioReadStreamFactory.h"
 #include "../bqaudiostream/AudioReadStream.h"
 #include "../bqaudiostream/Exceptions.h"
+#include "CachedAudioReadStream.h"
+#include "SharedBlockReadStream.h"
 
 #include <bqthingfactory/ThingFactory.h>
 
+#include <mutex>
+#include <thread>
+#include <exception>
+#include <memory>
+#include <iostream>
+
 #define DEBUG_AUDIO_READ_STREAM_FACTORY 1
 
 namespace breakfastquay {
@@ -57,10 +65,10 @@ AudioReadStreamFactory::extensionOf(std::string audioFileName)
     return ext;
 }
 
-AudioReadStream *
-AudioReadStreamFactory::createReadStream(std::string audioFileName)
+static AudioReadStream *
+createUncachedReadStream(std::string audioFileName)
 {
-    std::string extension = extensionOf(audioFileName);
+    std::string extension = AudioReadStreamFactory::extensionOf(audioFileName);
 
     AudioReadStreamFactoryImpl *f = AudioReadStreamFactoryImpl::getInstance();
 
@@ -88,6 +96,41 @@ AudioReadStreamFactory::createReadStream(std::string audioFileName)
     }
 }
 
+// Formats that are expensive enough to decode to be worth keeping in
+// the decoded audio cache
+static bool
+isCacheableExtension(std::string extension)
+{
+    static const char *const cacheable[] = {
+        "mp3", "ogg", "oga", "opus", "flac", "m4a", "aac", "mp4", "wma"
+    };
+    for (const char *ext: cacheable) {
+        if (extension == ext) return true;
+    }
+    return false;
+}
+
+static AudioReadStream *
+createUnsharedReadStream(std::string audioFileName)
+{
+    if (isCacheableExtension(AudioReadStreamFactory::extensionOf(audioFileName)) &&
+        AudioReadStreamFactory::getDecodedAudioCacheDirectory() != "") {
+        return new CachedAudioReadStream(audioFileName,
+                                         createUncachedReadStream);
+    }
+    return createUncachedReadStream(audioFileName);
+}
+
+AudioReadStream *
+AudioReadStreamFactory::createReadStream(std::string audioFileName)
+{
+    if (getSharedBlockCacheSize() > 0) {
+        return new SharedBlockReadStream(audioFileName,
+                                         createUnsharedReadStream);
+    }
+    return createUnsharedReadStream(audioFileName);
+}
+
 std::vector<std::string>
 AudioReadStreamFactory::getSupportedFileExtensions()
 {
@@ -115,6 +158,159 @@ AudioReadStreamFactory::getFileFilter()
     return filter;
 }
 
+static size_t
+readRange(AudioReadStream *stream, size_t count, float *frames)
+{
+    size_t channels = stream->getChannelCount();
+    size_t obtained = 0;
+    while (obtained < count) {
+        size_t got = stream->getInterleavedFrames
+            (count - obtained, frames + obtained * channels);
+        if (got == 0) break;
+        obtained += got;
+    }
+    return obtained;
+}
+
+size_t
+AudioReadStreamFactory::readInterleavedFrames(std::string fileName,
+                                              size_t startFrame,
+                                              size_t frameCount,
+                                              float *frames,
+                                              int threadCount)
+{
+    std::unique_ptr<AudioReadStream> first(createReadStream(fileName));
+    size_t channels = first->getChannelCount();
+    if (channels == 0 || frameCount == 0) return 0;
+
+    // Not worth another reader for less than this
+    const size_t minFramesPerThread = 65536;
+    
+    if (threadCount > 1 && size_t(threadCount) > frameCount / minFramesPerThread) {
+        threadCount = int(frameCount / minFramesPerThread);
+    }
+    
+    if (!first->isSeekable() || threadCount < 2) {
+        if (startFrame > 0) {
+            if (first->isSeekable()) {
+                if (!first->seek(startFrame)) return 0;
+            } else {
+                // Read and discard up to the start
+                std::vector<float> discard(4096 * channels);
+                size_t skipped = 0;
+                while (skipped < startFrame) {
+                    size_t n = startFrame - skipped;
+                    if (n > 4096) n = 4096;
+                    size_t got = first->getInterleavedFrames(n, discard.data());
+                    if (got == 0) return 0;
+                    skipped += got;
+                }
+            }
+        }
+        return readRange(first.get(), frameCount, frames);
+    }
+
+    size_t per = frameCount / threadCount;
+    std::vector<size_t> obtained(threadCount, 0);
+    std::vector<std::exception_ptr> exceptions(threadCount);
+    std::vector<std::thread> workers;
+    workers.reserve(threadCount);
+
+    AudioReadStream *firstStream = first.release();
+    
+    for (int i = 0; i < threadCount; ++i) {
+        size_t offset = i * per;
+        size_t count = (i == threadCount - 1 ? frameCount - offset : per);
+        try {
+            workers.push_back(std::thread([=, &obtained, &exceptions]() {
+                        try {
+                            std::unique_ptr<AudioReadStream> stream
+                                (i == 0 ? firstStream : createReadStream(fileName));
+                            if (stream->seek(startFrame + offset)) {
+                                obtained[i] = readRange
+                                    (stream.get(), count, frames + offset * channels);
+                            }
+                        } catch (...) {
+                            exceptions[i] = std::current_exception();
+                        }
+                    }));
+        } catch (...) {
+            // Could not start this thread: the ones already running
+            // write into our locals, so wait for them before leaving
+            for (auto &w : workers) w.join();
+            if (i == 0) delete firstStream;
+            throw;
+        }
+    }
+
+    for (auto &w : workers) {
+        w.join();
+    }
+    
+    // Return the length of the contiguous run of audio read from the
+    // start of the range
+    size_t total = 0;
+    for (int i = 0; i < threadCount; ++i) {
+        if (exceptions[i]) {
+            std::rethrow_exception(exceptions[i]);
+        }
+        total += obtained[i];
+        size_t count = (i == threadCount - 1 ? frameCount - i * per : per);
+        if (obtained[i] < count) break;
+    }
+    return total;
+}
+
+static std::mutex seekIndexCacheMutex;
+static std::string seekIndexCacheDirectory;
+
+void
+AudioReadStreamFactory::setSeekIndexCacheDirectory(std::string directory)
+{
+    std::lock_guard<std::mutex> guard(seekIndexCacheMutex);
+    seekIndexCacheDirectory = directory;
+}
+
+std::string
+AudioReadStreamFactory::getSeekIndexCacheDirectory()
+{
+    std::lock_guard<std::mutex> guard(seekIndexCacheMutex);
+    return seekIndexCacheDirectory;
+}
+
+void
+AudioReadStreamFactory::setDecodedAudioCache(std::string directory,
+                                             size_t maxBytes)
+{
+#ifdef _WIN32
+    if (directory != "") {
+        std::cerr << "WARNING: AudioReadStreamFactory::setDecodedAudioCache: "
+                  << "Decoded audio cache is not supported on this platform"
+                  << std::endl;
+    }
+#else
+    CachedAudioReadStream::setCache(directory, maxBytes);
+#endif
+}
+
+std::string
+AudioReadStreamFactory::getDecodedAudioCacheDirectory()
+{
+    return CachedAudioReadStream::getCacheDirectory();
+}
+
+void
+AudioReadStreamFactory::setSharedBlockCacheSize(size_t maxBytes)
+{
+    SharedBlockReadStream::setCacheSize(maxBytes);
+}
+
+size_t
+AudioReadStreamFactory::getSharedBlockCacheSize()
+{
+    return SharedBlockReadStream::getCacheSize();
+}
+
 }
 
 // We rather eccentrically include the C++ files here, not the
@@ -159,7 +355,7 @@ AudioReadStreamFactory::getFileFilter()
 // people using Windows expect
 #include "MediaFoundationReadStream.cpp"
 
-// MiniMP3ReadStream seems decent but lacks ID3 support, so in
-// practice is not as good as the platform frameworks
+// MiniMP3ReadStream seems decent, but its tag support (our own) is
+// basic, so in practice it is not as good as the platform frameworks
 #include "MiniMP3ReadStream.cpp"
 
@@ -0,0 +1,320 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudiostream
+
+    A small library wrapping various audio file read/write
+    implementations in C++.
+
+    Copyright 2007-2022 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#include "../bqaudiostream/AudioStreamPipeline.h"
+#include "../bqaudiostream/AudioReadStream.h"
+#include "../bqaudiostream/AudioWriteStream.h"
+
+#include "bqresample/Resampler.h"
+
+#include <bqvec/RingBuffer.h>
+#include <bqvec/Allocators.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <stdexcept>
+#include <vector>
+#include <cmath>
+
+namespace breakfastquay
+{
+
+class AudioStreamPipeline::D
+{
+public:
+    struct Block {
+        float *data;
+        size_t frames;
+        bool last;
+    };
+
+    // A single-producer single-consumer queue of blocks. The ring
+    // buffer is lock-free; the mutex and condition are used only to
+    // sleep when the queue is empty or full, and waits time out so
+    // that a missed notification can't stall the pipeline
+    class Queue {
+    public:
+        Queue(int size, std::atomic<bool> &abandoned) :
+            m_ring(size), m_abandoned(abandoned) { }
+        
+        bool push(Block *b) {
+            while (m_ring.getWriteSpace() == 0) {
+                if (m_abandoned) return false;
+                std::unique_lock<std::mutex> lock(m_mutex);
+                if (m_ring.getWriteSpace() > 0) break;
+                m_cond.wait_for(lock, std::chrono::milliseconds(10));
+            }
+            m_ring.writeOne(b);
+            m_cond.notify_all();
+            return true;
+        }
+        
+        Block *pop() {
+            while (m_ring.getReadSpace() == 0) {
+                if (m_abandoned) return 0;
+                std::unique_lock<std::mutex> lock(m_mutex);
+                if (m_ring.getReadSpace() > 0) break;
+                m_cond.wait_for(lock, std::chrono::milliseconds(10));
+            }
+            Block *b = m_ring.readOne();
+            m_cond.notify_all();
+            return b;
+        }
+        
+    private:
+        RingBuffer<Block *> m_ring;
+        std::atomic<bool> &m_abandoned;
+        std::mutex m_mutex;
+        std::condition_variable m_cond;
+    };
+
+    // A pool of blocks and the pair of queues for passing them from
+    // one stage to the next and back again
+    class Link {
+    public:
+        Link(int blocks, size_t samples, std::atomic<bool> &abandoned) :
+            full(blocks + 1, abandoned),
+            empty(blocks + 1, abandoned) {
+            for (int i = 0; i < blocks; ++i) {
+                Block *b = new Block;
+                b->data = allocate<float>(samples);
+                b->frames = 0;
+                b->last = false;
+                m_blocks.push_back(b);
+                empty.push(b);
+            }
+        }
+        ~Link() {
+            for (Block *b: m_blocks) {
+                deallocate(b->data);
+                delete b;
+            }
+        }
+        Queue full;
+        Queue empty;
+    private:
+        std::vector<Block *> m_blocks;
+    };
+    
+    D(AudioReadStream *s, AudioWriteStream *t, int bf, int qb) :
+        source(s), target(t), blockFrames(bf), queueBlocks(qb),
+        abandoned(false), written(0) { }
+
+    AudioReadStream *source;
+    AudioWriteStream *target;
+    int blockFrames;
+    int queueBlocks;
+
+    std::atomic<bool> abandoned;
+    std::mutex exceptionMutex;
+    std::exception_ptr exception;
+    size_t written;
+
+    void fail() {
+        std::lock_guard<std::mutex> guard(exceptionMutex);
+        if (!exception) exception = std::current_exception();
+        abandoned = true;
+    }
+
+    void decode(Link &out) {
+        try {
+            while (true) {
+                Block *b = out.empty.pop();
+                if (!b) return;
+                b->frames = source->getInterleavedFrames(blockFrames, b->data);
+                b->last = (b->frames < size_t(blockFrames));
+                if (!out.full.push(b) || b->last) return;
+            }
+        } catch (...) {
+            fail();
+        }
+    }
+
+    void resample(Link &in, Link &out, int channels,
+                  double inRate, double ratio, int outCapacity) {
+        try {
+            Resampler::Parameters params;
+            params.quality = Resampler::FastestTolerable;
+            params.initialSampleRate = inRate;
+            params.maxBufferSize = blockFrames;
+            Resampler resampler(params, channels);
+            
+            std::vector<float> zeros(size_t(blockFrames) * channels, 0.f);
+            size_t totalIn = 0, totalOut = 0;
+            
+            while (true) {
+                Block *ib = in.full.pop();
+                if (!ib) return;
+                Block *ob = out.empty.pop();
+                if (!ob) return;
+                
+                totalIn += ib->frames;
+                bool last = ib->last;
+                ob->frames = resampler.resampleInterleaved
+                    (ob->data, outCapacity, ib->data, int(ib->frames),
+                     ratio, last);
+                if (!in.empty.push(ib)) return;
+
+                if (!last) {
+                    ob->last = false;
+                    totalOut += ob->frames;
+                    if (!out.full.push(ob)) return;
+                    continue;
+                }
+
+                // At the end, push silence through until the
+                // resampler's latency has been flushed out, and
+                // trim to the expected length
+                size_t expected = size_t(round(double(totalIn) * ratio));
+                int idle = 0;
+                while (totalOut + ob->frames < expected) {
+                    if (ob->frames == 0 && ++idle > 4) break;
+                    totalOut += ob->frames;
+                    ob->last = false;
+                    if (!out.full.push(ob)) return;
+                    ob = out.empty.pop();
+                    if (!ob) return;
+                    ob->frames = resampler.resampleInterleaved
+                        (ob->data, outCapacity, zeros.data(), blockFrames,
+                         ratio, true);
+                }
+                if (totalOut + ob->frames > expected) {
+                    ob->frames = expected - totalOut;
+                }
+                ob->last = true;
+                out.full.push(ob);
+                return;
+            }
+        } catch (...) {
+            fail();
+        }
+    }
+
+    void encode(Link &in) {
+        try {
+            while (true) {
+                Block *b = in.full.pop();
+                if (!b) return;
+                if (b->frames > 0) {
+                    target->putInterleavedFrames(b->frames, b->data);
+                    written += b->frames;
+                }
+                bool last = b->last;
+                if (!in.empty.push(b) || last) return;
+            }
+        } catch (...) {
+            fail();
+        }
+    }
+};
+
+AudioStreamPipeline::AudioStreamPipeline(AudioReadStream *source,
+                                         AudioWriteStream *target,
+                                         int blockFrames,
+                                         int queueBlocks) :
+    m_d(new D(source, target,
+              blockFrames < 1 ? 1 : blockFrames,
+              queueBlocks < 1 ? 1 : queueBlocks))
+{
+}
+
+AudioStreamPipeline::~AudioStreamPipeline()
+{
+    delete m_d;
+}
+
+size_t
+AudioStreamPipeline::run()
+{
+    int channels = int(m_d->source->getRetrievalChannelCount());
+    if (channels != int(m_d->target->getChannelCount())) {
+        throw std::invalid_argument
+            ("source and target channel counts differ");
+    }
+    if (channels == 0) {
+        return 0;
+    }
+
+    m_d->abandoned = false;
+    m_d->exception = std::exception_ptr();
+    m_d->written = 0;
+    
+    double inRate = double(m_d->source->getRetrievalSampleRate());
+    double outRate = double(m_d->target->getSampleRate());
+    
+    D::Link decoded(m_d->queueBlocks,
+                    size_t(m_d->blockFrames) * channels,
+                    m_d->abandoned);
+
+    if (inRate == outRate) {
+        std::thread decoder([&]() { m_d->decode(decoded); });
+        m_d->encode(decoded);
+        decoder.join();
+    } else {
+        double ratio = outRate / inRate;
+        int outCapacity = int(ceil(m_d->blockFrames * ratio)) + 64;
+        D::Link resampled(m_d->queueBlocks,
+                          size_t(outCapacity) * channels,
+                          m_d->abandoned);
+        std::thread decoder([&]() { m_d->decode(decoded); });
+        std::thread resampler;
+        try {
+            resampler = std::thread([&]() {
+                    m_d->resample(decoded, resampled, channels,
+                                  inRate, ratio, outCapacity);
+                });
+        } catch (...) {
+            // The decoder must not outlive the queues it is using,
+            // and a joinable thread can't be destroyed
+            m_d->abandoned = true;
+            decoder.join();
+            throw;
+        }
+        m_d->encode(resampled);
+        resampler.join();
+        decoder.join();
+    }
+
+    if (m_d->exception) {
+        std::rethrow_exception(m_d->exception);
+    }
+    
+    return m_d->written;
+}
+
+}
+
@@ -0,0 +1,421 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudiostream
+
+    A small library wrapping various audio file read/write
+    implementations in C++.
+
+    Copyright 2007-2022 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#include "../bqaudiostream/AudioStreamSummary.h"
+#include "../bqaudiostream/Exceptions.h"
+
+#include <fstream>
+#include <iterator>
+#include <cmath>
+#include <cfloat>
+#include <cstdint>
+#include <cstring>
+
+#if defined(__SSE__) || defined(_M_X64)
+#include <xmmintrin.h>
+#define BQ_SUMMARY_USE_SSE 1
+#endif
+
+using namespace std;
+
+namespace breakfastquay
+{
+
+static const char summaryMagic[8] = { 'b', 'q', 's', 'u', 'm', 'm', '2', 0 };
+
+// Fold n contiguous samples into a running min, max and sum of
+// squares
+static void
+summariseSamples(const float *p, int n, float &mn, float &mx, double &ss)
+{
+    int i = 0;
+    float sum = 0.f;
+    
+#ifdef BQ_SUMMARY_USE_SSE
+    if (n >= 4) {
+        __m128 vmn = _mm_set1_ps(mn);
+        __m128 vmx = _mm_set1_ps(mx);
+        __m128 vss = _mm_setzero_ps();
+        for (; i + 4 <= n; i += 4) {
+            __m128 v = _mm_loadu_ps(p + i);
+            vmn = _mm_min_ps(vmn, v);
+            vmx = _mm_max_ps(vmx, v);
+            vss = _mm_add_ps(vss, _mm_mul_ps(v, v));
+        }
+        float a[4], b[4], c[4];
+        _mm_storeu_ps(a, vmn);
+        _mm_storeu_ps(b, vmx);
+        _mm_storeu_ps(c, vss);
+        for (int j = 0; j < 4; ++j) {
+            if (a[j] < mn) mn = a[j];
+            if (b[j] > mx) mx = b[j];
+            sum += c[j];
+        }
+    }
+#endif
+
+    for (; i < n; ++i) {
+        float v = p[i];
+        if (v < mn) mn = v;
+        if (v > mx) mx = v;
+        sum += v * v;
+    }
+
+    ss += sum;
+}
+
+AudioStreamSummary::AudioStreamSummary(int baseBinFrames,
+                                       int levelFactor,
+                                       int levelCount) :
+    m_baseBinFrames(baseBinFrames < 1 ? 1 : baseBinFrames),
+    m_levelFactor(levelFactor < 2 ? 2 : levelFactor),
+    m_levelCount(levelCount < 1 ? 1 : levelCount),
+    m_channelCount(0),
+    m_sampleRate(0),
+    m_frameCount(0),
+    m_complete(false)
+{
+}
+
+void
+AudioStreamSummary::clear(Accumulator &acc)
+{
+    acc.min = FLT_MAX;
+    acc.max = -FLT_MAX;
+    acc.sumsq = 0.0;
+    acc.frames = 0;
+}
+
+void
+AudioStreamSummary::reset(int channelCount, int sampleRate)
+{
+    m_channelCount = channelCount;
+    m_sampleRate = sampleRate;
+    m_frameCount = 0;
+    m_complete = false;
+    m_bins = vector<vector<Bin> >(m_levelCount);
+    m_acc = vector<Accumulator>(m_levelCount * m_channelCount);
+    for (auto &acc: m_acc) clear(acc);
+    m_accBins = vector<int>(m_levelCount, 0);
+    m_scratch = vector<float>(size_t(m_baseBinFrames) * m_channelCount);
+}
+
+void
+AudioStreamSummary::addInterleavedFrames(const float *frames, size_t count)
+{
+    if (m_complete || m_channelCount == 0) return;
+
+    int channels = m_channelCount;
+    size_t done = 0;
+    
+    while (done < count) {
+
+        // Take frames up to the end of the current base bin, and
+        // de-interleave them so each channel can be summarised with
+        // a contiguous run
+        size_t n = count - done;
+        size_t space = m_baseBinFrames - m_acc[0].frames;
+        if (n > space) n = space;
+
+        const float *in = frames + done * channels;
+        for (int c = 0; c < channels; ++c) {
+            float *out = m_scratch.data() + c * m_baseBinFrames;
+            for (size_t i = 0; i < n; ++i) {
+                out[i] = in[i * channels + c];
+            }
+            Accumulator &acc = m_acc[c];
+            summariseSamples(out, int(n), acc.min, acc.max, acc.sumsq);
+            acc.frames += n;
+        }
+
+        done += n;
+        m_frameCount += n;
+        
+        if (m_acc[0].frames == size_t(m_baseBinFrames)) {
+            emit(0);
+        }
+    }
+}
+
+void
+AudioStreamSummary::emit(int level)
+{
+    int channels = m_channelCount;
+    bool propagate = (level + 1 < m_levelCount);
+    
+    for (int c = 0; c < channels; ++c) {
+        Accumulator &acc = m_acc[level * channels + c];
+        Bin bin;
+        bin.min = acc.min;
+        bin.max = acc.max;
+        bin.rms = float(sqrt(acc.sumsq / double(acc.frames)));
+        m_bins[level].push_back(bin);
+        if (propagate) {
+            Accumulator &next = m_acc[(level + 1) * channels + c];
+            if (acc.min < next.min) next.min = acc.min;
+            if (acc.max > next.max) next.max = acc.max;
+            next.sumsq += acc.sumsq;
+            next.frames += acc.frames;
+        }
+        clear(acc);
+    }
+
+    if (propagate) {
+        if (++m_accBins[level + 1] == m_levelFactor) {
+            m_accBins[level + 1] = 0;
+            emit(level + 1);
+        }
+    }
+}
+
+void
+AudioStreamSummary::finish()
+{
+    if (m_complete || m_channelCount == 0) return;
+
+    // Flushing a partial bin at one level adds to the next, so go
+    // from the bottom up
+    for (int level = 0; level < m_levelCount; ++level) {
+        if (m_acc[level * m_channelCount].frames > 0) {
+            m_accBins[level] = 0;
+            emit(level);
+        }
+    }
+
+    m_complete = true;
+}
+
+size_t
+AudioStreamSummary::getBinFrames(int level) const
+{
+    size_t frames = m_baseBinFrames;
+    for (int i = 0; i < level; ++i) frames *= m_levelFactor;
+    return frames;
+}
+
+size_t
+AudioStreamSummary::getBinCount(int level) const
+{
+    if (level < 0 || level >= int(m_bins.size()) || m_channelCount == 0) {
+        return 0;
+    }
+    return m_bins[level].size() / m_channelCount;
+}
+
+AudioStreamSummary::Bin
+AudioStreamSummary::getBin(int level, int channel, size_t index) const
+{
+    if (index >= getBinCount(level) ||
+        channel < 0 || channel >= m_channelCount) {
+        Bin empty = { 0.f, 0.f, 0.f };
+        return empty;
+    }
+    return m_bins[level][index * m_channelCount + channel];
+}
+
+static void
+putU16(vector<unsigned char> &out, unsigned int v)
+{
+    out.push_back(v & 0xff);
+    out.push_back((v >> 8) & 0xff);
+}
+
+static void
+putU32(vector<unsigned char> &out, uint32_t v)
+{
+    for (int i = 0; i < 4; ++i) out.push_back((v >> (i * 8)) & 0xff);
+}
+
+static void
+putU64(vector<unsigned char> &out, uint64_t v)
+{
+    for (int i = 0; i < 8; ++i) out.push_back((v >> (i * 8)) & 0xff);
+}
+
+// Values are stored as fractions of a per-file scale, which is the
+// largest magnitude in the summary (or 1 if nothing exceeds it), so
+// that over-range peaks survive a round trip
+
+static int
+quantiseDown(float v, float scale)
+{
+    v /= scale;
+    if (!(v > -1.f)) return -32767;
+    if (v >= 1.f) return 32767;
+    return int(floor(v * 32767.f));
+}
+
+static int
+quantiseUp(float v, float scale)
+{
+    v /= scale;
+    if (!(v < 1.f)) return 32767;
+    if (v <= -1.f) return -32767;
+    return int(ceil(v * 32767.f));
+}
+
+void
+AudioStreamSummary::save(string path) const
+{
+    float scale = 1.f;
+    for (const auto &level: m_bins) {
+        for (const Bin &bin: level) {
+            if (-bin.min > scale) scale = -bin.min;
+            if (bin.max > scale) scale = bin.max;
+            if (bin.rms > scale) scale = bin.rms;
+        }
+    }
+    if (!(scale <= FLT_MAX)) scale = FLT_MAX;
+    uint32_t scaleBits;
+    memcpy(&scaleBits, &scale, 4);
+    
+    vector<unsigned char> out(summaryMagic, summaryMagic + 8);
+    putU32(out, m_channelCount);
+    putU32(out, m_sampleRate);
+    putU32(out, m_baseBinFrames);
+    putU32(out, m_levelFactor);
+    putU32(out, m_levelCount);
+    putU64(out, m_frameCount);
+    putU32(out, scaleBits);
+
+    for (int level = 0; level < m_levelCount; ++level) {
+        size_t n = (level < int(m_bins.size()) ? m_bins[level].size() : 0);
+        putU64(out, getBinCount(level));
+        for (size_t i = 0; i < n; ++i) {
+            const Bin &bin = m_bins[level][i];
+            putU16(out, uint16_t(int16_t(quantiseDown(bin.min, scale))));
+            putU16(out, uint16_t(int16_t(quantiseUp(bin.max, scale))));
+            float rms = bin.rms / scale;
+            if (!(rms < 1.f)) rms = 1.f;
+            putU16(out, unsigned(ceil(rms * 65535.f)));
+        }
+    }
+
+    ofstream file(path.c_str(), ios::out | ios::binary | ios::trunc);
+    if (!file) {
+        throw FailedToWriteFile(path);
+    }
+    file.write(reinterpret_cast<const char *>(out.data()), out.size());
+    file.close();
+    if (!file) {
+        throw FailedToWriteFile(path);
+    }
+}
+
+AudioStreamSummary
+AudioStreamSummary::load(string path)
+{
+    ifstream file(path.c_str(), ios::in | ios::binary);
+    if (!file) {
+        throw FileNotFound(path);
+    }
+    vector<unsigned char> in((istreambuf_iterator<char>(file)),
+                             istreambuf_iterator<char>());
+
+    size_t pos = 0;
+    auto need = [&](size_t n) {
+        if (in.size() - pos < n) {
+            throw InvalidFileFormat(path, "summary file is truncated");
+        }
+    };
+    auto getU = [&](int bytes) {
+        need(bytes);
+        uint64_t v = 0;
+        for (int i = 0; i < bytes; ++i) v |= uint64_t(in[pos++]) << (i * 8);
+        return v;
+    };
+
+    need(8);
+    if (memcmp(in.data(), summaryMagic, 8)) {
+        throw InvalidFileFormat(path, "not an audio summary file");
+    }
+    pos = 8;
+
+    int channels = int(getU(4));
+    int rate = int(getU(4));
+    int baseBinFrames = int(getU(4));
+    int levelFactor = int(getU(4));
+    int levelCount = int(getU(4));
+    if (channels < 1 || baseBinFrames < 1 || levelFactor < 2 ||
+        levelCount < 1 || levelCount > 64) {
+        throw InvalidFileFormat(path, "invalid summary parameters");
+    }
+
+    uint64_t frameCount = getU(8);
+
+    uint32_t scaleBits = uint32_t(getU(4));
+    float scale;
+    memcpy(&scale, &scaleBits, 4);
+    if (!(scale >= 1.f && scale <= FLT_MAX)) {
+        throw InvalidFileFormat(path, "invalid summary scale");
+    }
+
+    // Check the sizes in the header against what the file holds
+    // before allocating anything from them. Each whole base bin of
+    // frames has a bin per channel at the lowest level
+    uint64_t binBytes = uint64_t(channels) * 6;
+    auto haveBins = [&](uint64_t bins) {
+        return bins <= uint64_t(in.size() - pos) / binBytes;
+    };
+    if (!haveBins(frameCount / uint64_t(baseBinFrames))) {
+        throw InvalidFileFormat(path, "summary file is truncated");
+    }
+
+    // A loaded summary is complete, so it needs none of the
+    // accumulators or scratch space that reset() would allocate
+    AudioStreamSummary summary(baseBinFrames, levelFactor, levelCount);
+    summary.m_channelCount = channels;
+    summary.m_sampleRate = rate;
+    summary.m_frameCount = size_t(frameCount);
+    summary.m_bins = vector<vector<Bin> >(levelCount);
+    
+    for (int level = 0; level < levelCount; ++level) {
+        uint64_t bins = getU(8);
+        if (!haveBins(bins)) {
+            throw InvalidFileFormat(path, "summary file is truncated");
+        }
+        vector<Bin> &target = summary.m_bins[level];
+        target.resize(size_t(bins) * channels);
+        for (size_t i = 0; i < target.size(); ++i) {
+            target[i].min = float(int16_t(getU(2))) / 32767.f * scale;
+            target[i].max = float(int16_t(getU(2))) / 32767.f * scale;
+            target[i].rms = float(getU(2)) / 65535.f * scale;
+        }
+    }
+
+    summary.m_complete = true;
+    return summary;
+}
+
+}
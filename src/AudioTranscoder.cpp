@@ -0,0 +1,327 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudiostream
+
+    A small library wrapping various audio file read/write
+    implementations in C++.
+
+    Copyright 2007-2022 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#include "../bqaudiostream/AudioTranscoder.h"
+#include "../bqaudiostream/AudioReadStream.h"
+#include "../bqaudiostream/AudioReadStreamFactory.h"
+#include "../bqaudiostream/AudioWriteStreamFactory.h"
+
+#include <bqvec/Allocators.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <chrono>
+#include <memory>
+#include <exception>
+#include <system_error>
+
+namespace breakfastquay
+{
+
+// Takes blocks of audio and writes them to a stream on its own
+// thread, one at a time, so that the caller can read the next block
+// while this one is being encoded
+class TranscodeEncoder
+{
+public:
+    TranscodeEncoder(AudioWriteStream *stream) :
+        m_stream(stream),
+        m_pending(0),
+        m_pendingFrames(0),
+        m_finishing(false),
+        m_thread([this]() { run(); }) { }
+
+    ~TranscodeEncoder() {
+        if (m_thread.joinable()) {
+            try {
+                finish();
+            } catch (...) { }
+        }
+    }
+
+    // Hand over a block. Waits until the previous one has been
+    // written, so the caller may reuse that one's buffer as soon as
+    // this returns. The block must remain valid until the next call
+    // to submit() or finish().
+    void submit(const float *block, size_t frames) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [this]() { return m_pending == 0; });
+        if (m_exception) {
+            std::rethrow_exception(m_exception);
+        }
+        m_pending = block;
+        m_pendingFrames = frames;
+        m_cond.notify_all();
+    }
+
+    void finish() {
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cond.wait(lock, [this]() { return m_pending == 0; });
+            m_finishing = true;
+            m_cond.notify_all();
+        }
+        m_thread.join();
+        if (m_exception) {
+            std::rethrow_exception(m_exception);
+        }
+    }
+    
+private:
+    AudioWriteStream *m_stream;
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    const float *m_pending;
+    size_t m_pendingFrames;
+    bool m_finishing;
+    std::exception_ptr m_exception;
+    std::thread m_thread;
+    
+    void run() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true) {
+            m_cond.wait(lock, [this]() { return m_pending || m_finishing; });
+            if (!m_pending) break;
+            lock.unlock();
+            try {
+                if (!m_exception) {
+                    m_stream->putInterleavedFrames(m_pendingFrames, m_pending);
+                }
+            } catch (...) {
+                m_exception = std::current_exception();
+            }
+            lock.lock();
+            m_pending = 0;
+            m_cond.notify_all();
+        }
+    }
+};
+
+AudioTranscoder::Result
+AudioTranscoder::transcode(const Job &job, int blockSize)
+{
+    Result result;
+    result.job = job;
+
+    auto start = std::chrono::steady_clock::now();
+
+    float *buffers[2] = { 0, 0 };
+    
+    try {
+        std::unique_ptr<AudioReadStream> rs
+            (AudioReadStreamFactory::createReadStream(job.source));
+
+        size_t rate = job.sampleRate;
+        if (rate == 0) {
+            rate = rs->getSampleRate();
+        } else {
+            rs->setRetrievalSampleRate(rate);
+        }
+
+        if (!job.channelMap.empty()) {
+            // Applied before resampling, so we only resample the
+            // channels we're writing
+            rs->setRetrievalChannelMap(job.channelMap);
+        }
+        int channels = int(rs->getRetrievalChannelCount());
+
+        std::unique_ptr<AudioWriteStream> ws
+            (AudioWriteStreamFactory::createWriteStream
+             (job.destination, channels, rate, job.options));
+
+        for (int i = 0; i < 2; ++i) {
+            buffers[i] = allocate<float>(size_t(blockSize) * channels);
+        }
+        
+        {
+            TranscodeEncoder encoder(ws.get());
+            int current = 0;
+            while (true) {
+                size_t got = rs->getInterleavedFrames(blockSize, buffers[current]);
+                if (got > 0) {
+                    encoder.submit(buffers[current], got);
+                    result.frames += got;
+                    current = 1 - current;
+                }
+                if (got < size_t(blockSize)) break;
+            }
+            encoder.finish();
+        }
+
+        // Close the file before we count the time
+        ws.reset();
+        
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        result.seconds = elapsed.count();
+        if (result.seconds > 0.0) {
+            result.realTimeFactor =
+                (double(result.frames) / double(rate)) / result.seconds;
+        }
+        result.succeeded = true;
+        
+    } catch (const std::exception &e) {
+        result.error = e.what();
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        result.seconds = elapsed.count();
+    } catch (...) {
+        result.error = "Unknown error";
+        std::chrono::duration<double> elapsed =
+            std::chrono::steady_clock::now() - start;
+        result.seconds = elapsed.count();
+    }
+
+    for (int i = 0; i < 2; ++i) {
+        if (buffers[i]) deallocate(buffers[i]);
+    }
+    
+    return result;
+}
+
+class AudioTranscoder::D
+{
+public:
+    D(int threads) : threadCount(threads), blockSize(16384) {
+        if (threadCount < 1) {
+            threadCount = int(std::thread::hardware_concurrency());
+            if (threadCount < 1) threadCount = 1;
+        }
+    }
+
+    int threadCount;
+    int blockSize;
+
+    // One queue of job indices per worker. A worker takes from the
+    // front of its own queue, and steals from the back of another's
+    // when its own is empty
+    struct Queue {
+        std::mutex mutex;
+        std::deque<size_t> jobs;
+    };
+
+    bool take(std::vector<std::unique_ptr<Queue>> &queues, int worker,
+              size_t &job) {
+        {
+            Queue &own = *queues[worker];
+            std::lock_guard<std::mutex> guard(own.mutex);
+            if (!own.jobs.empty()) {
+                job = own.jobs.front();
+                own.jobs.pop_front();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues.size(); ++i) {
+            Queue &other = *queues[(worker + i) % queues.size()];
+            std::lock_guard<std::mutex> guard(other.mutex);
+            if (!other.jobs.empty()) {
+                job = other.jobs.back();
+                other.jobs.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+};
+
+AudioTranscoder::AudioTranscoder(int threadCount) :
+    m_d(new D(threadCount))
+{
+}
+
+AudioTranscoder::~AudioTranscoder()
+{
+    delete m_d;
+}
+
+void
+AudioTranscoder::setBlockSize(int frames)
+{
+    m_d->blockSize = (frames < 1 ? 1 : frames);
+}
+
+std::vector<AudioTranscoder::Result>
+AudioTranscoder::run(const std::vector<Job> &jobs)
+{
+    std::vector<Result> results(jobs.size());
+    if (jobs.empty()) return results;
+
+    int workers = m_d->threadCount;
+    if (size_t(workers) > jobs.size()) workers = int(jobs.size());
+
+    std::vector<std::unique_ptr<D::Queue>> queues;
+    for (int i = 0; i < workers; ++i) {
+        queues.push_back(std::unique_ptr<D::Queue>(new D::Queue));
+    }
+    for (size_t j = 0; j < jobs.size(); ++j) {
+        queues[j % workers]->jobs.push_back(j);
+    }
+
+    int blockSize = m_d->blockSize;
+    std::vector<std::thread> threads;
+    threads.reserve(workers);
+    for (int i = 0; i < workers; ++i) {
+        try {
+            threads.push_back(std::thread([&, i]() {
+                        size_t j;
+                        while (m_d->take(queues, i, j)) {
+                            results[j] = transcode(jobs[j], blockSize);
+                        }
+                    }));
+        } catch (const std::system_error &) {
+            break;
+        }
+    }
+
+    // If we could not start every worker, work through the rest of
+    // the queues here: take() steals from the other queues once the
+    // one we name is empty, so nothing is left behind
+    if (threads.size() < size_t(workers)) {
+        size_t j;
+        while (m_d->take(queues, int(threads.size()), j)) {
+            results[j] = transcode(jobs[j], blockSize);
+        }
+    }
+    
+    for (auto &t : threads) {
+        t.join();
+    }
+
+    return results;
+}
+
+}
+
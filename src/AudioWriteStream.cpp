@@ -0,0 +1,117 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudiostream
+
+    A small library wrapping various audio file read/write
+    implementations in C++.
+
+    Copyright 2007-2022 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#include "../bqaudiostream/AudioWriteStream.h"
+
+namespace breakfastquay
+{
+
+AudioWriteStream::AudioWriteStream(Target t) :
+    m_target(t),
+    m_statistics(0),
+    m_framesSinceSync(0),
+    m_lastSync(std::chrono::steady_clock::now())
+{
+}
+
+AudioWriteStream::~AudioWriteStream()
+{
+    delete m_statistics;
+}
+
+void
+AudioWriteStream::setStatisticsEnabled(bool enabled)
+{
+    delete m_statistics;
+    m_statistics = (enabled ? new AudioStreamStatistics : 0);
+}
+
+AudioStreamStatistics
+AudioWriteStream::getStatistics() const
+{
+    if (m_statistics) return *m_statistics;
+    else return AudioStreamStatistics();
+}
+
+void
+AudioWriteStream::resetStatistics()
+{
+    if (m_statistics) *m_statistics = AudioStreamStatistics();
+}
+
+bool
+AudioWriteStream::isSyncDue(size_t count)
+{
+    m_framesSinceSync += count;
+
+    const Options &options = getOptions();
+    
+    switch (options.durability) {
+
+    case Options::SyncByFrameCount:
+        return m_framesSinceSync > size_t(options.syncFrameCount);
+
+    case Options::SyncByTime:
+        if (m_framesSinceSync == 0) {
+            return false;
+        } else {
+            std::chrono::duration<double, std::milli> elapsed =
+                std::chrono::steady_clock::now() - m_lastSync;
+            return elapsed.count() >= options.syncIntervalMs;
+        }
+
+    case Options::SyncOnFlushOnly:
+    case Options::SyncNever:
+        return false;
+    }
+
+    return false;
+}
+
+bool
+AudioWriteStream::shouldSyncOnFlush() const
+{
+    return getOptions().durability != Options::SyncNever;
+}
+
+void
+AudioWriteStream::syncDone()
+{
+    m_framesSinceSync = 0;
+    m_lastSync = std::chrono::steady_clock::now();
+    if (m_statistics) ++m_statistics->syncs;
+}
+
+}
+
@@ -53,10 +53,21 @@ AudioWriteStream *
 AudioWriteStreamFactory::createWriteStream(std::string audioFileName,
                                            size_t channelCount,
                                            size_t sampleRate)
+{
+    return createWriteStream(audioFileName, channelCount, sampleRate,
+                             AudioWriteStream::Options());
+}
+
+AudioWriteStream *
+AudioWriteStreamFactory::createWriteStream(std::string audioFileName,
+                                           size_t channelCount,
+                                           size_t sampleRate,
+                                           const AudioWriteStream::Options &options)
 {
     std::string extension = AudioReadStreamFactory::extensionOf(audioFileName);
     
-    AudioWriteStream::Target target(audioFileName, channelCount, sampleRate);
+    AudioWriteStream::Target target(audioFileName, channelCount, sampleRate,
+                                    options);
 
     AudioWriteStreamFactoryImpl *f = AudioWriteStreamFactoryImpl::getInstance();
 
@@ -69,7 +80,15 @@ AudioWriteStreamFactory::createWriteStream(std::string audioFileName,
     }
     
     try {
-        AudioWriteStream *stream = f->createFor(extension, target);
+        AudioWriteStream *stream = 0;
+        if (options.directIO && extension == "wav") {
+            // Only our own WAV writer supports direct I/O
+            stream = f->create
+                ("http://breakfastquay.com/rdf/turbot/audiostream/SimpleWavFileWriteStream",
+                 target);
+        } else {
+            stream = f->createFor(extension, target);
+        }
         if (!stream) throw FailedToWriteFile(audioFileName);
         return stream;
     } catch (const UnknownTagException &) {
@@ -0,0 +1,541 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudiostream
+
+    A small library wrapping various audio file read/write
+    implementations in C++.
+
+    Copyright 2007-2022 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#include "CachedAudioReadStream.h"
+#include "../bqaudiostream/AudioReadStreamFactory.h"
+
+#include <mutex>
+#include <vector>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <iostream>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#endif
+
+namespace breakfastquay
+{
+
+static std::mutex decodedCacheMutex;
+static std::string decodedCacheDirectory;
+static size_t decodedCacheMaxBytes = 0;
+
+// Cache files are private to this machine, so the header and sample
+// data are simply in host byte order. The check word catches a cache
+// directory shared with a host of the other endianness.
+static const char decodedCacheMagic[8] = { 'b', 'q', 'p', 'c', 'm', '1', 0, 0 };
+static const uint32_t decodedCacheCheck = 0x01020304;
+static const size_t decodedCacheAlignment = 64;
+
+struct DecodedCacheHeader {
+    char magic[8];
+    uint32_t check;
+    uint32_t channels;
+    uint32_t sampleRate;
+    uint32_t rate;
+    uint64_t frames;
+    uint64_t nativeFrames;
+    uint32_t trackLength;
+    uint32_t artistLength;
+};
+
+class CachedAudioReadStream::D
+{
+public:
+    D(std::string p, SourceFactory f) :
+        path(p), factory(f), source(0),
+        nativeEstimate(0), rate(0), started(false),
+#ifndef _WIN32
+        fd(-1),
+#endif
+        map(0), mapSize(0), data(0), frames(0), pos(0),
+        out(0), written(0) { }
+    
+    ~D() {
+        closeEntry();
+        abandonWrite();
+        delete source;
+    }
+
+    std::string path;
+    SourceFactory factory;
+    AudioReadStream *source;
+    std::string key;
+    std::string track;
+    std::string artist;
+    size_t nativeEstimate;
+    size_t rate;
+    bool started;
+
+    // Serving from a cache file
+#ifndef _WIN32
+    int fd;
+#endif
+    void *map;
+    size_t mapSize;
+    const float *data;
+    size_t frames;
+    size_t pos;
+
+    // Writing through to a new cache file
+    FILE *out;
+    std::string entryPath;
+    std::string tmpPath;
+    size_t written;
+    DecodedCacheHeader header;
+
+    static uint64_t fnv1a(const void *data, size_t n, uint64_t h) {
+        const unsigned char *p = (const unsigned char *)data;
+        for (size_t i = 0; i < n; ++i) {
+            h = (h ^ p[i]) * 1099511628211ull;
+        }
+        return h;
+    }
+
+    void makeKey() {
+#ifndef _WIN32
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) {
+            return;
+        }
+        uint64_t size = uint64_t(st.st_size);
+        uint64_t modified = uint64_t(st.st_mtime);
+        // Sub-second modification time where there is one, so that
+        // a file rewritten within a second gets a new key
+        uint64_t nsec = 0;
+#if defined(__APPLE__)
+        nsec = uint64_t(st.st_mtimespec.tv_nsec);
+#elif defined(__linux__)
+        nsec = uint64_t(st.st_mtim.tv_nsec);
+#endif
+        uint64_t h = fnv1a(path.data(), path.size(), 14695981039346656037ull);
+        h = fnv1a(&size, sizeof(size), h);
+        h = fnv1a(&modified, sizeof(modified), h);
+        h = fnv1a(&nsec, sizeof(nsec), h);
+        char buf[24];
+        snprintf(buf, sizeof(buf), "%016llx", (unsigned long long)h);
+        key = buf;
+#endif
+    }
+
+    // Rate 0 denotes the native rate, so that an entry can be found
+    // before the source has been opened to find out what that is
+    std::string entryFor(size_t r) const {
+        std::string dir = CachedAudioReadStream::getCacheDirectory();
+        if (dir == "" || key == "") return "";
+        return dir + "/" + key + "-" + std::to_string(r) + ".pcm";
+    }
+
+    static size_t dataOffset(const DecodedCacheHeader &h) {
+        size_t n = sizeof(h) + h.trackLength + h.artistLength;
+        return ((n + decodedCacheAlignment - 1) / decodedCacheAlignment)
+            * decodedCacheAlignment;
+    }
+    
+    bool openEntry(std::string file) {
+#ifndef _WIN32
+        if (file == "") return false;
+        fd = ::open(file.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        struct stat st;
+        if (fstat(fd, &st) != 0 || size_t(st.st_size) < sizeof(header)) {
+            closeEntry();
+            return false;
+        }
+        mapSize = size_t(st.st_size);
+        map = mmap(0, mapSize, PROT_READ, MAP_SHARED, fd, 0);
+        if (map == MAP_FAILED) {
+            map = 0;
+            closeEntry();
+            return false;
+        }
+
+        const char *base = (const char *)map;
+        DecodedCacheHeader h;
+        memcpy(&h, base, sizeof(h));
+        if (memcmp(h.magic, decodedCacheMagic, 8) ||
+            h.check != decodedCacheCheck ||
+            h.channels == 0 ||
+            sizeof(h) + h.trackLength + h.artistLength > mapSize ||
+            dataOffset(h) + h.frames * h.channels * sizeof(float) > mapSize) {
+            std::cerr << "WARNING: CachedAudioReadStream: Ignoring invalid "
+                      << "cache file " << file << std::endl;
+            closeEntry();
+            return false;
+        }
+
+        header = h;
+        track = std::string(base + sizeof(h), h.trackLength);
+        artist = std::string(base + sizeof(h) + h.trackLength, h.artistLength);
+        data = (const float *)(base + dataOffset(h));
+        frames = h.frames;
+        pos = 0;
+
+        // Mark as recently used, for eviction
+        futimens(fd, 0);
+        madvise(map, mapSize, MADV_SEQUENTIAL);
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    void closeEntry() {
+#ifndef _WIN32
+        if (map) munmap(map, mapSize);
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+#endif
+        map = 0;
+        mapSize = 0;
+        data = 0;
+        frames = 0;
+        pos = 0;
+    }
+
+    void openSource() {
+        source = factory(path);
+        nativeEstimate = source->getEstimatedFrameCount();
+        track = source->getTrackName();
+        artist = source->getArtistName();
+    }
+    
+    void beginWrite(std::string file, size_t channels,
+                    size_t sampleRate, size_t r) {
+#ifndef _WIN32
+        if (file == "") return;
+        static std::atomic<int> counter(0);
+        entryPath = file;
+        tmpPath = file + "." + std::to_string(getpid()) + "." +
+            std::to_string(++counter) + ".tmp";
+        out = fopen(tmpPath.c_str(), "wb");
+        if (!out) return;
+
+        memcpy(header.magic, decodedCacheMagic, 8);
+        header.check = decodedCacheCheck;
+        header.channels = uint32_t(channels);
+        header.sampleRate = uint32_t(sampleRate);
+        header.rate = uint32_t(r);
+        header.frames = 0;
+        header.nativeFrames = nativeEstimate;
+        header.trackLength = uint32_t(track.size());
+        header.artistLength = uint32_t(artist.size());
+
+        std::vector<char> head(dataOffset(header), 0);
+        memcpy(head.data(), &header, sizeof(header));
+        memcpy(head.data() + sizeof(header), track.data(), track.size());
+        memcpy(head.data() + sizeof(header) + track.size(),
+               artist.data(), artist.size());
+        written = 0;
+        if (fwrite(head.data(), 1, head.size(), out) != head.size()) {
+            abandonWrite();
+        }
+#endif
+    }
+
+    void writeThrough(const float *f, size_t n) {
+        if (!out || n == 0) return;
+        size_t samples = n * header.channels;
+        size_t limit = CachedAudioReadStream::getCacheMaxBytes();
+        if ((written + n) * header.channels * sizeof(float) > limit ||
+            fwrite(f, sizeof(float), samples, out) != samples) {
+            // Too big to cache, or out of space
+            abandonWrite();
+            return;
+        }
+        written += n;
+    }
+
+    void commitWrite(bool native) {
+        if (!out) return;
+        header.frames = written;
+        if (native) header.nativeFrames = written;
+        bool ok = (fseek(out, 0, SEEK_SET) == 0 &&
+                   fwrite(&header, sizeof(header), 1, out) == 1);
+        ok = (fclose(out) == 0) && ok;
+        out = 0;
+        if (!ok || rename(tmpPath.c_str(), entryPath.c_str()) != 0) {
+            remove(tmpPath.c_str());
+            return;
+        }
+        evict(CachedAudioReadStream::getCacheDirectory(),
+              CachedAudioReadStream::getCacheMaxBytes());
+    }
+
+    void abandonWrite() {
+        if (!out) return;
+        fclose(out);
+        out = 0;
+        remove(tmpPath.c_str());
+    }
+
+    // Remove least recently used cache files until the total is
+    // within budget. Files still mapped by other streams remain
+    // readable until those streams close them.
+    static void evict(std::string dir, size_t maxBytes) {
+#ifndef _WIN32
+        std::lock_guard<std::mutex> guard(decodedCacheMutex);
+
+        DIR *d = opendir(dir.c_str());
+        if (!d) return;
+
+        struct Entry {
+            std::string path;
+            size_t size;
+            time_t used;
+        };
+        std::vector<Entry> entries;
+        size_t total = 0;
+        
+        while (struct dirent *e = readdir(d)) {
+            std::string name(e->d_name);
+            if (name.size() < 5 ||
+                name.compare(name.size() - 4, 4, ".pcm") != 0) {
+                continue;
+            }
+            std::string file = dir + "/" + name;
+            struct stat st;
+            if (stat(file.c_str(), &st) != 0) continue;
+            Entry entry = { file, size_t(st.st_size), st.st_mtime };
+            entries.push_back(entry);
+            total += entry.size;
+        }
+        closedir(d);
+
+        if (total <= maxBytes) return;
+        
+        std::sort(entries.begin(), entries.end(),
+                  [](const Entry &a, const Entry &b) {
+                      return a.used < b.used;
+                  });
+        for (const auto &entry: entries) {
+            if (total <= maxBytes) break;
+            if (remove(entry.path.c_str()) == 0) {
+                total -= entry.size;
+            }
+        }
+#endif
+    }
+};
+
+CachedAudioReadStream::CachedAudioReadStream(std::string path,
+                                             SourceFactory factory) :
+    m_d(new D(path, factory))
+{
+    try {
+        m_d->makeKey();
+
+        if (m_d->openEntry(m_d->entryFor(0))) {
+            m_channelCount = m_d->header.channels;
+            m_sampleRate = m_d->header.sampleRate;
+            m_estimatedFrameCount = m_d->frames;
+            m_seekable = true;
+            m_d->rate = m_sampleRate;
+            return;
+        }
+
+        m_d->openSource();
+        m_channelCount = m_d->source->getChannelCount();
+        m_sampleRate = m_d->source->getSampleRate();
+        m_estimatedFrameCount = m_d->nativeEstimate;
+        m_seekable = m_d->source->isSeekable();
+        m_d->rate = m_sampleRate;
+        m_d->beginWrite(m_d->entryFor(0), m_channelCount, m_sampleRate,
+                        m_sampleRate);
+
+    } catch (...) {
+        delete m_d;
+        throw;
+    }
+}
+
+CachedAudioReadStream::~CachedAudioReadStream()
+{
+    delete m_d;
+}
+
+std::string
+CachedAudioReadStream::getTrackName() const
+{
+    return m_d->track;
+}
+
+std::string
+CachedAudioReadStream::getArtistName() const
+{
+    return m_d->artist;
+}
+
+std::string
+CachedAudioReadStream::getError() const
+{
+    if (m_d->source) return m_d->source->getError();
+    return "";
+}
+
+bool
+CachedAudioReadStream::isServedFromCache() const
+{
+    return m_d->map != 0;
+}
+
+size_t
+CachedAudioReadStream::performSetDecodeSampleRate(size_t rate)
+{
+    // Once reading has begun we stay at the rate we have, and the
+    // base class resamples from it
+    if (m_d->started || rate == m_d->rate) {
+        return m_d->rate;
+    }
+
+    bool native = (rate == m_sampleRate);
+    
+    m_d->closeEntry();
+    m_d->abandonWrite();
+    m_d->rate = rate;
+    
+    if (m_d->openEntry(m_d->entryFor(native ? 0 : rate))) {
+        m_seekable = true;
+        return rate;
+    }
+
+    if (!m_d->source) {
+        m_d->openSource();
+    }
+    m_d->source->setRetrievalSampleRate(native ? 0 : rate);
+    m_seekable = m_d->source->isSeekable();
+    m_d->beginWrite(m_d->entryFor(native ? 0 : rate),
+                    m_channelCount, m_sampleRate, rate);
+    return rate;
+}
+
+size_t
+CachedAudioReadStream::getFrames(size_t count, float *frames)
+{
+    m_d->started = true;
+
+    if (m_d->map) {
+        size_t n = count;
+        if (m_d->pos + n > m_d->frames) n = m_d->frames - m_d->pos;
+        memcpy(frames, m_d->data + m_d->pos * m_channelCount,
+               n * m_channelCount * sizeof(float));
+        m_d->pos += n;
+        return n;
+    }
+
+    if (!m_d->source) {
+        return 0;
+    }
+
+    // A short read does not always mean the end of the stream (an
+    // incremental reader may just be waiting for more data), so keep
+    // asking until the source gives us nothing at all
+    size_t got = 0;
+    while (got < count) {
+        size_t n = m_d->source->getInterleavedFrames
+            (count - got, frames + got * m_channelCount);
+        if (n == 0) break;
+        got += n;
+    }
+    
+    if (m_d->out) {
+        m_d->writeThrough(frames, got);
+        if (got < count) {
+            // Only a clean end makes a complete cache entry
+            if (m_d->source->getError() == "") {
+                m_d->commitWrite(m_d->rate == m_sampleRate);
+            } else {
+                m_d->abandonWrite();
+            }
+        }
+    }
+    return got;
+}
+
+bool
+CachedAudioReadStream::performSeek(size_t frame)
+{
+    if (m_d->map) {
+        if (frame > m_d->frames) return false;
+        m_d->pos = frame;
+        return true;
+    }
+
+    if (!m_d->source) {
+        return false;
+    }
+
+    // A cache file must be written in order, so give up on it
+    m_d->abandonWrite();
+    return m_d->source->seek(frame);
+}
+
+void
+CachedAudioReadStream::setCache(std::string directory, size_t maxBytes)
+{
+    {
+        std::lock_guard<std::mutex> guard(decodedCacheMutex);
+        decodedCacheDirectory = directory;
+        decodedCacheMaxBytes = maxBytes;
+    }
+    if (directory != "") {
+        D::evict(directory, maxBytes);
+    }
+}
+
+std::string
+CachedAudioReadStream::getCacheDirectory()
+{
+    std::lock_guard<std::mutex> guard(decodedCacheMutex);
+    return decodedCacheDirectory;
+}
+
+size_t
+CachedAudioReadStream::getCacheMaxBytes()
+{
+    std::lock_guard<std::mutex> guard(decodedCacheMutex);
+    return decodedCacheMaxBytes;
+}
+
+}
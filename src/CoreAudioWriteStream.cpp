@@ -199,6 +199,10 @@ CoreAudioWriteStream::putInterleavedFrames(size_t count, const float *frames)
 {
     if (count == 0) return;
 
+    AudioStreamStatistics::Timer timer
+        (m_statistics, &AudioStreamStatistics::codecSeconds);
+    countFrames(count);
+
     m_d->buffer.mBuffers[0].mDataByteSize =
         sizeof(float) * getChannelCount() * count;
     
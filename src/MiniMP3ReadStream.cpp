@@ -39,8 +39,18 @@
 #include <minimp3_ex.h>
 
 #include "MiniMP3ReadStream.h"
+#include "../bqaudiostream/AudioReadStreamFactory.h"
 
 #include <sstream>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <vector>
+
+#include <sys/types.h>
+#include <sys/stat.h>
 
 namespace breakfastquay
 {
@@ -63,8 +73,585 @@ minimp3builder(
 class MiniMP3ReadStream::D
 {
 public:
-    D() { }
+    D() : open(false), fileSize(0), fileModified(0), headerHash(0),
+          indexCached(false) { }
     mp3dec_ex_t dec;
+    bool open; // dec is open and must be closed
+
+    // Release the decoder, its file mapping and its frame index
+    void close() {
+        if (open) {
+            mp3dec_ex_close(&dec);
+            open = false;
+        }
+    }
+
+    // Seek index cache (see
+    // AudioReadStreamFactory::setSeekIndexCacheDirectory). The cache
+    // file holds a key identifying the audio file, followed by the
+    // total sample count and the frame index, all as unsigned LEB128
+    // varints with the index entries delta-coded - typically two or
+    // three bytes per MP3 frame.
+    
+    std::string cachePath;
+    uint64_t fileSize;
+    uint64_t fileModified;
+    uint64_t headerHash;
+    bool indexCached;
+
+    static const char *cacheMagic() { return "bqmp3idx1"; }
+
+    void prepareCache(std::string path) {
+        std::string dir = AudioReadStreamFactory::getSeekIndexCacheDirectory();
+        if (dir == "") {
+            // A Xing/Info/VBRI header gives us the length, but not
+            // the frame offsets, so the first seek still has to scan
+            // the file whether or not there is one
+            return;
+        }
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) {
+            return;
+        }
+        fileSize = uint64_t(st.st_size);
+        fileModified = uint64_t(st.st_mtime);
+        // Hash the first 64K, which covers any ID3 tag and the first
+        // few frames
+        headerHash = fnv1a(dec.file.buffer,
+                           dec.file.size < 65536 ? dec.file.size : 65536,
+                           14695981039346656037ull);
+        uint64_t name = fnv1a((const uint8_t *)path.data(), path.size(),
+                              headerHash ^ fileSize ^ fileModified);
+        char buf[40];
+        snprintf(buf, sizeof(buf), "%016llx.mp3idx", (unsigned long long)name);
+        cachePath = dir + "/" + buf;
+    }
+
+    void loadCachedIndex() {
+        if (cachePath == "") return;
+        FILE *f = fopen(cachePath.c_str(), "rb");
+        if (!f) return;
+        std::vector<uint8_t> data;
+        uint8_t buf[16384];
+        size_t n;
+        while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+            data.insert(data.end(), buf, buf + n);
+        }
+        fclose(f);
+
+        size_t magicLen = strlen(cacheMagic());
+        if (data.size() < magicLen ||
+            memcmp(data.data(), cacheMagic(), magicLen)) {
+            return;
+        }
+        size_t pos = magicLen;
+        uint64_t size, modified, hash, samples, count;
+        if (!readVarint(data, pos, size) || size != fileSize ||
+            !readVarint(data, pos, modified) || modified != fileModified ||
+            !readVarint(data, pos, hash) || hash != headerHash ||
+            !readVarint(data, pos, samples) ||
+            !readVarint(data, pos, count) || count == 0 ||
+            count > data.size()) {
+            return;
+        }
+        mp3dec_frame_t *frames =
+            (mp3dec_frame_t *)malloc(count * sizeof(mp3dec_frame_t));
+        if (!frames) return;
+        uint64_t sample = 0, offset = 0;
+        for (uint64_t i = 0; i < count; ++i) {
+            uint64_t ds, doff;
+            if (!readVarint(data, pos, ds) || !readVarint(data, pos, doff)) {
+                free(frames);
+                return;
+            }
+            sample += ds;
+            offset += doff;
+            if (offset >= dec.file.size) {
+                free(frames);
+                return;
+            }
+            frames[i].sample = sample;
+            frames[i].offset = offset;
+        }
+
+        // The index belongs to the decoder from here on, and is freed
+        // by mp3dec_ex_close
+        free(dec.index.frames);
+        dec.index.frames = frames;
+        dec.index.num_frames = size_t(count);
+        dec.index.capacity = size_t(count);
+        dec.samples = samples;
+        dec.indexes_built = 1;
+        indexCached = true;
+    }
+
+    void saveCachedIndex() {
+        if (cachePath == "" || indexCached || !dec.indexes_built ||
+            dec.index.num_frames == 0) {
+            return;
+        }
+        indexCached = true; // whether or not we succeed, don't retry
+        
+        std::vector<uint8_t> data(cacheMagic(),
+                                  cacheMagic() + strlen(cacheMagic()));
+        writeVarint(data, fileSize);
+        writeVarint(data, fileModified);
+        writeVarint(data, headerHash);
+        writeVarint(data, dec.samples);
+        writeVarint(data, dec.index.num_frames);
+        uint64_t sample = 0, offset = 0;
+        for (size_t i = 0; i < dec.index.num_frames; ++i) {
+            writeVarint(data, dec.index.frames[i].sample - sample);
+            writeVarint(data, dec.index.frames[i].offset - offset);
+            sample = dec.index.frames[i].sample;
+            offset = dec.index.frames[i].offset;
+        }
+
+        // Write to a temporary file and rename, so that a reader
+        // never sees a partial index
+        std::string tmpPath = cachePath + ".tmp";
+        FILE *f = fopen(tmpPath.c_str(), "wb");
+        if (!f) return;
+        bool ok = (fwrite(data.data(), 1, data.size(), f) == data.size());
+        if (fclose(f) != 0) ok = false;
+        if (!ok || rename(tmpPath.c_str(), cachePath.c_str()) != 0) {
+            std::cerr << "MiniMP3ReadStream: Failed to write seek index cache file \""
+                      << cachePath << "\"" << std::endl;
+            remove(tmpPath.c_str());
+        }
+    }
+
+    // Tags. minimp3 has already mapped the whole file, so we read
+    // them from its buffer rather than opening the file again. We
+    // look for ID3v2 at the start, and APEv2 and ID3v1 at the end,
+    // preferring them in that order.
+
+    void readTags(std::string &track, std::string &artist) const {
+        const uint8_t *buf = dec.file.buffer;
+        size_t size = dec.file.size;
+        if (!buf) return;
+
+        std::string t, a;
+        readID3v2(buf, size, t, a);
+        
+        size_t end = size;
+        std::string v1t, v1a;
+        if (size >= 128 && !memcmp(buf + size - 128, "TAG", 3)) {
+            v1t = latin1ToUtf8(buf + size - 125, 30);
+            v1a = latin1ToUtf8(buf + size - 95, 30);
+            end = size - 128;
+        }
+        
+        std::string apet, apea;
+        readAPEv2(buf, end, apet, apea);
+
+        track = (t != "" ? t : apet != "" ? apet : v1t);
+        artist = (a != "" ? a : apea != "" ? apea : v1a);
+    }
+
+    // Reads bytes from an ID3v2 tag in place in the mapped file,
+    // removing whole-tag unsynchronisation on the way if the tag has
+    // it, so that the tag (which may hold megabytes of cover art)
+    // never has to be copied
+    struct TagCursor {
+        const uint8_t *data;
+        size_t size;
+        size_t pos;
+        bool unsync;
+
+        // Copy count bytes to out, or skip them if out is null.
+        // Return false if the tag runs out first.
+        bool take(uint8_t *out, size_t count) {
+            if (!unsync) {
+                if (count > size - pos) return false;
+                if (out) memcpy(out, data + pos, count);
+                pos += count;
+                return true;
+            }
+            for (size_t i = 0; i < count; ++i) {
+                if (pos >= size) return false;
+                uint8_t b = data[pos++];
+                if (out) out[i] = b;
+                if (b == 0xff && pos < size && data[pos] == 0x00) ++pos;
+            }
+            return true;
+        }
+    };
+    
+    static void readID3v2(const uint8_t *buf, size_t size,
+                          std::string &track, std::string &artist) {
+        
+        if (size < 10 || memcmp(buf, "ID3", 3)) return;
+        
+        int version = buf[3];
+        int flags = buf[5];
+        if (version < 2 || version > 4) return;
+        
+        size_t tagSize = syncsafe(buf + 6, 4);
+        if (tagSize + 10 > size) return;
+
+        // Whole-tag unsynchronisation (in v2.4 this is done per
+        // frame, and the tag flag just says all frames have it)
+        TagCursor tag = { buf + 10, tagSize, 0,
+                          version < 4 && (flags & 0x80) };
+
+        if (version > 2 && (flags & 0x40)) {
+            // Extended header: size excludes itself in v2.3, is
+            // syncsafe and includes itself in v2.4
+            uint8_t e[4];
+            if (!tag.take(e, 4)) return;
+            size_t extended = (version == 3 ?
+                               4 + bigEndian(e, 4) : syncsafe(e, 4));
+            if (extended < 4 || !tag.take(0, extended - 4)) return;
+        }
+
+        size_t idLen = (version == 2 ? 3 : 4);
+        size_t headerLen = (version == 2 ? 6 : 10);
+        uint8_t h[10];
+        
+        while (tag.take(h, headerLen)) {
+            if (h[0] == 0) break; // padding
+            
+            std::string id((const char *)h, idLen);
+            size_t frameSize;
+            int frameFlags = 0;
+            if (version == 2) {
+                frameSize = bigEndian(h + 3, 3);
+            } else if (version == 3) {
+                frameSize = bigEndian(h + 4, 4);
+                frameFlags = h[9];
+            } else {
+                frameSize = syncsafe(h + 4, 4);
+                frameFlags = h[9];
+            }
+
+            std::string *target = 0;
+            if (id == "TT2" || id == "TIT2") target = &track;
+            else if (id == "TP1" || id == "TPE1") target = &artist;
+
+            // Skip compressed or encrypted frames
+            bool unreadable = false;
+            if (version == 3) unreadable = (frameFlags & 0xc0);
+            if (version == 4) unreadable = (frameFlags & 0x0c);
+            
+            if (!target || *target != "" || unreadable) {
+                if (!tag.take(0, frameSize)) break;
+                continue;
+            }
+
+            // Read the frame where it is unless it has to be
+            // unsynchronised
+            bool frameUnsync = (version == 4 &&
+                                ((frameFlags & 0x02) || (flags & 0x80)));
+            const uint8_t *text = 0;
+            std::vector<uint8_t> frame;
+            if (tag.unsync || frameUnsync) {
+                frame.resize(frameSize);
+                if (!tag.take(frame.data(), frameSize)) break;
+                if (frameUnsync) {
+                    frame = unsynchronise(frame.data(), frame.size());
+                }
+                text = frame.data();
+                frameSize = frame.size();
+            } else {
+                text = tag.data + tag.pos;
+                if (!tag.take(0, frameSize)) break;
+            }
+
+            // Skip the extra bytes that precede the text when the
+            // frame has a grouping identity or (v2.4) a data length
+            // indicator, in that order
+            size_t skip = 0;
+            if (version == 3 && (frameFlags & 0x20)) skip += 1;
+            if (version == 4 && (frameFlags & 0x40)) skip += 1;
+            if (version == 4 && (frameFlags & 0x01)) skip += 4;
+            if (skip <= frameSize) {
+                *target = decodeText(text + skip, frameSize - skip);
+            }
+        }
+    }
+
+    static void readAPEv2(const uint8_t *buf, size_t end,
+                          std::string &track, std::string &artist) {
+
+        if (end < 32) return;
+        const uint8_t *footer = buf + end - 32;
+        if (memcmp(footer, "APETAGEX", 8)) return;
+
+        size_t tagSize = littleEndian(footer + 12, 4); // items + footer
+        size_t count = littleEndian(footer + 16, 4);
+        if (tagSize < 32 || tagSize > end) return;
+
+        const uint8_t *p = buf + end - tagSize;
+        const uint8_t *limit = footer;
+        
+        for (size_t i = 0; i < count && p + 8 < limit; ++i) {
+            size_t valueSize = littleEndian(p, 4);
+            int itemFlags = int(littleEndian(p + 4, 4));
+            p += 8;
+            const uint8_t *k = p;
+            while (p < limit && *p) ++p;
+            if (p >= limit) break;
+            std::string key((const char *)k, p - k);
+            ++p;
+            if (valueSize > size_t(limit - p)) break;
+            // Type 0 is UTF-8 text; the others are binary or links
+            if (((itemFlags >> 1) & 0x3) == 0) {
+                std::string value((const char *)p, valueSize);
+                // Multiple values are separated by nulls; take the first
+                value = value.substr(0, value.find('\0'));
+                for (size_t j = 0; j < key.size(); ++j) {
+                    key[j] = char(tolower((unsigned char)key[j]));
+                }
+                if (key == "title" && track == "") track = value;
+                else if (key == "artist" && artist == "") artist = value;
+            }
+            p += valueSize;
+        }
+    }
+
+    static size_t syncsafe(const uint8_t *p, int n) {
+        size_t v = 0;
+        for (int i = 0; i < n; ++i) v = (v << 7) | (p[i] & 0x7f);
+        return v;
+    }
+
+    static size_t bigEndian(const uint8_t *p, int n) {
+        size_t v = 0;
+        for (int i = 0; i < n; ++i) v = (v << 8) | p[i];
+        return v;
+    }
+
+    static size_t littleEndian(const uint8_t *p, int n) {
+        size_t v = 0;
+        for (int i = n; i > 0; --i) v = (v << 8) | p[i-1];
+        return v;
+    }
+
+    static std::vector<uint8_t> unsynchronise(const uint8_t *p, size_t n) {
+        // Remove the zero byte inserted after each 0xff
+        std::vector<uint8_t> out;
+        out.reserve(n);
+        for (size_t i = 0; i < n; ++i) {
+            out.push_back(p[i]);
+            if (p[i] == 0xff && i + 1 < n && p[i+1] == 0x00) ++i;
+        }
+        return out;
+    }
+    
+    static std::string decodeText(const uint8_t *p, size_t n) {
+        if (n == 0) return "";
+        int encoding = p[0];
+        ++p;
+        --n;
+        std::string s;
+        switch (encoding) {
+        case 0:
+            s = latin1ToUtf8(p, n);
+            break;
+        case 1: // UTF-16 with BOM
+            if (n >= 2 && p[0] == 0xfe && p[1] == 0xff) {
+                s = utf16ToUtf8(p + 2, n - 2, true);
+            } else if (n >= 2 && p[0] == 0xff && p[1] == 0xfe) {
+                s = utf16ToUtf8(p + 2, n - 2, false);
+            } else {
+                s = utf16ToUtf8(p, n, false);
+            }
+            break;
+        case 2:
+            s = utf16ToUtf8(p, n, true);
+            break;
+        case 3:
+            s = std::string((const char *)p, n);
+            break;
+        default:
+            return "";
+        }
+        // Text frames may hold several null-separated strings (v2.4)
+        // or be null-terminated; take the first
+        return s.substr(0, s.find('\0'));
+    }
+
+    static std::string latin1ToUtf8(const uint8_t *p, size_t n) {
+        std::string s;
+        for (size_t i = 0; i < n && p[i]; ++i) {
+            appendUtf8(s, p[i]);
+        }
+        // ID3v1 fields are padded with spaces or nulls
+        while (!s.empty() && s[s.size()-1] == ' ') s.resize(s.size()-1);
+        return s;
+    }
+
+    static std::string utf16ToUtf8(const uint8_t *p, size_t n, bool be) {
+        std::string s;
+        for (size_t i = 0; i + 1 < n; i += 2) {
+            unsigned c = be ? ((p[i] << 8) | p[i+1]) : ((p[i+1] << 8) | p[i]);
+            if (c == 0) break;
+            if (c >= 0xd800 && c < 0xdc00 && i + 3 < n) {
+                unsigned c2 = be ?
+                    ((p[i+2] << 8) | p[i+3]) : ((p[i+3] << 8) | p[i+2]);
+                if (c2 >= 0xdc00 && c2 < 0xe000) {
+                    c = 0x10000 + ((c - 0xd800) << 10) + (c2 - 0xdc00);
+                    i += 2;
+                }
+            }
+            appendUtf8(s, c);
+        }
+        return s;
+    }
+
+    static void appendUtf8(std::string &s, unsigned c) {
+        if (c < 0x80) {
+            s += char(c);
+        } else if (c < 0x800) {
+            s += char(0xc0 | (c >> 6));
+            s += char(0x80 | (c & 0x3f));
+        } else if (c < 0x10000) {
+            s += char(0xe0 | (c >> 12));
+            s += char(0x80 | ((c >> 6) & 0x3f));
+            s += char(0x80 | (c & 0x3f));
+        } else {
+            s += char(0xf0 | (c >> 18));
+            s += char(0x80 | ((c >> 12) & 0x3f));
+            s += char(0x80 | ((c >> 6) & 0x3f));
+            s += char(0x80 | (c & 0x3f));
+        }
+    }
+    
+    // Parallel decoding (see AudioReadStream::setDecodeThreadCount).
+    // We split the request into one contiguous range per thread and
+    // give each thread its own decoder, over the same mapped file
+    // buffer and sharing a copy of our frame index, seeked to the
+    // start of its range. A sample-accurate seek in minimp3 starts
+    // decoding a few frames early and discards their output, which
+    // refills the bit reservoir and the filterbank overlap, so each
+    // range comes out exactly as it would from a sequential decode.
+    
+    size_t readParallel(float *out, size_t desired, int threads,
+                        int channels) {
+        
+        // Not worth a thread for less than a few seconds of audio.
+        // Check this against the request before anything else, as
+        // building the index means scanning the whole file, which a
+        // small read shouldn't have to wait for
+        size_t minPerThread = MINIMP3_MAX_SAMPLES_PER_FRAME * 64;
+        if (desired / minPerThread < 2) return 0;
+        
+        uint64_t start = dec.cur_sample;
+        if (!dec.indexes_built) {
+            // Build the index now, rather than in every thread
+            if (mp3dec_ex_seek(&dec, start)) return 0;
+            saveCachedIndex();
+        }
+        if (dec.samples <= start || dec.index.num_frames == 0) return 0;
+
+        uint64_t available = dec.samples - start;
+        size_t n = (desired < available ? desired : size_t(available));
+
+        if (size_t(threads) > n / minPerThread) {
+            threads = int(n / minPerThread);
+        }
+        if (threads < 2) return 0;
+
+        size_t per = (n / channels / threads) * channels;
+        std::vector<size_t> obtained(threads, 0);
+        std::vector<std::thread> workers;
+        for (int t = 0; t < threads; ++t) {
+            size_t offset = t * per;
+            size_t count = (t == threads - 1 ? n - offset : per);
+            workers.push_back(std::thread([=, &obtained]() {
+                        obtained[t] = decodeRange(start + offset,
+                                                  out + offset, count);
+                    }));
+        }
+        bool ok = true;
+        for (int t = 0; t < threads; ++t) {
+            workers[t].join();
+            size_t expected = (t == threads - 1 ? n - t * per : per);
+            if (obtained[t] != expected) ok = false;
+        }
+
+        if (!ok) {
+            // Probably a change of format partway through, which
+            // the sequential path knows how to report
+            mp3dec_ex_seek(&dec, start);
+            return 0;
+        }
+
+        // Carry on sequentially from the end of what we decoded
+        mp3dec_ex_seek(&dec, start + n);
+        return n;
+    }
+
+    size_t decodeRange(uint64_t start, float *out, size_t n) const {
+        int flags = MP3D_SEEK_TO_SAMPLE;
+#ifdef MP3D_DO_NOT_SCAN
+        flags |= MP3D_DO_NOT_SCAN;
+#endif
+        mp3dec_ex_t w;
+        if (mp3dec_ex_open_buf(&w, dec.file.buffer, dec.file.size, flags)) {
+            return 0;
+        }
+        size_t bytes = dec.index.num_frames * sizeof(mp3dec_frame_t);
+        mp3dec_frame_t *frames = (mp3dec_frame_t *)malloc(bytes);
+        if (!frames) {
+            mp3dec_ex_close(&w);
+            return 0;
+        }
+        memcpy(frames, dec.index.frames, bytes);
+        free(w.index.frames);
+        w.index.frames = frames;
+        w.index.num_frames = dec.index.num_frames;
+        w.index.capacity = dec.index.num_frames;
+        w.samples = dec.samples;
+        w.indexes_built = 1;
+
+        size_t obtained = 0;
+        if (!mp3dec_ex_seek(&w, start)) {
+            obtained = mp3dec_ex_read(&w, out, n);
+        }
+        mp3dec_ex_close(&w);
+        return obtained;
+    }
+    
+    static uint64_t fnv1a(const uint8_t *data, size_t n, uint64_t h) {
+        for (size_t i = 0; i < n; ++i) {
+            h = (h ^ data[i]) * 1099511628211ull;
+        }
+        return h;
+    }
+    
+    static void writeVarint(std::vector<uint8_t> &data, uint64_t v) {
+        while (v >= 0x80) {
+            data.push_back(uint8_t(v & 0x7f) | 0x80);
+            v >>= 7;
+        }
+        data.push_back(uint8_t(v));
+    }
+
+    static bool readVarint(const std::vector<uint8_t> &data, size_t &pos,
+                           uint64_t &v) {
+        v = 0;
+        for (int shift = 0; shift < 64; shift += 7) {
+            if (pos >= data.size()) return false;
+            uint8_t b = data[pos++];
+            v |= uint64_t(b & 0x7f) << shift;
+            if (!(b & 0x80)) return true;
+        }
+        return false;
+    }
+
+    // The exact frame count if we know it (from a VBR header, or
+    // because the file has been scanned), or 0 otherwise, as we are
+    // seekable and so must not report an approximate count
+    size_t getKnownFrameCount(int channels) const {
+#ifdef MP3D_DO_NOT_SCAN
+        if (!dec.vbr_tag_found && !dec.indexes_built) {
+            return 0;
+        }
+#endif
+        return size_t(dec.samples / channels);
+    }
 };
 
 MiniMP3ReadStream::MiniMP3ReadStream(std::string path) :
@@ -76,7 +663,20 @@ MiniMP3ReadStream::MiniMP3ReadStream(std::string path) :
     m_channelCount = 0;
     m_sampleRate = 0;
 
-    int err = mp3dec_ex_open(&m_d->dec, path.c_str(), 0);
+    // Ask for sample-accurate seeking. The frame index this needs is
+    // built on the first seek rather than at open. If the library
+    // supports it, we also ask it not to scan the whole file at open
+    // just to count the samples, so that opening a long file is
+    // quick: the sample count is still known up front if the file
+    // has a Xing/Info/VBRI header, and is found when the index is
+    // built otherwise.
+
+    int flags = MP3D_SEEK_TO_SAMPLE;
+#ifdef MP3D_DO_NOT_SCAN
+    flags |= MP3D_DO_NOT_SCAN;
+#endif
+    
+    int err = mp3dec_ex_open(&m_d->dec, path.c_str(), flags);
     if (err) {
         std::ostringstream os;
         os << "MiniMP3ReadStream: Unable to open file (error code " << err << ")";
@@ -87,20 +687,49 @@ MiniMP3ReadStream::MiniMP3ReadStream(std::string path) :
             throw InvalidFileFormat(m_path, "failed to open audio file");
         }
     }
+    m_d->open = true;
 
     m_channelCount = m_d->dec.info.channels;
     m_sampleRate = m_d->dec.info.hz;
 
     if (m_channelCount == 0) {
         m_error = "MiniMP3ReadStream: Unable to open file: bad header or no channels reported";
+        m_d->close();
         throw InvalidFileFormat(m_path, "bad header or no channels reported");
     }
     
-    if (m_channelCount > 0) {
-        m_estimatedFrameCount = m_d->dec.samples / m_channelCount;
-    } else {
-        m_estimatedFrameCount = 0;
+    m_d->readTags(m_track, m_artist);
+    
+    m_d->prepareCache(m_path);
+    m_d->loadCachedIndex();
+    
+    m_seekable = true;
+    m_estimatedFrameCount = m_d->getKnownFrameCount(m_channelCount);
+}
+
+bool
+MiniMP3ReadStream::performSeek(size_t frame)
+{
+    if (m_error != "" || m_channelCount == 0) return false;
+
+    // This builds the frame index (scanning the file) the first time
+    // it is called, unless the file had a usable VBR header
+    int err = mp3dec_ex_seek(&m_d->dec, uint64_t(frame) * m_channelCount);
+    if (err) {
+        std::cerr << "MiniMP3ReadStream::performSeek: seek to frame "
+                  << frame << " failed (error code " << err << ")"
+                  << std::endl;
+        return false;
+    }
+
+    m_d->saveCachedIndex();
+    
+    m_estimatedFrameCount = m_d->getKnownFrameCount(m_channelCount);
+    if (m_estimatedFrameCount > 0 && frame > m_estimatedFrameCount) {
+        return false;
     }
+    
+    return true;
 }
 
 size_t
@@ -110,10 +739,18 @@ MiniMP3ReadStream::getFrames(size_t count, float *frames)
     if (count == 0) return 0;
 
     size_t desired = count * m_channelCount;
-    size_t obtained = mp3dec_ex_read(&m_d->dec, frames, desired);
 
-    //!!! have to provide our own tags support?
+    if (m_decodeThreads > 1) {
+        size_t obtained = m_d->readParallel(frames, desired, m_decodeThreads,
+                                            int(m_channelCount));
+        m_estimatedFrameCount = m_d->getKnownFrameCount(m_channelCount);
+        if (obtained > 0) {
+            return obtained / m_channelCount;
+        }
+    }
     
+    size_t obtained = mp3dec_ex_read(&m_d->dec, frames, desired);
+
     if (obtained < desired) {
         if (m_d->dec.last_error == MP3D_E_DECODE) {
             // Marks a change in sample rate, layer, or channels. We
@@ -129,7 +766,7 @@ MiniMP3ReadStream::getFrames(size_t count, float *frames)
             os << "MiniMP3ReadStream: Failed to read from file (error code "
                << m_d->dec.last_error << ")";
             m_error = os.str();
-            mp3dec_ex_close(&m_d->dec);
+            m_d->close();
             throw InvalidFileFormat(m_path, "error in decoder");
         }
     }
@@ -137,11 +774,15 @@ MiniMP3ReadStream::getFrames(size_t count, float *frames)
     return obtained / m_channelCount;
 }
 
+bool
+MiniMP3ReadStream::hasParallelDecodeSupport() const
+{
+    return true;
+}
+
 MiniMP3ReadStream::~MiniMP3ReadStream()
 {
-    if (m_error != "") {
-        mp3dec_ex_close(&m_d->dec);
-    }
+    m_d->close();
     delete m_d;
 }
 
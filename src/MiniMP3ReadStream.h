@@ -53,8 +53,11 @@ public:
 
     virtual std::string getError() const { return m_error; }
 
+    virtual bool hasParallelDecodeSupport() const;
+
 protected:
     virtual size_t getFrames(size_t count, float *frames);
+    virtual bool performSeek(size_t frame);
 
     std::string m_path;
     std::string m_error;
@@ -69,18 +69,23 @@ public:
         m_oggz(0),
         m_fishSound(0),
         m_buffer(0),
+        m_interleaved(0),
+        m_interleavedSize(0),
         m_namesRead(false),
         m_finished(false) { }
     ~D() {
 	if (m_fishSound) fish_sound_delete(m_fishSound);
 	if (m_oggz) oggz_close(m_oggz);
         delete m_buffer;
+        deallocate(m_interleaved);
     }
 
     OggVorbisReadStream *m_rs;
     OGGZ *m_oggz;
     FishSound *m_fishSound;
     RingBuffer<float> *m_buffer;
+    float *m_interleaved;
+    int m_interleavedSize;
     bool m_namesRead;
     bool m_finished;
 
@@ -161,10 +166,14 @@ public:
 
         sizeBuffer(getAvailableFrameCount() + int(n));
         int channels = int(m_rs->getChannelCount());
-        float *interleaved = allocate<float>(n * channels);
-        v_interleave(interleaved, frames, channels, int(n));
-        m_buffer->write(interleaved, int(n) * channels);
-        deallocate(interleaved);
+        int samples = int(n) * channels;
+        if (m_interleavedSize < samples) {
+            deallocate(m_interleaved);
+            m_interleaved = allocate<float>(samples);
+            m_interleavedSize = samples;
+        }
+        v_interleave(m_interleaved, frames, channels, int(n));
+        m_buffer->write(m_interleaved, samples);
         return 0;
     }
 
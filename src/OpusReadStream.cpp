@@ -39,6 +39,10 @@
 #include "OpusReadStream.h"
 
 #include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <cstdint>
+#include <algorithm>
 
 namespace breakfastquay
 {
@@ -61,11 +65,372 @@ opusbuilder(
 class OpusReadStream::D
 {
 public:
-    D() : file(0) { }
+    D() : file(0), lowRate(0), decodeRate(48000), started(false) { }
+    ~D();
+
+    class LowRateDecoder;
 
     OggOpusFile *file;
+    LowRateDecoder *lowRate;
+    size_t decodeRate;
+    bool started;
+
+    // Convert n frames of interleaved audio with inChannels channels,
+    // at the start of buf, into n frames with outChannels channels,
+    // in place and in a single pass. The channel mapping is the same
+    // as that of v_reconfigure_channels: mono is duplicated to every
+    // output channel, anything is mixed down to mono by averaging,
+    // and otherwise channels are copied across with any extra output
+    // channels left silent. buf must have room for n * max(inChannels,
+    // outChannels) samples. We work backwards when expanding and
+    // forwards when reducing, so that no sample is overwritten before
+    // it has been read.
+    static void reconfigureInterleaved(float *buf, int outChannels,
+                                       int inChannels, int n) {
+
+        if (outChannels == inChannels) {
+            return;
+        }
+
+        if (inChannels == 1) {
+            if (outChannels == 2) {
+                for (int i = n - 1; i >= 0; --i) {
+                    float v = buf[i];
+                    buf[i * 2] = v;
+                    buf[i * 2 + 1] = v;
+                }
+            } else {
+                for (int i = n - 1; i >= 0; --i) {
+                    float v = buf[i];
+                    for (int c = 0; c < outChannels; ++c) {
+                        buf[i * outChannels + c] = v;
+                    }
+                }
+            }
+            return;
+        }
+
+        if (outChannels == 1) {
+            if (inChannels == 2) {
+                for (int i = 0; i < n; ++i) {
+                    buf[i] = (buf[i * 2] + buf[i * 2 + 1]) * 0.5f;
+                }
+            } else {
+                float scale = 1.f / float(inChannels);
+                for (int i = 0; i < n; ++i) {
+                    float sum = 0.f;
+                    for (int c = 0; c < inChannels; ++c) {
+                        sum += buf[i * inChannels + c];
+                    }
+                    buf[i] = sum * scale;
+                }
+            }
+            return;
+        }
+
+        if (outChannels < inChannels) {
+            for (int i = 0; i < n; ++i) {
+                for (int c = 0; c < outChannels; ++c) {
+                    buf[i * outChannels + c] = buf[i * inChannels + c];
+                }
+            }
+        } else {
+            for (int i = n - 1; i >= 0; --i) {
+                for (int c = outChannels - 1; c >= inChannels; --c) {
+                    buf[i * outChannels + c] = 0.f;
+                }
+                for (int c = inChannels - 1; c >= 0; --c) {
+                    buf[i * outChannels + c] = buf[i * inChannels + c];
+                }
+            }
+        }
+    }
 };
 
+// libopusfile always decodes at 48kHz, but the Opus decoder itself
+// can decode at 8, 12, 16, or 24kHz too, at proportionately lower
+// cost and without the need for a separate resampling pass when that
+// is the rate the caller wants. This class does that, reading the Ogg
+// Opus stream directly with libogg and decoding with libopus. It
+// handles chained streams, pre-skip and end trimming, but doesn't
+// support seeking.
+
+class OpusReadStream::D::LowRateDecoder
+{
+public:
+    LowRateDecoder(std::string path, int rate, int outChannels) :
+        m_file(0),
+        m_rate(rate),
+        m_outChannels(outChannels),
+        m_serial(0),
+        m_haveStream(false),
+        m_inBosGroup(false),
+        m_headerPackets(0),
+        m_decoder(0),
+        m_linkChannels(0),
+        m_preSkip(0),
+        m_granule(0),
+        m_pcm(0),
+        m_pcmCapacity(0),
+        m_pcmStart(0),
+        m_pcmEnd(0),
+        m_finished(false) {
+        //!!! Windows: use wchar version
+        m_file = fopen(path.c_str(), "rb");
+        ogg_sync_init(&m_sync);
+    }
+
+    ~LowRateDecoder() {
+        if (m_decoder) opus_multistream_decoder_destroy(m_decoder);
+        if (m_haveStream) ogg_stream_clear(&m_stream);
+        ogg_sync_clear(&m_sync);
+        if (m_file) fclose(m_file);
+        deallocate(m_pcm);
+    }
+
+    bool isOK() const {
+        return m_file != 0;
+    }
+
+    std::string getError() const {
+        return m_error;
+    }
+
+    // Read up to count frames at our decode rate, with our output
+    // channel count. Return the number of frames read, which will be
+    // less than count only at the end of the stream, or -1 on error.
+    int read(float *frames, int count) {
+        int got = 0;
+        while (got < count) {
+            if (m_pcmStart == m_pcmEnd) {
+                if (m_finished) break;
+                decodeNextPacket();
+                continue;
+            }
+            int n = m_pcmEnd - m_pcmStart;
+            if (n > count - got) n = count - got;
+            v_copy(frames + got * m_outChannels,
+                   m_pcm + m_pcmStart * m_outChannels,
+                   n * m_outChannels);
+            m_pcmStart += n;
+            got += n;
+        }
+        if (got == 0 && m_error != "") {
+            return -1;
+        }
+        return got;
+    }
+
+private:
+    FILE *m_file;
+    int m_rate;
+    int m_outChannels;
+    ogg_sync_state m_sync;
+    ogg_stream_state m_stream;
+    int m_serial;
+    bool m_haveStream;
+    bool m_inBosGroup;     // no non-BOS page seen since the last BOS page
+    int m_headerPackets;
+    OpusMSDecoder *m_decoder;
+    int m_linkChannels;
+    int m_preSkip;         // frames at m_rate still to be discarded
+    ogg_int64_t m_granule; // 48kHz samples decoded so far in this link
+    float *m_pcm;
+    int m_pcmCapacity;     // samples
+    int m_pcmStart;
+    int m_pcmEnd;
+    bool m_finished;
+    std::string m_error;
+
+    // Longest possible Opus packet is 120ms
+    int maxPacketFrames() const {
+        return (m_rate / 1000) * 120;
+    }
+    
+    bool readPage(ogg_page &page) {
+        while (ogg_sync_pageout(&m_sync, &page) != 1) {
+            static const long bufsize = 16384;
+            char *buf = ogg_sync_buffer(&m_sync, bufsize);
+            size_t n = fread(buf, 1, bufsize, m_file);
+            if (n == 0) {
+                return false;
+            }
+            ogg_sync_wrote(&m_sync, long(n));
+        }
+        return true;
+    }
+
+    bool readPacket(ogg_packet &packet) {
+        while (true) {
+            if (m_haveStream) {
+                int rv = ogg_stream_packetout(&m_stream, &packet);
+                if (rv == 1) return true;
+                if (rv < 0) continue; // hole in data: carry on
+            }
+            ogg_page page;
+            if (!readPage(page)) {
+                return false;
+            }
+            if (ogg_page_bos(&page)) {
+                if (m_inBosGroup) {
+                    // The BOS pages of all logical streams in a link
+                    // are grouped together at its start (RFC 3533
+                    // section 4), so a further BOS page before any
+                    // non-BOS page belongs to another stream
+                    // multiplexed with ours, which we ignore
+                    continue;
+                }
+                // Start of a new link in a chain
+                m_inBosGroup = true;
+                m_serial = ogg_page_serialno(&page);
+                if (m_haveStream) {
+                    ogg_stream_reset_serialno(&m_stream, m_serial);
+                } else {
+                    ogg_stream_init(&m_stream, m_serial);
+                    m_haveStream = true;
+                }
+                m_headerPackets = 0;
+            } else {
+                m_inBosGroup = false;
+                if (!m_haveStream ||
+                    ogg_page_serialno(&page) != m_serial) {
+                    continue;
+                }
+            }
+            ogg_stream_pagein(&m_stream, &page);
+        }
+    }
+
+    bool readIdHeader(const ogg_packet &packet) {
+        const unsigned char *p = packet.packet;
+        if (packet.bytes < 19 || memcmp(p, "OpusHead", 8)) {
+            m_error = "stream does not start with an Opus ID header";
+            return false;
+        }
+        int channels = p[9];
+        int preSkip = p[10] | (p[11] << 8);
+        int gain = int16_t(p[16] | (p[17] << 8));
+        int family = p[18];
+        int streams = 1, coupled = (channels > 1 ? 1 : 0);
+        unsigned char defaultMapping[2] = { 0, 1 };
+        const unsigned char *mapping = defaultMapping;
+        if (family != 0) {
+            if (packet.bytes < 21 + channels) {
+                m_error = "Opus ID header is truncated";
+                return false;
+            }
+            streams = p[19];
+            coupled = p[20];
+            mapping = p + 21;
+        } else if (channels > 2) {
+            m_error = "invalid channel count for mapping family 0";
+            return false;
+        }
+        if (channels < 1) {
+            m_error = "invalid channel count in Opus ID header";
+            return false;
+        }
+
+        if (m_decoder) {
+            opus_multistream_decoder_destroy(m_decoder);
+            m_decoder = 0;
+        }
+        int err = 0;
+        m_decoder = opus_multistream_decoder_create
+            (m_rate, channels, streams, coupled, mapping, &err);
+        if (err != OPUS_OK || !m_decoder) {
+            m_error = std::string("failed to create Opus decoder: ") +
+                opus_strerror(err);
+            m_decoder = 0;
+            return false;
+        }
+        if (gain != 0) {
+            opus_multistream_decoder_ctl(m_decoder, OPUS_SET_GAIN(gain));
+        }
+
+        m_linkChannels = channels;
+        m_preSkip = int((ogg_int64_t(preSkip) * m_rate + 47999) / 48000);
+        m_granule = 0;
+
+        // Room to decode a packet and then remap it in place
+        int needed = maxPacketFrames() *
+            std::max(m_linkChannels, m_outChannels);
+        if (needed > m_pcmCapacity) {
+            deallocate(m_pcm);
+            m_pcm = allocate<float>(needed);
+            m_pcmCapacity = needed;
+        }
+        return true;
+    }
+
+    // Decode the next packet into m_pcm. Return false if there was
+    // no audio to decode (either because the stream has finished, or
+    // because the packet was a header, or because of an error, in
+    // which case m_error will be set).
+    bool decodeNextPacket() {
+        ogg_packet packet;
+        if (!readPacket(packet)) {
+            m_finished = true;
+            return false;
+        }
+        if (m_headerPackets == 0) {
+            ++m_headerPackets;
+            if (!readIdHeader(packet)) {
+                m_finished = true;
+            }
+            return false;
+        }
+        if (m_headerPackets == 1) {
+            // comment header: we have already read the tags through
+            // libopusfile
+            ++m_headerPackets;
+            return false;
+        }
+
+        int obtained = opus_multistream_decode_float
+            (m_decoder, packet.packet, packet.bytes,
+             m_pcm, maxPacketFrames(), 0);
+        if (obtained < 0) {
+            m_error = std::string("error in decoder: ") +
+                opus_strerror(obtained);
+            m_finished = true;
+            return false;
+        }
+
+        int start = 0, end = obtained;
+
+        // Trim the end of the final packet of the link, if its
+        // granule position says that not all of it is wanted
+        int nominal = opus_packet_get_nb_samples
+            (packet.packet, packet.bytes, 48000);
+        if (nominal < 0) {
+            nominal = int((ogg_int64_t(obtained) * 48000) / m_rate);
+        }
+        if (packet.e_o_s && packet.granulepos >= 0 &&
+            packet.granulepos < m_granule + nominal) {
+            ogg_int64_t wanted = packet.granulepos - m_granule;
+            if (wanted < 0) wanted = 0;
+            end = int((wanted * m_rate) / 48000);
+        }
+        m_granule += nominal;
+
+        if (m_preSkip > 0) {
+            start = std::min(m_preSkip, end);
+            m_preSkip -= start;
+        }
+
+        D::reconfigureInterleaved(m_pcm, m_outChannels, m_linkChannels, end);
+        m_pcmStart = start;
+        m_pcmEnd = end;
+        return end > start;
+    }
+};
+
+OpusReadStream::D::~D()
+{
+    delete lowRate;
+}
+
 OpusReadStream::OpusReadStream(std::string path) :
     m_path(path),
     m_d(new D)
@@ -130,6 +495,18 @@ OpusReadStream::getFrames(size_t count, float *frames)
     if (!m_d->file) return 0;
     if (count == 0) return 0;
 
+    m_d->started = true;
+
+    if (m_d->lowRate) {
+        int obtained = m_d->lowRate->read(frames, int(count));
+        if (obtained < 0) {
+            m_error = "OpusReadStream: Failed to read from file (" +
+                m_d->lowRate->getError() + ")";
+            throw InvalidFileFormat(m_path, "error in decoder");
+        }
+        return obtained;
+    }
+
 //    cerr << "getFrames: working" << endl;
 
     int totalRequired = int(count);
@@ -193,21 +570,12 @@ OpusReadStream::getFrames(size_t count, float *frames)
                 // despite precaution earlier - truncate if so
                 obtained = (totalRequired - totalObtained);
             }
-            
-            float **read =
-                allocate_channels<float>(channelsRead, obtained);
-            float **toWrite =
-                allocate_channels<float>(channelsRequired, obtained);
-            
-            v_deinterleave(read, fptr, channelsRead, obtained);
-            v_reconfigure_channels(toWrite, channelsRequired,
-                                   read, channelsRead,
-                                   obtained);
-
-            v_interleave(fptr, toWrite, channelsRequired, obtained);
-        
-            deallocate_channels(read, channelsRead);
-            deallocate_channels(toWrite, channelsRequired);
+
+            // This happens on every read for the rest of a link with
+            // a different channel count, so we remap in place rather
+            // than deinterleaving through temporary buffers
+            D::reconfigureInterleaved(fptr, channelsRequired,
+                                      channelsRead, obtained);
         }
         
         totalObtained += obtained;
@@ -217,6 +585,49 @@ OpusReadStream::getFrames(size_t count, float *frames)
     return totalObtained;
 }
 
+size_t
+OpusReadStream::performSetDecodeSampleRate(size_t rate)
+{
+    if (m_d->started || !m_d->file) {
+        // Too late to switch decoder
+        return m_d->decodeRate;
+    }
+
+    // Pick the lowest rate the decoder supports that is no lower
+    // than the requested one: we only need to resample if it is not
+    // the same
+    static const size_t supported[] = { 8000, 12000, 16000, 24000 };
+    size_t target = 48000;
+    for (size_t i = 0; i < sizeof(supported)/sizeof(supported[0]); ++i) {
+        if (rate <= supported[i]) {
+            target = supported[i];
+            break;
+        }
+    }
+
+    if (target == m_d->decodeRate) {
+        return target;
+    }
+
+    delete m_d->lowRate;
+    m_d->lowRate = 0;
+    m_d->decodeRate = 48000;
+    
+    if (target != 48000) {
+        D::LowRateDecoder *decoder = new D::LowRateDecoder
+            (m_path, int(target), int(m_channelCount));
+        if (decoder->isOK()) {
+            m_d->lowRate = decoder;
+            m_d->decodeRate = target;
+        } else {
+            // We can still fall back to libopusfile
+            delete decoder;
+        }
+    }
+
+    return m_d->decodeRate;
+}
+
 OpusReadStream::~OpusReadStream()
 {
     if (m_d->file) {
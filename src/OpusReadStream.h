@@ -55,6 +55,7 @@ public:
 
 protected:
     virtual size_t getFrames(size_t count, float *frames);
+    virtual size_t performSetDecodeSampleRate(size_t rate);
 
     std::string m_path;
     std::string m_error;
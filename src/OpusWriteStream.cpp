@@ -40,9 +40,19 @@
 #include "OpusWriteStream.h"
 
 #include <opus/opusenc.h>
+#include <ogg/ogg.h>
 
 #include <iostream>
 #include <sstream>
+#include <cstdio>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <deque>
+#include <future>
+#include <memory>
+#include <random>
 
 namespace breakfastquay
 {
@@ -65,11 +75,340 @@ opuswritebuilder(
 class OpusWriteStream::D
 {
 public:
-    D() : encoder(0), begun(false) { }
+    D() : comments(0), encoder(0), begun(false), headerWritten(false),
+          file(0), parallel(false), rate(0), channels(0),
+          segmentFrames(0), overlapFrames(0), prefixFrames(0),
+          serial(0), threads(1) { }
 
     OggOpusComments *comments;
     OggOpusEnc *encoder;
     bool begun;
+    bool headerWritten;
+
+    // We open the file ourselves and give the encoder callbacks to
+    // write to it, so that we can flush it
+    FILE *file;
+
+    static int writeToFile(void *data, const unsigned char *ptr,
+                           opus_int32 len) {
+        if (fwrite(ptr, 1, len, (FILE *)data) != size_t(len)) {
+            return 1;
+        }
+        return 0;
+    }
+
+    static int closeFile(void *) {
+        // We close the file ourselves after destroying the encoder
+        return 0;
+    }
+    
+    // Parallel encoding (see Options::encodeThreads). Each segment
+    // of the input is encoded by its own encoder, on its own thread,
+    // into memory, and the results are appended to the file in order
+    // as a chained stream. To avoid audible discontinuities at the
+    // joins, each segment's encoder is first fed a short overlap from
+    // the end of the previous segment, which the decoder discards
+    // because we extend the pre-skip in that link's ID header to
+    // cover it.
+    
+    bool parallel;
+    std::string path;
+    int rate;
+    int channels;
+    Options options;
+    size_t segmentFrames;
+    size_t overlapFrames;
+    std::vector<float> segment; // overlap prefix followed by new audio
+    size_t prefixFrames;
+    int serial;
+    size_t threads;
+    std::deque<std::future<std::string> > pending;
+
+    void appendFrames(size_t count, const float *frames) {
+        while (count > 0) {
+            size_t have = segment.size() / channels - prefixFrames;
+            size_t n = std::min(count, segmentFrames - have);
+            segment.insert(segment.end(), frames, frames + n * channels);
+            frames += n * channels;
+            count -= n;
+            if (have + n == segmentFrames) {
+                submitSegment();
+            }
+        }
+    }
+
+    void submitSegment() {
+        size_t total = segment.size() / channels;
+        if (total == prefixFrames) {
+            return;
+        }
+        std::shared_ptr<std::vector<float> > audio(new std::vector<float>);
+        audio->swap(segment);
+        size_t nextPrefix = std::min(overlapFrames, total);
+        segment.reserve((nextPrefix + segmentFrames) * channels);
+        segment.assign(audio->end() - nextPrefix * channels, audio->end());
+        pending.push_back(std::async(std::launch::async, &D::encodeSegment,
+                                     audio, prefixFrames, rate, channels,
+                                     options, serial++, path));
+        prefixFrames = nextPrefix;
+        while (pending.size() > threads) {
+            writeNextSegment();
+        }
+    }
+
+    void writeNextSegment() {
+        std::future<std::string> f = std::move(pending.front());
+        pending.pop_front();
+        std::string encoded = f.get();
+        if (fwrite(encoded.data(), 1, encoded.size(), file) != encoded.size()) {
+            throw FileOperationFailed(path, "write");
+        }
+    }
+
+    // Write out any segments that have already been encoded, without
+    // waiting for the rest
+    void writeReadySegments() {
+        while (!pending.empty() &&
+               pending.front().wait_for(std::chrono::seconds(0)) ==
+               std::future_status::ready) {
+            writeNextSegment();
+        }
+    }
+    
+    void finishSegments() {
+        submitSegment();
+        while (!pending.empty()) {
+            writeNextSegment();
+        }
+    }
+
+    static int appendToString(void *data, const unsigned char *ptr,
+                              opus_int32 len) {
+        ((std::string *)data)->append((const char *)ptr, len);
+        return 0;
+    }
+    
+    static int closeString(void *) {
+        return 0;
+    }
+
+    static std::string encodeSegment(std::shared_ptr<std::vector<float> > audio,
+                                     size_t prefixFrames,
+                                     int rate, int channels,
+                                     Options options, int serial,
+                                     std::string path) {
+        std::string encoded;
+        OpusEncCallbacks callbacks = { appendToString, closeString };
+        OggOpusComments *comments = ope_comments_create();
+        int err = 0;
+        OggOpusEnc *encoder = ope_encoder_create_callbacks
+            (&callbacks, &encoded, comments, rate, channels,
+             channels > 2 ? 1 : 0, &err);
+        if (err || !encoder) {
+            ope_comments_destroy(comments);
+            throw FileOperationFailed(path, "create encoder",
+                                      ope_strerror(err));
+        }
+        std::string failure = configure(encoder, options);
+        if (failure == "" &&
+            ope_encoder_ctl(encoder, OPE_SET_SERIALNO(serial)) != OPE_OK) {
+            failure = "failed to set serial number";
+        }
+        if (failure == "" &&
+            ope_encoder_write_float(encoder, audio->data(),
+                                    int(audio->size() / channels)) != OPE_OK) {
+            failure = "failed to encode segment";
+        }
+        if (failure == "" && ope_encoder_drain(encoder) != OPE_OK) {
+            failure = "failed to drain encoder";
+        }
+        ope_encoder_destroy(encoder);
+        ope_comments_destroy(comments);
+        if (failure == "" && prefixFrames > 0) {
+            int extra = int(round(double(prefixFrames) * 48000.0 / rate));
+            if (!extendPreSkip(encoded, extra)) {
+                failure = "failed to update pre-skip in ID header";
+            }
+        }
+        if (failure != "") {
+            throw FileOperationFailed(path, "encode", failure);
+        }
+        return encoded;
+    }
+
+    // Add extra (in 48kHz samples) to the pre-skip field of the ID
+    // header at the start of the given Ogg Opus stream. The ID header
+    // is always alone on the first page, so only that page's checksum
+    // has to be updated.
+    static bool extendPreSkip(std::string &stream, int extra) {
+        if (stream.size() < 27 || stream.compare(0, 4, "OggS") != 0) {
+            return false;
+        }
+        unsigned char *data = (unsigned char *)&stream[0];
+        long headerLen = 27 + data[26];
+        if (long(stream.size()) < headerLen) {
+            return false;
+        }
+        long bodyLen = 0;
+        for (long i = 27; i < headerLen; ++i) {
+            bodyLen += data[i];
+        }
+        if (long(stream.size()) < headerLen + bodyLen || bodyLen < 19) {
+            return false;
+        }
+        unsigned char *body = data + headerLen;
+        if (memcmp(body, "OpusHead", 8)) {
+            return false;
+        }
+        int preSkip = (body[10] | (body[11] << 8)) + extra;
+        if (preSkip > 65535) {
+            return false;
+        }
+        body[10] = (unsigned char)(preSkip & 0xff);
+        body[11] = (unsigned char)((preSkip >> 8) & 0xff);
+        ogg_page page;
+        page.header = data;
+        page.header_len = headerLen;
+        page.body = body;
+        page.body_len = bodyLen;
+        ogg_page_checksum_set(&page);
+        return true;
+    }
+
+    // Check that the given options are acceptable to an encoder
+    // with the given rate and channel count, by configuring one that
+    // writes nowhere. Return an empty string if so, or an
+    // explanation if not.
+    static std::string validate(const Options &options,
+                                int rate, int channels) {
+        std::string discard;
+        OpusEncCallbacks callbacks = { appendToString, closeString };
+        OggOpusComments *comments = ope_comments_create();
+        int err = 0;
+        OggOpusEnc *encoder = ope_encoder_create_callbacks
+            (&callbacks, &discard, comments, rate, channels,
+             channels > 2 ? 1 : 0, &err);
+        if (err || !encoder) {
+            ope_comments_destroy(comments);
+            return std::string("failed to create encoder: ") + ope_strerror(err);
+        }
+        std::string failure = configure(encoder, options);
+        ope_encoder_destroy(encoder);
+        ope_comments_destroy(comments);
+        return failure;
+    }
+
+    // Apply the encoder settings from the given options. Return an
+    // empty string on success, or an explanation on failure.
+    static std::string configure(OggOpusEnc *encoder, const Options &options) {
+
+        std::ostringstream os;
+        int err = OPE_OK;
+
+        if (options.bitrate > 0) {
+            err = ope_encoder_ctl(encoder, OPUS_SET_BITRATE(options.bitrate));
+            if (err != OPE_OK) {
+                os << "unsupported bitrate " << options.bitrate;
+                return os.str();
+            }
+        }
+
+        if (options.complexity >= 0) {
+            err = ope_encoder_ctl(encoder,
+                                  OPUS_SET_COMPLEXITY(options.complexity));
+            if (err != OPE_OK) {
+                os << "unsupported complexity " << options.complexity
+                   << " (should be 0-10)";
+                return os.str();
+            }
+        }
+
+        switch (options.bitrateMode) {
+        case Options::DefaultBitrateMode:
+            break;
+        case Options::ConstantBitrate:
+            err = ope_encoder_ctl(encoder, OPUS_SET_VBR(0));
+            break;
+        case Options::VariableBitrate:
+            err = ope_encoder_ctl(encoder, OPUS_SET_VBR(1));
+            if (err == OPE_OK) {
+                err = ope_encoder_ctl(encoder, OPUS_SET_VBR_CONSTRAINT(0));
+            }
+            break;
+        case Options::ConstrainedVariableBitrate:
+            err = ope_encoder_ctl(encoder, OPUS_SET_VBR(1));
+            if (err == OPE_OK) {
+                err = ope_encoder_ctl(encoder, OPUS_SET_VBR_CONSTRAINT(1));
+            }
+            break;
+        }
+        if (err != OPE_OK) {
+            return "failed to set bitrate mode";
+        }
+
+        switch (options.signalType) {
+        case Options::DefaultSignalType:
+            break;
+        case Options::VoiceSignal:
+            err = ope_encoder_ctl(encoder, OPUS_SET_SIGNAL(OPUS_SIGNAL_VOICE));
+            break;
+        case Options::MusicSignal:
+            err = ope_encoder_ctl(encoder, OPUS_SET_SIGNAL(OPUS_SIGNAL_MUSIC));
+            break;
+        }
+        if (err != OPE_OK) {
+            return "failed to set signal type";
+        }
+
+        if (options.maxPageLatencyMs > 0.0) {
+            // Both the muxing delay (how long completed packets may
+            // wait before being written as a page) and the decision
+            // delay (how much input is buffered before encoding) are
+            // in 48kHz samples
+            int delay = int(round(options.maxPageLatencyMs * 48.0));
+            err = ope_encoder_ctl(encoder, OPE_SET_MUXING_DELAY(delay));
+            if (err == OPE_OK) {
+                err = ope_encoder_ctl(encoder, OPE_SET_DECISION_DELAY(delay));
+            }
+            if (err != OPE_OK) {
+                os << "unsupported page latency " << options.maxPageLatencyMs
+                   << "ms";
+                return os.str();
+            }
+        }
+
+        if (options.frameDurationMs > 0.0) {
+            static const struct { double ms; int code; } durations[] = {
+                { 2.5, OPUS_FRAMESIZE_2_5_MS },
+                { 5.0, OPUS_FRAMESIZE_5_MS },
+                { 10.0, OPUS_FRAMESIZE_10_MS },
+                { 20.0, OPUS_FRAMESIZE_20_MS },
+                { 40.0, OPUS_FRAMESIZE_40_MS },
+                { 60.0, OPUS_FRAMESIZE_60_MS },
+                { 80.0, OPUS_FRAMESIZE_80_MS },
+                { 100.0, OPUS_FRAMESIZE_100_MS },
+                { 120.0, OPUS_FRAMESIZE_120_MS }
+            };
+            int code = 0;
+            for (size_t i = 0; i < sizeof(durations)/sizeof(durations[0]); ++i) {
+                if (options.frameDurationMs == durations[i].ms) {
+                    code = durations[i].code;
+                    break;
+                }
+            }
+            if (code != 0) {
+                err = ope_encoder_ctl
+                    (encoder, OPUS_SET_EXPERT_FRAME_DURATION(code));
+            }
+            if (code == 0 || err != OPE_OK) {
+                os << "unsupported frame duration " << options.frameDurationMs
+                   << "ms";
+                return os.str();
+            }
+        }
+
+        return "";
+    }
 };
 
 OpusWriteStream::OpusWriteStream(Target target) :
@@ -82,13 +421,56 @@ OpusWriteStream::OpusWriteStream(Target target) :
 
     //!!! +windows file encoding?
 
+    m_d->file = fopen(getPath().c_str(), "wb");
+    if (!m_d->file) {
+        m_error = "OpusWriteStream: Unable to open file for writing";
+        std::cerr << m_error << std::endl;
+        throw FailedToWriteFile(getPath());
+    }
+
+    const Options &options = getOptions();
+    
+    if (options.encodeThreads > 1) {
+        // Segments are encoded on worker threads, possibly not
+        // until we are being destroyed, so check the options with a
+        // throwaway encoder now in order to fail as the sequential
+        // path would
+        std::string failure = D::validate(options, int(getSampleRate()),
+                                          int(getChannelCount()));
+        if (failure != "") {
+            m_error = "OpusWriteStream: Failed to configure encoder: " + failure;
+            std::cerr << m_error << std::endl;
+            fclose(m_d->file);
+            m_d->file = 0;
+            remove(getPath().c_str());
+            throw FileOperationFailed(getPath(), "configure encoder", failure);
+        }
+        m_d->parallel = true;
+        m_d->path = getPath();
+        m_d->rate = int(getSampleRate());
+        m_d->channels = int(getChannelCount());
+        m_d->options = options;
+        double duration = options.segmentDurationSeconds;
+        if (duration <= 0.0) duration = Options().segmentDurationSeconds;
+        m_d->segmentFrames = size_t(round(duration * getSampleRate()));
+        if (m_d->segmentFrames < 1) m_d->segmentFrames = 1;
+        m_d->overlapFrames = getSampleRate() / 10;
+        m_d->serial = int(std::random_device()() & 0x7fffffff);
+        m_d->threads = options.encodeThreads;
+        return;
+    }
+
     m_d->comments = ope_comments_create();
+
+    OpusEncCallbacks callbacks = { D::writeToFile, D::closeFile };
     
     int err = 0;
-    m_d->encoder = ope_encoder_create_file(getPath().c_str(), m_d->comments,
-                                           getSampleRate(), getChannelCount(),
-                                           getChannelCount() > 2 ? 1 : 0,
-                                           &err);
+    m_d->encoder = ope_encoder_create_callbacks(&callbacks, m_d->file,
+                                                m_d->comments,
+                                                getSampleRate(),
+                                                getChannelCount(),
+                                                getChannelCount() > 2 ? 1 : 0,
+                                                &err);
 
     if (err || !m_d->encoder) {
         std::ostringstream os;    
@@ -97,12 +479,41 @@ OpusWriteStream::OpusWriteStream(Target target) :
         m_error = os.str();
         std::cerr << m_error << std::endl;
         m_d->encoder = 0;
+        ope_comments_destroy(m_d->comments);
+        fclose(m_d->file);
+        m_d->file = 0;
         throw FailedToWriteFile(getPath());
     }    
+
+    std::string failure = D::configure(m_d->encoder, getOptions());
+    if (failure != "") {
+        m_error = "OpusWriteStream: Failed to configure encoder: " + failure;
+        std::cerr << m_error << std::endl;
+        ope_encoder_destroy(m_d->encoder);
+        ope_comments_destroy(m_d->comments);
+        m_d->encoder = 0;
+        fclose(m_d->file);
+        m_d->file = 0;
+        remove(getPath().c_str());
+        throw FileOperationFailed(getPath(), "configure encoder", failure);
+    }
 }
 
 OpusWriteStream::~OpusWriteStream()
 {
+    if (m_d->parallel) {
+        try {
+            m_d->finishSegments();
+        } catch (const std::exception &e) {
+            std::cerr << "WARNING: OpusWriteStream: failed to finish encoding: "
+                      << e.what() << std::endl;
+            while (!m_d->pending.empty()) {
+                m_d->pending.front().wait();
+                m_d->pending.pop_front();
+            }
+        }
+    }
+    
     if (m_d->encoder) {
 #ifdef DEBUG_OPUS_WRITE
         std::cerr << "OpusWriteStream::~OpusWriteStream: closing" << std::endl;
@@ -125,11 +536,32 @@ OpusWriteStream::~OpusWriteStream()
         ope_encoder_destroy(m_d->encoder);
         ope_comments_destroy(m_d->comments);
     }
+
+    if (m_d->file) {
+        fclose(m_d->file);
+    }
+    
+    delete m_d;
 }
 
 void
 OpusWriteStream::putInterleavedFrames(size_t count, const float *frames)
 {
+    AudioStreamStatistics::Timer timer
+        (m_statistics, &AudioStreamStatistics::codecSeconds);
+    countFrames(count);
+    
+    if (count > 0 && m_d->parallel) {
+        try {
+            m_d->appendFrames(count, frames);
+        } catch (const FileOperationFailed &) {
+            m_error = "OpusWriteStream: Failed to encode or write segment";
+            std::cerr << m_error << std::endl;
+            throw;
+        }
+        return;
+    }
+    
     if (count == 0 || !m_d->encoder) {
 #ifdef DEBUG_OPUS_WRITE
         std::cerr << "OpusWriteStream::putInterleavedFrames: No encoder!"
@@ -159,6 +591,41 @@ OpusWriteStream::putInterleavedFrames(size_t count, const float *frames)
 void
 OpusWriteStream::flush()
 {
+    if (!m_d->file) {
+        return;
+    }
+
+    // The encoder holds on to audio until it has enough to make
+    // pages of up to Options::maxPageLatencyMs (or its default of
+    // about two seconds), and there is no way to make it emit a
+    // partial page without ending the stream. So what we can do here
+    // is to make sure the headers have been written, and push out
+    // everything the encoder has already given us.
+
+    if (m_d->parallel) {
+        try {
+            m_d->writeReadySegments();
+        } catch (const FileOperationFailed &) {
+            m_error = "OpusWriteStream: Failed to encode or write segment";
+            std::cerr << m_error << std::endl;
+            throw;
+        }
+    } else if (m_d->encoder && !m_d->begun && !m_d->headerWritten) {
+        int err = ope_encoder_flush_header(m_d->encoder);
+        if (err) {
+            std::ostringstream os;    
+            os << "OpusWriteStream: Failed to write headers (error code "
+               << err << ")";
+            m_error = os.str();
+            std::cerr << m_error << std::endl;
+            throw FileOperationFailed(getPath(), "flush");
+        }
+        m_d->headerWritten = true;
+    }
+
+    if (fflush(m_d->file)) {
+        throw FileOperationFailed(getPath(), "flush");
+    }
 }
 
 }
@@ -0,0 +1,515 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudiostream
+
+    A small library wrapping various audio file read/write
+    implementations in C++.
+
+    Copyright 2007-2022 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#include "../bqaudiostream/PrefetchingAudioReadStream.h"
+
+#include <bqvec/RingBuffer.h>
+#include <bqvec/Allocators.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <exception>
+#include <cmath>
+
+namespace breakfastquay
+{
+
+// The source's estimated frame count, which is at the rate it
+// delivers audio at, converted to the given rate. A resampling
+// source is not seekable, so its count need not be exact.
+static size_t
+getFrameCountAt(const AudioReadStream *source, size_t rate)
+{
+    size_t count = source->getEstimatedFrameCount();
+    size_t from = source->getRetrievalSampleRate();
+    if (count == 0 || from == 0 || rate == from) {
+        return count;
+    }
+    return size_t(round(double(count) * double(rate) / double(from)));
+}
+
+class PrefetchingAudioReadStream::D
+{
+public:
+    D(AudioReadStream *s, double seconds) :
+        source(s),
+        prefetchSeconds(seconds),
+        channels(int(s->getRetrievalChannelCount())),
+        rate(s->getRetrievalSampleRate()),
+        sourceMap(s->getRetrievalChannelMap()),
+        buffer(0),
+        block(0),
+        blockFrames(1024),
+        begun(false),
+        finished(false),
+        failed(false),
+        stopping(false),
+        written(0),
+        seekFrame(0),
+        seekRequested(0),
+        seekDone(0),
+        seekBoundary(0),
+        realTime(false),
+        readTotal(0),
+        awaitedSeek(0),
+        discarding(false),
+        status(ReadComplete),
+        underruns(0) {
+        allocateBlock();
+    }
+
+    ~D() {
+        stop();
+        delete buffer;
+        deallocate(block);
+        delete source;
+    }
+    
+    AudioReadStream *source;
+    double prefetchSeconds;
+    int channels;
+    size_t rate;
+
+    // The source's own channel map, at the time it was wrapped
+    std::vector<std::vector<int>> sourceMap;
+
+    RingBuffer<float> *buffer;
+    float *block;
+    int blockFrames;
+
+    // Prefetching starts with the first read or seek, or when
+    // real-time mode is switched on, so that a retrieval rate or
+    // channel map set before then can be handed to the source
+    // without losing anything already prefetched
+    bool begun;
+
+    std::thread thread;
+    std::mutex mutex;
+    std::condition_variable cond;
+    std::atomic<bool> finished;
+    std::atomic<bool> failed;
+    std::atomic<bool> stopping;
+    std::exception_ptr exception;
+
+    // Seeks in real-time mode are posted to the background thread.
+    // It counts the samples it has written to the buffer, and on
+    // carrying out a seek, records the count at that point as the
+    // boundary before which everything in the buffer is stale.
+    // Only the background thread writes these (apart from the
+    // request, which only the reader writes)
+    std::atomic<size_t> written;
+    std::atomic<size_t> seekFrame;
+    std::atomic<int> seekRequested;
+    std::atomic<int> seekDone;
+    std::atomic<size_t> seekBoundary;
+
+    // Reader-side state
+    bool realTime;
+    size_t readTotal;
+    int awaitedSeek;
+    bool discarding;
+    ReadStatus status;
+    size_t underruns;
+
+    void allocateBlock() {
+        deallocate(block);
+        block = allocate<float>(blockFrames * channels);
+    }
+    
+    void setSourceMap(const std::vector<std::vector<int>> &map) {
+        source->setRetrievalChannelMap(map);
+        channels = int(source->getRetrievalChannelCount());
+        allocateBlock();
+    }
+    
+    void start() {
+        begun = true;
+        int size = int(prefetchSeconds * double(rate)) * channels;
+        if (size < blockFrames * channels * 2) {
+            size = blockFrames * channels * 2;
+        }
+        if (!buffer || buffer->getSize() != size) {
+            delete buffer;
+            buffer = new RingBuffer<float>(size);
+        } else {
+            buffer->reset();
+        }
+        finished = false;
+        failed = false;
+        stopping = false;
+        exception = std::exception_ptr();
+        written = 0;
+        seekRequested = 0;
+        seekDone = 0;
+        seekBoundary = 0;
+        readTotal = 0;
+        awaitedSeek = 0;
+        discarding = false;
+        thread = std::thread([this]() { run(); });
+    }
+
+    void stop() {
+        if (!thread.joinable()) return;
+        {
+            std::lock_guard<std::mutex> guard(mutex);
+            stopping = true;
+        }
+        cond.notify_all();
+        thread.join();
+    }
+
+    void performPostedSeek(int request) {
+        bool ok = false;
+        try {
+            ok = source->seek(seekFrame);
+        } catch (...) {
+            exception = std::current_exception();
+        }
+        std::lock_guard<std::mutex> guard(mutex);
+        if (ok) {
+            exception = std::exception_ptr();
+        }
+        failed = !ok;
+        finished = !ok;
+        seekBoundary.store(written);
+        seekDone.store(request, std::memory_order_release);
+        cond.notify_all();
+    }
+    
+    void run() {
+        while (!stopping) {
+            int request = seekRequested.load(std::memory_order_acquire);
+            if (request != seekDone.load()) {
+                performPostedSeek(request);
+                continue;
+            }
+            if (finished ||
+                buffer->getWriteSpace() < blockFrames * channels) {
+                // Buffer is full, or there is nothing more to read
+                // unless we are asked to seek; wait for the reader.
+                // The timeout covers a notification we miss because
+                // the reader doesn't take the lock to notify, and a
+                // real-time reader, which doesn't notify at all
+                std::unique_lock<std::mutex> lock(mutex);
+                if (stopping) break;
+                cond.wait_for(lock, std::chrono::milliseconds(20));
+                continue;
+            }
+            size_t got = 0;
+            try {
+                got = source->getInterleavedFrames(blockFrames, block);
+            } catch (...) {
+                exception = std::current_exception();
+                failed = true;
+                got = 0;
+            }
+            if (got > 0) {
+                buffer->write(block, int(got) * channels);
+                written += got * channels;
+            }
+            if (got < size_t(blockFrames)) {
+                std::lock_guard<std::mutex> guard(mutex);
+                finished = true;
+            }
+            cond.notify_all();
+        }
+    }
+
+    void postSeek(size_t frame) {
+        seekFrame = frame;
+        awaitedSeek = seekRequested.fetch_add(1, std::memory_order_release) + 1;
+        discarding = true;
+    }
+
+    // Return true if no posted seek is outstanding, having discarded
+    // any stale audio from before the last one. If wait is false,
+    // only discard what is already buffered.
+    bool settleSeek(bool wait) {
+        if (!discarding) return true;
+        while (true) {
+            // Take the read space before checking whether the seek
+            // is done, so as never to discard audio written after it
+            int stale = buffer->getReadSpace();
+            if (seekDone.load(std::memory_order_acquire) == awaitedSeek) {
+                break;
+            }
+            buffer->skip(stale);
+            readTotal += stale;
+            if (!wait) return false;
+            std::unique_lock<std::mutex> lock(mutex);
+            if (seekDone.load() == awaitedSeek) break;
+            cond.wait_for(lock, std::chrono::milliseconds(20));
+        }
+        // Everything before the boundary was written before the
+        // seek, so is certainly in the buffer by now
+        size_t stale = seekBoundary.load() - readTotal;
+        buffer->skip(int(stale));
+        readTotal += stale;
+        discarding = false;
+        return true;
+    }
+    
+    size_t read(size_t count, float *frames) {
+        settleSeek(true);
+        size_t obtained = 0;
+        while (obtained < count) {
+            int available = buffer->getReadSpace() / channels;
+            if (available > 0) {
+                int n = int(count - obtained);
+                if (n > available) n = available;
+                buffer->read(frames + obtained * channels, n * channels);
+                readTotal += n * channels;
+                obtained += n;
+                cond.notify_all();
+                continue;
+            }
+            std::unique_lock<std::mutex> lock(mutex);
+            if (buffer->getReadSpace() > 0) continue;
+            if (finished) {
+                if (exception && obtained == 0) {
+                    std::exception_ptr e = exception;
+                    exception = std::exception_ptr();
+                    std::rethrow_exception(e);
+                }
+                break;
+            }
+            cond.wait_for(lock, std::chrono::milliseconds(20));
+        }
+        status = (obtained < count ? ReadEnded : ReadComplete);
+        return obtained;
+    }
+
+    size_t readRealTime(size_t count, float *frames) {
+        size_t obtained = 0;
+        bool ended = false;
+        if (settleSeek(false)) {
+            // Check for the end before looking at the buffer, as
+            // the background thread finishes writing before it sets
+            // finished
+            ended = finished;
+            int available = buffer->getReadSpace() / channels;
+            int n = int(count);
+            if (n > available) n = available;
+            buffer->read(frames, n * channels);
+            readTotal += n * channels;
+            obtained = n;
+        }
+        if (obtained == count) {
+            status = ReadComplete;
+            return obtained;
+        }
+        if (ended) {
+            status = (failed ? ReadFailed : ReadEnded);
+            return obtained;
+        }
+        v_zero(frames + obtained * channels, int(count - obtained) * channels);
+        status = ReadUnderrun;
+        ++underruns;
+        return count;
+    }
+};
+
+PrefetchingAudioReadStream::PrefetchingAudioReadStream(AudioReadStream *source,
+                                                       double prefetchSeconds) :
+    m_d(new D(source, prefetchSeconds))
+{
+    // What we buffer is what the source retrieves, so that is our
+    // native rate, whatever the source's own
+    m_channelCount = source->getRetrievalChannelCount();
+    m_sampleRate = source->getRetrievalSampleRate();
+    m_estimatedFrameCount = getFrameCountAt(source, m_sampleRate);
+    m_seekable = source->isSeekable();
+}
+
+PrefetchingAudioReadStream::~PrefetchingAudioReadStream()
+{
+    delete m_d;
+}
+
+std::string
+PrefetchingAudioReadStream::getTrackName() const
+{
+    return m_d->source->getTrackName();
+}
+
+std::string
+PrefetchingAudioReadStream::getArtistName() const
+{
+    return m_d->source->getArtistName();
+}
+
+std::string
+PrefetchingAudioReadStream::getError() const
+{
+    return m_d->source->getError();
+}
+
+size_t
+PrefetchingAudioReadStream::getBufferedFrameCount() const
+{
+    if (!m_d->begun) return 0;
+    int available = m_d->buffer->getReadSpace();
+    if (m_d->discarding) {
+        // A posted seek is outstanding, or done but with stale audio
+        // still to be discarded ahead of the new
+        if (m_d->seekDone.load(std::memory_order_acquire) !=
+            m_d->awaitedSeek) {
+            return 0;
+        }
+        available = int(m_d->buffer->getReadSpace() -
+                        (m_d->seekBoundary.load() - m_d->readTotal));
+    }
+    return size_t(available / m_d->channels);
+}
+
+void
+PrefetchingAudioReadStream::setRealTimeMode(bool realTime)
+{
+    m_d->realTime = realTime;
+    if (realTime && !m_d->begun) {
+        // Reads from now on must not start a thread
+        m_d->start();
+    }
+}
+
+bool
+PrefetchingAudioReadStream::isRealTimeMode() const
+{
+    return m_d->realTime;
+}
+
+PrefetchingAudioReadStream::ReadStatus
+PrefetchingAudioReadStream::getLastReadStatus() const
+{
+    return m_d->status;
+}
+
+size_t
+PrefetchingAudioReadStream::getUnderrunCount() const
+{
+    return m_d->underruns;
+}
+
+bool
+PrefetchingAudioReadStream::isGetFramesRealTimeSafe() const
+{
+    return m_d->realTime;
+}
+
+size_t
+PrefetchingAudioReadStream::getFrames(size_t count, float *frames)
+{
+    if (m_channelCount == 0 || count == 0) return 0;
+    if (!m_d->begun) {
+        m_d->start();
+    }
+    if (m_d->realTime) {
+        return m_d->readRealTime(count, frames);
+    } else {
+        return m_d->read(count, frames);
+    }
+}
+
+bool
+PrefetchingAudioReadStream::performSeek(size_t frame)
+{
+    if (m_d->realTime) {
+        size_t count = getEstimatedFrameCount();
+        if (count > 0 && frame > count) {
+            return false;
+        }
+        m_d->postSeek(frame);
+        return true;
+    }
+    m_d->stop();
+    bool result = m_d->source->seek(frame);
+    // Seeking may have taught the source its true length
+    m_estimatedFrameCount = getFrameCountAt(m_d->source, m_sampleRate);
+    m_d->start();
+    return result;
+}
+
+size_t
+PrefetchingAudioReadStream::performSetDecodeSampleRate(size_t rate)
+{
+    // Before prefetching has begun, have the source resample, on the
+    // prefetch thread, so that all we do is copy. After that we stay
+    // at the rate we have, and the base class resamples from it,
+    // rather than throw away what has been prefetched
+    if (m_d->begun) {
+        return m_d->rate;
+    }
+    m_d->source->setRetrievalSampleRate(rate);
+    m_d->rate = rate;
+    m_seekable = m_d->source->isSeekable();
+    return rate;
+}
+
+bool
+PrefetchingAudioReadStream::performSetDecodeChannelMap(const std::vector<std::vector<int>> &map)
+{
+    // As with the sample rate, once prefetching has begun the base
+    // class maps what we have buffered
+    if (m_d->begun) {
+        return false;
+    }
+
+    // Before then, have the source map on the prefetch thread, in
+    // terms of its native channels. Our channels are those of the
+    // source's own map, so each must be a single native channel for
+    // the two maps to compose: averages of averages do not
+    const std::vector<std::vector<int>> &original = m_d->sourceMap;
+    std::vector<std::vector<int>> composed;
+    bool composable = !map.empty();
+    for (size_t c = 0; composable && c < map.size(); ++c) {
+        composed.push_back(std::vector<int>());
+        for (int s: map[c]) {
+            if (original.empty()) {
+                composed[c].push_back(s);
+            } else if (original[s].size() == 1) {
+                composed[c].push_back(original[s][0]);
+            } else {
+                composable = false;
+                break;
+            }
+        }
+    }
+    m_d->setSourceMap(composable ? composed : original);
+    return composable;
+}
+
+}
+
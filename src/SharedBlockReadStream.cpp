@@ -0,0 +1,492 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudiostream
+
+    A small library wrapping various audio file read/write
+    implementations in C++.
+
+    Copyright 2007-2022 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#include "SharedBlockReadStream.h"
+
+#include <mutex>
+#include <condition_variable>
+#include <memory>
+#include <unordered_map>
+#include <list>
+#include <vector>
+#include <cstring>
+
+#ifndef _WIN32
+#include <sys/types.h>
+#include <sys/stat.h>
+#endif
+
+namespace breakfastquay
+{
+
+static const size_t sharedBlockFrames = 65536;
+
+// Stream info is small, but is kept for every file opened, so the
+// least recently used is dropped beyond this many
+static const size_t sharedInfoEntries = 1024;
+
+struct SharedAudioBlock {
+    std::vector<float> data;
+    size_t frames; // less than sharedBlockFrames only at end of stream
+};
+
+struct SharedStreamInfo {
+    size_t channels;
+    size_t sampleRate;
+    size_t estimatedFrameCount;
+    bool seekable;
+    std::string track;
+    std::string artist;
+};
+
+typedef std::shared_ptr<const SharedAudioBlock> SharedAudioBlockPtr;
+
+// The process-wide cache. Blocks are immutable once published and
+// are handed out by shared pointer, so a block evicted while a
+// stream is still reading from it stays alive until that stream lets
+// go of it.
+class SharedBlockCache
+{
+public:
+    static SharedBlockCache &getInstance() {
+        static SharedBlockCache instance;
+        return instance;
+    }
+
+    void setBudget(size_t bytes) {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        m_budget = bytes;
+        if (bytes == 0) {
+            m_info.clear();
+            m_infoLru.clear();
+        }
+        evict();
+    }
+
+    size_t getBudget() {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        return m_budget;
+    }
+
+    bool getInfo(const std::string &identity, SharedStreamInfo &info) {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        auto i = m_info.find(identity);
+        if (i == m_info.end()) return false;
+        m_infoLru.splice(m_infoLru.begin(), m_infoLru, i->second.lru);
+        info = i->second.info;
+        return true;
+    }
+
+    void setInfo(const std::string &identity, const SharedStreamInfo &info) {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        auto i = m_info.find(identity);
+        if (i != m_info.end()) {
+            m_infoLru.splice(m_infoLru.begin(), m_infoLru, i->second.lru);
+            i->second.info = info;
+            return;
+        }
+        m_infoLru.push_front(identity);
+        InfoEntry &entry = m_info[identity];
+        entry.info = info;
+        entry.lru = m_infoLru.begin();
+        while (m_info.size() > sharedInfoEntries) {
+            m_info.erase(m_infoLru.back());
+            m_infoLru.pop_back();
+        }
+    }
+    
+    // Return the block for the key if it is cached, waiting for it
+    // if another stream is decoding it. Otherwise return null and
+    // set claimed, in which case the caller must decode the block
+    // and then either publish or abandon it.
+    SharedAudioBlockPtr acquire(const std::string &key, bool &claimed) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        claimed = false;
+        while (true) {
+            auto i = m_entries.find(key);
+            if (i == m_entries.end()) {
+                Entry entry;
+                entry.pending = true;
+                m_entries[key] = entry;
+                claimed = true;
+                return SharedAudioBlockPtr();
+            }
+            if (!i->second.pending) {
+                m_lru.splice(m_lru.begin(), m_lru, i->second.lru);
+                return i->second.block;
+            }
+            m_cond.wait(lock);
+        }
+    }
+
+    void publish(const std::string &key, SharedAudioBlockPtr block) {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        Entry &entry = m_entries[key];
+        if (entry.pending || !entry.block) {
+            insert(key, entry, block);
+        }
+        m_cond.notify_all();
+    }
+
+    // Publish a block that was decoded on the way to another one,
+    // unless it is already present or claimed
+    void offer(const std::string &key, SharedAudioBlockPtr block) {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        if (m_entries.find(key) != m_entries.end()) return;
+        insert(key, m_entries[key], block);
+    }
+
+    void abandon(const std::string &key) {
+        std::lock_guard<std::mutex> guard(m_mutex);
+        auto i = m_entries.find(key);
+        if (i != m_entries.end() && i->second.pending) {
+            m_entries.erase(i);
+        }
+        m_cond.notify_all();
+    }
+    
+private:
+    SharedBlockCache() : m_budget(0), m_total(0) { }
+    
+    struct Entry {
+        Entry() : pending(false) { }
+        SharedAudioBlockPtr block;
+        bool pending;
+        std::list<std::string>::iterator lru;
+    };
+
+    struct InfoEntry {
+        SharedStreamInfo info;
+        std::list<std::string>::iterator lru;
+    };
+
+    static size_t bytesOf(const SharedAudioBlockPtr &block) {
+        return sizeof(SharedAudioBlock) + block->data.size() * sizeof(float);
+    }
+    
+    void insert(const std::string &key, Entry &entry, SharedAudioBlockPtr block) {
+        entry.block = block;
+        entry.pending = false;
+        m_lru.push_front(key);
+        entry.lru = m_lru.begin();
+        m_total += bytesOf(block);
+        evict();
+    }
+
+    void evict() {
+        while (m_total > m_budget && !m_lru.empty()) {
+            auto i = m_entries.find(m_lru.back());
+            m_lru.pop_back();
+            if (i != m_entries.end()) {
+                m_total -= bytesOf(i->second.block);
+                m_entries.erase(i);
+            }
+        }
+    }
+    
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    size_t m_budget;
+    size_t m_total;
+    std::unordered_map<std::string, Entry> m_entries;
+    std::list<std::string> m_lru; // most recently used first
+    std::unordered_map<std::string, InfoEntry> m_info;
+    std::list<std::string> m_infoLru; // most recently used first
+};
+
+class SharedBlockReadStream::D
+{
+public:
+    D(std::string p, SourceFactory f) :
+        path(p), factory(f), source(0), sourcePos(0),
+        rate(0), nativeRate(0), started(false),
+        pos(0), currentIndex(0) { }
+    
+    ~D() {
+        delete source;
+    }
+
+    std::string path;
+    SourceFactory factory;
+    std::string identity;
+    SharedStreamInfo info;
+    AudioReadStream *source;
+    size_t sourcePos;
+    size_t rate;
+    size_t nativeRate;
+    bool started;
+    size_t pos;
+    SharedAudioBlockPtr current;
+    size_t currentIndex;
+
+    void makeIdentity() {
+#ifndef _WIN32
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) {
+            return;
+        }
+        // Include the sub-second modification time where there is
+        // one, so that a file rewritten within a second isn't taken
+        // for the old one
+        long nsec = 0;
+#if defined(__APPLE__)
+        nsec = long(st.st_mtimespec.tv_nsec);
+#elif defined(__linux__)
+        nsec = long(st.st_mtim.tv_nsec);
+#endif
+        identity = path + "|" + std::to_string((long long)st.st_size) +
+            "|" + std::to_string((long long)st.st_mtime) +
+            "." + std::to_string(nsec);
+#else
+        identity = path;
+#endif
+    }
+
+    std::string keyFor(size_t index) const {
+        return identity + "|" + std::to_string(rate) + "|" +
+            std::to_string(index);
+    }
+
+    void openSource() {
+        delete source;
+        source = 0;
+        source = factory(path);
+        if (rate != 0 && rate != source->getSampleRate()) {
+            source->setRetrievalSampleRate(rate);
+        }
+        sourcePos = 0;
+    }
+    
+    SharedAudioBlockPtr decodeNext() {
+        size_t channels = info.channels;
+        std::shared_ptr<SharedAudioBlock> block(new SharedAudioBlock);
+        block->data.resize(sharedBlockFrames * channels);
+        size_t got = 0;
+        while (got < sharedBlockFrames) {
+            size_t n = source->getInterleavedFrames
+                (sharedBlockFrames - got, block->data.data() + got * channels);
+            if (n == 0) break;
+            got += n;
+        }
+        block->frames = got;
+        block->data.resize(got * channels);
+        block->data.shrink_to_fit();
+        sourcePos += got;
+        return block;
+    }
+    
+    SharedAudioBlockPtr produce(size_t index) {
+        size_t target = index * sharedBlockFrames;
+        if (!source) {
+            openSource();
+        }
+        if (sourcePos != target) {
+            // Only seek at the native rate. Away from it the source
+            // is resampling, and a resampler started cold partway
+            // through would not give the same frames as one that
+            // read through from the start, so blocks would differ
+            // depending on which stream produced them
+            if (rate == nativeRate &&
+                source->isSeekable() && source->seek(target)) {
+                sourcePos = target;
+            } else if (sourcePos > target) {
+                openSource();
+            }
+        }
+        // Any blocks we have to read through on the way are useful
+        // to others as well
+        while (sourcePos < target) {
+            size_t here = sourcePos / sharedBlockFrames;
+            SharedAudioBlockPtr block = decodeNext();
+            SharedBlockCache::getInstance().offer(keyFor(here), block);
+            if (block->frames < sharedBlockFrames) {
+                // Ended before reaching the target
+                std::shared_ptr<SharedAudioBlock> empty(new SharedAudioBlock);
+                empty->frames = 0;
+                return empty;
+            }
+        }
+        return decodeNext();
+    }
+
+    SharedAudioBlockPtr obtain(size_t index) {
+        if (current && currentIndex == index) {
+            return current;
+        }
+        SharedBlockCache &cache = SharedBlockCache::getInstance();
+        std::string key = keyFor(index);
+        bool claimed = false;
+        SharedAudioBlockPtr block = cache.acquire(key, claimed);
+        if (claimed) {
+            try {
+                block = produce(index);
+            } catch (...) {
+                cache.abandon(key);
+                throw;
+            }
+            cache.publish(key, block);
+        }
+        current = block;
+        currentIndex = index;
+        return block;
+    }
+};
+
+SharedBlockReadStream::SharedBlockReadStream(std::string path,
+                                             SourceFactory factory) :
+    m_d(new D(path, factory))
+{
+    try {
+        m_d->makeIdentity();
+
+        SharedBlockCache &cache = SharedBlockCache::getInstance();
+        if (m_d->identity == "" ||
+            !cache.getInfo(m_d->identity, m_d->info)) {
+            m_d->openSource();
+            AudioReadStream *s = m_d->source;
+            m_d->info.channels = s->getChannelCount();
+            m_d->info.sampleRate = s->getSampleRate();
+            m_d->info.estimatedFrameCount = s->getEstimatedFrameCount();
+            m_d->info.seekable = s->isSeekable();
+            m_d->info.track = s->getTrackName();
+            m_d->info.artist = s->getArtistName();
+            if (m_d->identity != "") {
+                cache.setInfo(m_d->identity, m_d->info);
+            }
+        }
+
+        m_channelCount = m_d->info.channels;
+        m_sampleRate = m_d->info.sampleRate;
+        m_estimatedFrameCount = m_d->info.estimatedFrameCount;
+        m_seekable = m_d->info.seekable;
+        m_d->rate = m_sampleRate;
+        m_d->nativeRate = m_sampleRate;
+
+    } catch (...) {
+        delete m_d;
+        throw;
+    }
+}
+
+SharedBlockReadStream::~SharedBlockReadStream()
+{
+    delete m_d;
+}
+
+std::string
+SharedBlockReadStream::getTrackName() const
+{
+    return m_d->info.track;
+}
+
+std::string
+SharedBlockReadStream::getArtistName() const
+{
+    return m_d->info.artist;
+}
+
+std::string
+SharedBlockReadStream::getError() const
+{
+    if (m_d->source) return m_d->source->getError();
+    return "";
+}
+
+size_t
+SharedBlockReadStream::performSetDecodeSampleRate(size_t rate)
+{
+    // Once reading has begun we stay at the rate we have, and the
+    // base class resamples from it
+    if (m_d->started || rate == m_d->rate) {
+        return m_d->rate;
+    }
+    m_d->rate = rate;
+    m_d->current = SharedAudioBlockPtr();
+    if (m_d->source) {
+        m_d->openSource();
+    }
+    return rate;
+}
+
+size_t
+SharedBlockReadStream::getFrames(size_t count, float *frames)
+{
+    m_d->started = true;
+    
+    size_t channels = m_channelCount;
+    size_t done = 0;
+
+    while (done < count) {
+        size_t index = m_d->pos / sharedBlockFrames;
+        size_t offset = m_d->pos % sharedBlockFrames;
+        SharedAudioBlockPtr block = m_d->obtain(index);
+        if (offset >= block->frames) {
+            break;
+        }
+        size_t n = count - done;
+        if (n > block->frames - offset) n = block->frames - offset;
+        memcpy(frames + done * channels,
+               block->data.data() + offset * channels,
+               n * channels * sizeof(float));
+        done += n;
+        m_d->pos += n;
+    }
+
+    return done;
+}
+
+bool
+SharedBlockReadStream::performSeek(size_t frame)
+{
+    if (m_d->rate == m_sampleRate && m_estimatedFrameCount > 0 &&
+        frame > m_estimatedFrameCount) {
+        return false;
+    }
+    m_d->pos = frame;
+    return true;
+}
+
+void
+SharedBlockReadStream::setCacheSize(size_t maxBytes)
+{
+    SharedBlockCache::getInstance().setBudget(maxBytes);
+}
+
+size_t
+SharedBlockReadStream::getCacheSize()
+{
+    return SharedBlockCache::getInstance().getBudget();
+}
+
+}
@@ -0,0 +1,86 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/*
+    bqaudiostream
+
+    A small library wrapping various audio file read/write
+    implementations in C++.
+
+    Copyright 2007-2022 Particular Programs Ltd.
+
+    Permission is hereby granted, free of charge, to any person
+    obtaining a copy of this software and associated documentation
+    files (the "Software"), to deal in the Software without
+    restriction, including without limitation the rights to use, copy,
+    modify, merge, publish, distribute, sublicense, and/or sell copies
+    of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be
+    included in all copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND,
+    EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF
+    MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND
+    NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS BE LIABLE FOR
+    ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF
+    CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION
+    WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+
+    Except as contained in this notice, the names of Chris Cannam and
+    Particular Programs Ltd shall not be used in advertising or
+    otherwise to promote the sale, use or other dealings in this
+    Software without prior written authorization.
+*/
+
+#ifndef BQ_SHARED_BLOCK_READ_STREAM_H_
+#define BQ_SHARED_BLOCK_READ_STREAM_H_
+
+#include "../bqaudiostream/AudioReadStream.h"
+
+namespace breakfastquay
+{
+
+/**
+ * A read stream that obtains its audio in fixed-size blocks from a
+ * process-wide cache (see
+ * AudioReadStreamFactory::setSharedBlockCacheSize), keyed by source
+ * file identity, retrieval rate and block index. Blocks missing from
+ * the cache are decoded by a real reader for the source file, which
+ * is only created when first needed, and published to the cache for
+ * other streams to use.
+ *
+ * If two streams need the same missing block at the same time, one
+ * decodes it and the other waits for it.
+ */
+class SharedBlockReadStream : public AudioReadStream
+{
+public:
+    typedef AudioReadStream *(*SourceFactory)(std::string);
+
+    /**
+     * Open the given file, using sourceFactory to create the real
+     * reader if and when it is needed. Throws whatever the source
+     * factory throws.
+     */
+    SharedBlockReadStream(std::string path, SourceFactory sourceFactory);
+    virtual ~SharedBlockReadStream();
+
+    virtual std::string getTrackName() const;
+    virtual std::string getArtistName() const;
+    virtual std::string getError() const;
+
+    static void setCacheSize(size_t maxBytes);
+    static size_t getCacheSize();
+    
+protected:
+    virtual size_t getFrames(size_t count, float *frames);
+    virtual bool performSeek(size_t frame);
+    virtual size_t performSetDecodeSampleRate(size_t rate);
+
+    class D;
+    D *m_d;
+};
+
+}
+
+#endif
@@ -35,6 +35,7 @@
 #include "SimpleWavFileReadStream.h"
 
 #include <iostream>
+#include <cstring>
 
 #include <chrono>
 #include <thread>
@@ -148,8 +149,9 @@ SimpleWavFileReadStream::readHeader()
         if (audioFormat == 1) {
             throw InvalidFileFormat(m_path, "32-bit samples are only supported in float format, not PCM");
         } else {
-            char *buf = (char *)malloc(sizeof(float));
-            *(float *)buf = -0.f;
+            float f = -0.f;
+            char buf[sizeof(float)];
+            memcpy(buf, &f, sizeof(float));
             m_floatSwap = (buf[0] != '\0');
         }
     }
@@ -177,6 +179,10 @@ SimpleWavFileReadStream::readHeader()
 
     m_dataReadOffset = 0;
     m_dataReadStart = m_file->tellg();
+
+    // Sample data is read in blocks of up to this many samples, so
+    // that getFrames need not allocate
+    m_readBuffer.resize(readBufferSamples * (m_bitDepth / 8));
 }
 
 uint32_t
@@ -218,24 +224,24 @@ SimpleWavFileReadStream::readExpectedTag(std::string tag)
 std::string
 SimpleWavFileReadStream::readTag()
 {
-    std::vector<uint8_t> v(4);
+    uint8_t v[4];
     int obtained = getBytes(4, v);
     if (obtained == 0) return "";
     if (obtained != 4) {
         throw InvalidFileFormat(m_path, "incomplete tag");
     }
-    std::string tag((const char *)v.data(), 4);
+    std::string tag((const char *)v, 4);
     return tag;
 }
 
 uint32_t
 SimpleWavFileReadStream::readMandatoryNumber(int length)
 {
-    std::vector<uint8_t> v(length);
-    if (getBytes(length, v) != length) {
+    uint8_t v[4];
+    if (length > 4 || getBytes(length, v) != length) {
         throw InvalidFileFormat(m_path, "incomplete number");
     }
-    return le2int(v);
+    return le2int(v, length);
 }
 
 uint32_t
@@ -378,6 +384,7 @@ SimpleWavFileReadStream::shouldRetry(int justReadBytes)
                   << target << " succeeded, returning true" << std::endl;
 #endif
         ++m_retryCount;
+        countRetry();
         return true;
     } else {
 #ifdef DEBUG_SIMPLE_WAV_FILE_READ_STREAM
@@ -395,7 +402,6 @@ size_t
 SimpleWavFileReadStream::getFrames(size_t count, float *frames)
 {
     int sampleSize = m_bitDepth / 8;
-    std::vector<uint8_t> buf(sampleSize);
     
     size_t requested = count * m_channelCount;
     size_t got = 0;
@@ -409,22 +415,51 @@ SimpleWavFileReadStream::getFrames(size_t count, float *frames)
         if (m_dataChunkSize > 0 && m_dataReadOffset >= m_dataChunkSize) {
             break;
         }
-        int gotHere = getBytes(sampleSize, buf);
+
+        size_t samples = requested - got;
+        if (samples > readBufferSamples) {
+            samples = readBufferSamples;
+        }
+        if (m_dataChunkSize > 0) {
+            // Any final partial sample is read (and found incomplete)
+            // just as a whole one would be
+            size_t remaining = m_dataChunkSize - m_dataReadOffset;
+            size_t available = (remaining + sampleSize - 1) / sampleSize;
+            if (samples > available) {
+                samples = available;
+            }
+        }
+
+        int wanted = int(samples) * sampleSize;
+        int gotHere = getBytes(wanted, m_readBuffer.data());
+        int whole = gotHere / sampleSize;
+        int partial = gotHere - whole * sampleSize;
         m_dataReadOffset += gotHere;
-        if (gotHere < sampleSize) {
-            if (m_dataChunkSize == 0 && shouldRetry(gotHere)) {
+
+        const uint8_t *buf = m_readBuffer.data();
+        for (int i = 0; i < whole; ++i) {
+            switch (m_bitDepth) {
+            case 8: frames[got] = convertSample8(buf); break;
+            case 16: frames[got] = convertSample16(buf); break;
+            case 24: frames[got] = convertSample24(buf); break;
+            case 32: frames[got] = convertSampleFloat(buf); break;
+            }
+            buf += sampleSize;
+            ++got;
+        }
+        if (whole > 0) {
+            m_retryCount = 0;
+        }
+        
+        if (gotHere < wanted) {
+            if (m_dataChunkSize == 0 && shouldRetry(partial)) {
+                // shouldRetry has re-seeked to the start of the
+                // partial sample, which we will now read again
+                m_dataReadOffset -= partial;
                 continue;
             }
             break;
         }
-        switch (m_bitDepth) {
-        case 8: frames[got] = convertSample8(buf); break;
-        case 16: frames[got] = convertSample16(buf); break;
-        case 24: frames[got] = convertSample24(buf); break;
-        case 32: frames[got] = convertSampleFloat(buf); break;
-        }
-        ++got;
-        m_retryCount = 0;
     }
 
     if (got < requested) {
@@ -442,13 +477,13 @@ SimpleWavFileReadStream::getFrames(size_t count, float *frames)
 }
 
 float
-SimpleWavFileReadStream::convertSample8(const std::vector<uint8_t> &v)
+SimpleWavFileReadStream::convertSample8(const uint8_t *v)
 {
     return float(int32_t(v[0]) - 128) / 128.0;
 }
 
 float
-SimpleWavFileReadStream::convertSample16(const std::vector<uint8_t> &v)
+SimpleWavFileReadStream::convertSample16(const uint8_t *v)
 {
     uint32_t b0 = v[0], b1 = v[1];
 
@@ -459,7 +494,7 @@ SimpleWavFileReadStream::convertSample16(const std::vector<uint8_t> &v)
 }
 
 float
-SimpleWavFileReadStream::convertSample24(const std::vector<uint8_t> &v)
+SimpleWavFileReadStream::convertSample24(const uint8_t *v)
 {
     uint32_t b0 = v[0], b1 = v[1], b2 = v[2];
 
@@ -470,44 +505,37 @@ SimpleWavFileReadStream::convertSample24(const std::vector<uint8_t> &v)
 }
 
 float
-SimpleWavFileReadStream::convertSampleFloat(const std::vector<uint8_t> &v)
+SimpleWavFileReadStream::convertSampleFloat(const uint8_t *v)
 {
+    float f;
     if (!m_floatSwap) {
-        const uint8_t *buf = v.data();
-        return *(const float *)buf;
+        memcpy(&f, v, 4);
     } else {
-        std::vector<uint8_t> vv(4);
+        uint8_t vv[4];
         for (int i = 0; i < 4; ++i) {
             vv[i] = v[3-i];
         }
-        const uint8_t *buf = vv.data();
-        return *(const float *)buf;
+        memcpy(&f, vv, 4);
     }
+    return f;
 }
 
 int
-SimpleWavFileReadStream::getBytes(int n, std::vector<uint8_t> &v)
+SimpleWavFileReadStream::getBytes(int n, uint8_t *v)
 {
     if (!m_file) return 0;
 
-    for (int i = 0; i < n; ++i) {
-        char c;
-        m_file->get(c);
-        if (!m_file->good()) {
-            return i;
-        } else {
-            v[i] = (uint8_t)c;
-        }
-    }
-
-    return n;
+    m_file->read((char *)v, n);
+    int got = int(m_file->gcount());
+    
+    countIO(got);
+    return got;
 }
 
 uint32_t
-SimpleWavFileReadStream::le2int(const std::vector<uint8_t> &le)
+SimpleWavFileReadStream::le2int(const uint8_t *le, int len)
 {
     uint32_t n = 0;
-    int len = int(le.size());
 
     for (int i = 0; i < len; ++i) {
         n += (uint32_t(le[i]) << (8 * i));
@@ -80,6 +80,9 @@ private:
     uint32_t m_dataReadOffset;
     uint32_t m_dataReadStart;
 
+    static const size_t readBufferSamples = 4096;
+    std::vector<uint8_t> m_readBuffer;
+
     void readHeader();
     uint32_t readExpectedChunkSize(std::string tag);
     void readExpectedTag(std::string tag);
@@ -90,13 +93,13 @@ private:
     int m_retryCount;
     bool shouldRetry(int justRead);
     
-    float convertSample8(const std::vector<uint8_t> &);
-    float convertSample16(const std::vector<uint8_t> &);
-    float convertSample24(const std::vector<uint8_t> &);
-    float convertSampleFloat(const std::vector<uint8_t> &);
+    float convertSample8(const uint8_t *);
+    float convertSample16(const uint8_t *);
+    float convertSample24(const uint8_t *);
+    float convertSampleFloat(const uint8_t *);
 
-    int getBytes(int n, std::vector<uint8_t> &);
-    static uint32_t le2int(const std::vector<uint8_t> &le);
+    int getBytes(int n, uint8_t *);
+    static uint32_t le2int(const uint8_t *le, int len);
 };
 
 }
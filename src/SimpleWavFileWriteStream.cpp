@@ -38,6 +38,19 @@
 #include <iostream>
 #include <stdint.h>
 
+#ifdef __linux__
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#endif
+
 using namespace std;
 
 namespace breakfastquay
@@ -57,16 +70,208 @@ simplewavfilewritebuilder(
     getSimpleWavWriterExtensions()
     );
 
-size_t
-SimpleWavFileWriteStream::m_syncBlockSize = 4096;
+#ifdef __linux__
+
+class SimpleWavFileWriteStream::DirectWriter
+{
+public:
+    // O_DIRECT requires the buffer address, file offset, and length
+    // of each write to be aligned to the logical block size of the
+    // device, which this is a multiple of in practice
+    static const size_t alignment = 4096;
+    
+    DirectWriter(int fd, size_t bufferSize) :
+        m_fd(fd),
+        m_bufferSize(bufferSize),
+        m_fill(0),
+        m_offset(0),
+        m_pending(0),
+        m_pendingSize(0),
+        m_pendingOffset(0),
+        m_quit(false),
+        m_failed(false) {
+        for (int i = 0; i < 2; ++i) {
+            void *p = 0;
+            if (posix_memalign(&p, alignment, m_bufferSize)) {
+                if (i > 0) free(m_buffers[0]);
+                ::close(m_fd);
+                throw std::bad_alloc();
+            }
+            m_buffers[i] = (char *)p;
+        }
+        m_current = m_buffers[0];
+        m_thread = std::thread([this]() { run(); });
+    }
+
+    ~DirectWriter() {
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            m_quit = true;
+        }
+        m_cond.notify_all();
+        m_thread.join();
+        free(m_buffers[0]);
+        free(m_buffers[1]);
+        ::close(m_fd);
+    }
+
+    int getFd() const { return m_fd; }
+    
+    // Total bytes written so far, including those still staged
+    off_t getLength() const { return m_offset + m_fill; }
+    
+    bool write(const char *data, size_t n) {
+        while (n > 0) {
+            size_t count = m_bufferSize - m_fill;
+            if (count > n) count = n;
+            memcpy(m_current + m_fill, data, count);
+            m_fill += count;
+            data += count;
+            n -= count;
+            if (m_fill == m_bufferSize) {
+                if (!submit(m_bufferSize)) return false;
+            }
+        }
+        return true;
+    }
+
+    // Wait until the background thread has written everything
+    // handed to it
+    bool wait() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cond.wait(lock, [this]() { return m_pending == 0; });
+        return !m_failed;
+    }
+
+    // Write out what remains, padded to a whole block, truncate the
+    // file to the length actually written (which also releases any
+    // space preallocated beyond it), and switch off O_DIRECT so that
+    // the header can be rewritten with unaligned writes
+    bool finish() {
+        off_t length = getLength();
+        if (m_fill > 0) {
+            size_t padded = ((m_fill + alignment - 1) / alignment) * alignment;
+            memset(m_current + m_fill, 0, padded - m_fill);
+            if (!submit(padded)) return false;
+        }
+        if (!wait()) return false;
+        if (ftruncate(m_fd, length)) return false;
+        int flags = fcntl(m_fd, F_GETFL);
+        if (flags < 0 || fcntl(m_fd, F_SETFL, flags & ~O_DIRECT) < 0) {
+            return false;
+        }
+        return true;
+    }
+
+    bool writeAt(off_t offset, const std::string &s) {
+        return pwrite(m_fd, s.data(), s.size(), offset) == ssize_t(s.size());
+    }
+    
+private:
+    int m_fd;
+    size_t m_bufferSize;
+    char *m_buffers[2];
+    char *m_current;
+    size_t m_fill;
+    off_t m_offset;
+
+    std::mutex m_mutex;
+    std::condition_variable m_cond;
+    char *m_pending;
+    size_t m_pendingSize;
+    off_t m_pendingOffset;
+    bool m_quit;
+    bool m_failed;
+    std::thread m_thread;
+
+    bool submit(size_t n) {
+        if (!wait()) return false;
+        {
+            std::lock_guard<std::mutex> guard(m_mutex);
+            m_pending = m_current;
+            m_pendingSize = n;
+            m_pendingOffset = m_offset;
+        }
+        m_cond.notify_all();
+        m_offset += m_fill;
+        m_fill = 0;
+        m_current = (m_current == m_buffers[0] ? m_buffers[1] : m_buffers[0]);
+        return true;
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (true) {
+            m_cond.wait(lock, [this]() { return m_pending != 0 || m_quit; });
+            if (!m_pending) break;
+            const char *buf = m_pending;
+            size_t n = m_pendingSize;
+            off_t offset = m_pendingOffset;
+            lock.unlock();
+            bool ok = true;
+            size_t done = 0;
+            while (done < n) {
+                ssize_t r = pwrite(m_fd, buf + done, n - done, offset + done);
+                if (r < 0 && errno == EINTR) continue;
+                if (r <= 0) {
+                    ok = false;
+                    break;
+                }
+                done += r;
+            }
+            lock.lock();
+            if (!ok) m_failed = true;
+            m_pending = 0;
+            m_cond.notify_all();
+        }
+    }
+};
+
+#else
+
+class SimpleWavFileWriteStream::DirectWriter { };
+
+#endif
 
 SimpleWavFileWriteStream::SimpleWavFileWriteStream(Target target) :
     AudioWriteStream(target),
     m_bitDepth(24),
     m_file(0),
-    m_sinceSync(0)
+    m_direct(0),
+    m_preallocatedFd(-1)
 {
     std::string path = getPath();
+
+    const Options &options = getOptions();
+    off_t expectedSize = 0;
+    if (options.expectedDurationSeconds > 0.0) {
+        expectedSize = 44 + off_t(options.expectedDurationSeconds *
+                                  double(getSampleRate())) *
+            getChannelCount() * (m_bitDepth / 8);
+    }
+
+#ifdef __linux__
+    if (options.directIO) {
+        int fd = ::open(path.c_str(),
+                        O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0666);
+        if (fd < 0 && errno == EINVAL) {
+            // The filesystem doesn't support O_DIRECT (e.g. tmpfs)
+            std::cerr << "WARNING: SimpleWavFileWriteStream: Direct I/O not supported for file \"" << path << "\", writing normally" << std::endl;
+        } else if (fd < 0) {
+            m_error = std::string("Failed to open audio file '") +
+                path + "' for writing";
+            throw FailedToWriteFile(path);
+        } else {
+            if (expectedSize > 0 &&
+                fallocate(fd, FALLOC_FL_KEEP_SIZE, 0, expectedSize)) {
+                std::cerr << "WARNING: SimpleWavFileWriteStream: Failed to preallocate space for file \"" << path << "\"" << std::endl;
+            }
+            m_direct = new DirectWriter(fd, 1024 * 1024);
+            writeFormatChunk();
+            return;
+        }
+    }
+#endif
     
 #ifdef _MSC_VER
     // This is behind _MSC_VER not _WIN32 because the fstream
@@ -94,6 +299,16 @@ SimpleWavFileWriteStream::SimpleWavFileWriteStream(Target target) :
         throw FailedToWriteFile(path);
     }
 
+#ifdef __linux__
+    if (expectedSize > 0) {
+        m_preallocatedFd = ::open(path.c_str(), O_WRONLY);
+        if (m_preallocatedFd >= 0 &&
+            fallocate(m_preallocatedFd, FALLOC_FL_KEEP_SIZE, 0, expectedSize)) {
+            std::cerr << "WARNING: SimpleWavFileWriteStream: Failed to preallocate space for file \"" << path << "\"" << std::endl;
+        }
+    }
+#endif
+    
     writeFormatChunk();
 }
 
@@ -113,6 +328,27 @@ int2le(uint32_t value, uint32_t length)
 
 SimpleWavFileWriteStream::~SimpleWavFileWriteStream()
 {
+#ifdef __linux__
+    if (m_direct) {
+        off_t totalSize = m_direct->getLength();
+        uint32_t effSize = uint32_t(-1);
+        if (totalSize < off_t(effSize)) {
+            effSize = uint32_t(totalSize);
+        }
+        if (!m_direct->finish() ||
+            !m_direct->writeAt(4, int2le(effSize - 8, 4)) ||
+            !m_direct->writeAt(40, int2le(effSize - 44, 4))) {
+            std::cerr << "WARNING: SimpleWavFileWriteStream: Failed to complete file \"" << getPath() << "\"" << std::endl;
+        } else if (getOptions().durability != Options::SyncNever &&
+                   fdatasync(m_direct->getFd())) {
+            std::cerr << "WARNING: SimpleWavFileWriteStream: Failed to sync file \"" << getPath() << "\" on close" << std::endl;
+        }
+        delete m_direct;
+        m_direct = 0;
+        return;
+    }
+#endif
+    
     if (!m_file) {
         return;
     }
@@ -141,26 +377,49 @@ SimpleWavFileWriteStream::~SimpleWavFileWriteStream()
 
     delete m_file;
     m_file = 0;
+
+#ifdef __linux__
+    if (m_preallocatedFd >= 0) {
+        // Release any space preallocated beyond the real end
+        struct stat st;
+        if (fstat(m_preallocatedFd, &st) == 0) {
+            if (ftruncate(m_preallocatedFd, st.st_size)) {
+                std::cerr << "WARNING: SimpleWavFileWriteStream: Failed to release preallocated space for \"" << getPath() << "\"" << std::endl;
+            }
+        }
+        ::close(m_preallocatedFd);
+    }
+#endif
 }
 
 void
 SimpleWavFileWriteStream::putBytes(const std::string &s)
 {
-    if (!m_file) return;
-    m_file->write(s.data(), s.length());
+    putBytes((const uint8_t *)s.data(), s.length());
 }
 
 void
 SimpleWavFileWriteStream::putBytes(const uint8_t *buffer, size_t n)
 {
+#ifdef __linux__
+    if (m_direct) {
+        if (!m_direct->write((const char *)buffer, n)) {
+            m_error = "SimpleWavFileWriteStream: Failed to write to file";
+            throw FileOperationFailed(getPath(), "write");
+        }
+        countIO(n);
+        return;
+    }
+#endif
     if (!m_file) return;
     m_file->write((const char *)buffer, n);
+    countIO(n);
 }
 
 void
 SimpleWavFileWriteStream::writeFormatChunk()
 {
-    if (!m_file) return;
+    if (!m_file && !m_direct) return;
 
     std::string outString;
 
@@ -203,12 +462,26 @@ SimpleWavFileWriteStream::putInterleavedFrames(size_t count, const float *frames
 {
     if (count == 0) return;
 
-    for (size_t i = 0; i < count; ++i) {
-        for (size_t c = 0; c < getChannelCount(); ++c) {
+    AudioStreamStatistics::Timer timer
+        (m_statistics, &AudioStreamStatistics::codecSeconds);
+    countFrames(count);
+    
+    // Convert into a fixed buffer and write a block at a time
+    static const size_t blockSamples = 4096;
+    uint8_t buffer[blockSamples * 4];
+    int sampleSize = m_bitDepth / 8;
+    size_t samples = count * getChannelCount();
+    
+    for (size_t i = 0; i < samples; i += blockSamples) {
+
+        size_t n = samples - i;
+        if (n > blockSamples) n = blockSamples;
+
+        for (size_t j = 0; j < n; ++j) {
             
-            double f = frames[i * getChannelCount() + c];
+            double f = frames[i + j];
             uint32_t u = 0;
-            uint8_t ubuf[4];
+            uint8_t *ubuf = buffer + j * sampleSize;
             if (f < -1.0) f = -1.0;
             if (f > 1.0) f = 1.0;
             
@@ -226,16 +499,24 @@ SimpleWavFileWriteStream::putInterleavedFrames(size_t count, const float *frames
                 break;
 
             default:
-                ubuf[0] = ubuf[1] = ubuf[2] = ubuf[3] = '\0';
+                for (int k = 0; k < sampleSize; ++k) ubuf[k] = '\0';
                 break;
             }
-
-            putBytes(ubuf, m_bitDepth / 8);
         }
+
+        putBytes(buffer, n * sampleSize);
     }
 
-    m_sinceSync += count;
-    if (m_sinceSync > m_syncBlockSize) {
+    if (isSyncDue(count)) {
+#ifdef __linux__
+        if (m_direct) {
+            syncDirect();
+            return;
+        }
+#endif
+        // We can't sync an ofstream to disc, so the durability
+        // policy just determines how often we push our buffered data
+        // out to the OS
         flush();
     }
 }
@@ -243,11 +524,40 @@ SimpleWavFileWriteStream::putInterleavedFrames(size_t count, const float *frames
 void
 SimpleWavFileWriteStream::flush()
 {
+#ifdef __linux__
+    if (m_direct) {
+        if (shouldSyncOnFlush()) {
+            syncDirect();
+        } else if (!m_direct->wait()) {
+            m_error = "SimpleWavFileWriteStream: Failed to write to file";
+            throw FileOperationFailed(getPath(), "write");
+        }
+        return;
+    }
+#endif
     if (m_file) {
         m_file->flush();
-        m_sinceSync = 0;
+        syncDone();
+    }
+}
+
+#ifdef __linux__
+void
+SimpleWavFileWriteStream::syncDirect()
+{
+    // We can only write whole blocks, so anything still staged stays
+    // there: wait for the blocks already handed over, and sync those
+    if (!m_direct->wait()) {
+        m_error = "SimpleWavFileWriteStream: Failed to write to file";
+        throw FileOperationFailed(getPath(), "write");
     }
+    if (fdatasync(m_direct->getFd())) {
+        m_error = "SimpleWavFileWriteStream: Failed to sync file";
+        throw FileOperationFailed(getPath(), "sync");
+    }
+    syncDone();
 }
+#endif
 
 }
 
@@ -62,10 +62,17 @@ protected:
     int m_bitDepth;
     std::string m_error;
     std::ofstream *m_file;
-    size_t m_sinceSync;
-    static size_t m_syncBlockSize;
+
+    // Used instead of m_file when writing with O_DIRECT
+    class DirectWriter;
+    DirectWriter *m_direct;
+
+    // Our own descriptor for the file written through m_file, if we
+    // have preallocated space for it, otherwise -1
+    int m_preallocatedFd;
 
     void writeFormatChunk();
+    void syncDirect(); // Linux only, when m_direct is in use
     void putBytes(const std::string &);
     void putBytes(const unsigned char *, size_t);
 };
@@ -37,7 +37,11 @@
 #include "WavFileReadStream.h"
 #include "../bqaudiostream/Exceptions.h"
 
+#include <bqvec/VectorOps.h>
+
 #include <iostream>
+#include <cstdint>
+#include <cstring>
 
 namespace breakfastquay
 {
@@ -85,7 +89,9 @@ wavbuilder(
 WavFileReadStream::WavFileReadStream(std::string path) :
     m_file(0),
     m_path(path),
-    m_offset(0)
+    m_offset(0),
+    m_rawSubtype(0),
+    m_rawSwap(false)
 {
     m_channelCount = 0;
     m_sampleRate = 0;
@@ -144,6 +150,29 @@ WavFileReadStream::WavFileReadStream(std::string path) :
     }
     
     sf_seek(m_file, 0, SF_SEEK_SET);
+
+    // For plain PCM or float data in an uncompressed container, we
+    // read the sample data with sf_read_raw and convert it ourselves
+    // in vectorisable blocks, rather than have libsndfile convert
+    // sample by sample. libsndfile still parses the header and keeps
+    // track of the data chunk.
+    int major = (m_fileInfo.format & SF_FORMAT_TYPEMASK);
+    int subtype = (m_fileInfo.format & SF_FORMAT_SUBMASK);
+    if (major == SF_FORMAT_WAV || major == SF_FORMAT_WAVEX ||
+        major == SF_FORMAT_AIFF || major == SF_FORMAT_W64 ||
+        major == SF_FORMAT_RF64) {
+        switch (subtype) {
+        case SF_FORMAT_PCM_S8: case SF_FORMAT_PCM_U8:
+        case SF_FORMAT_PCM_16: case SF_FORMAT_PCM_24:
+        case SF_FORMAT_PCM_32: case SF_FORMAT_FLOAT:
+            m_rawSubtype = subtype;
+            m_rawSwap = (sf_command(m_file, SFC_RAW_DATA_NEEDS_ENDSWAP,
+                                    0, 0) == SF_TRUE);
+            break;
+        default:
+            break;
+        }
+    }
 }
 
 WavFileReadStream::~WavFileReadStream()
@@ -161,6 +190,19 @@ WavFileReadStream::performSeek(size_t frame)
     return true;
 }
 
+bool
+WavFileReadStream::performSetDecodeChannelMap(const std::vector<std::vector<int>> &map)
+{
+    // We can map channels during our own sample conversion, but
+    // not when libsndfile is doing the conversion
+    if (m_rawSubtype == 0) {
+        m_channelMap.clear();
+        return false;
+    }
+    m_channelMap = map;
+    return true;
+}
+
 size_t
 WavFileReadStream::getFrames(size_t count, float *frames)
 {
@@ -171,7 +213,12 @@ WavFileReadStream::getFrames(size_t count, float *frames)
 	return 0;
     }
 
-    sf_count_t readCount = sf_readf_float(m_file, frames, count);
+    sf_count_t readCount;
+    if (m_rawSubtype != 0) {
+        readCount = getFramesRaw(count, frames);
+    } else {
+        readCount = sf_readf_float(m_file, frames, count);
+    }
     
     if (readCount < 0) {
         return 0;
@@ -182,6 +229,223 @@ WavFileReadStream::getFrames(size_t count, float *frames)
     return readCount;
 }
 
+static void
+swapBytes(unsigned char *buf, size_t n, int width)
+{
+    for (size_t i = 0; i + width <= n; i += width) {
+        for (int j = 0; j < width / 2; ++j) {
+            unsigned char c = buf[i + j];
+            buf[i + j] = buf[i + width - 1 - j];
+            buf[i + width - 1 - j] = c;
+        }
+    }
+}
+
+// Readers for a single raw sample of each format, already in native
+// byte order. The format is a template parameter of the loops that
+// use these, so that it is switched on once per block rather than
+// once per sample
+
+struct RawPCM_S8 {
+    static const int width = 1;
+    static float read(const unsigned char *b) {
+        return float(int8_t(b[0])) * (1.f / 0x80);
+    }
+};
+
+struct RawPCM_U8 {
+    static const int width = 1;
+    static float read(const unsigned char *b) {
+        return float(int(b[0]) - 128) * (1.f / 0x80);
+    }
+};
+
+struct RawPCM_16 {
+    static const int width = 2;
+    static float read(const unsigned char *b) {
+        int16_t v;
+        memcpy(&v, b, 2);
+        return float(v) * (1.f / 0x8000);
+    }
+};
+
+struct RawPCM_24 {
+    static const int width = 3;
+    static float read(const unsigned char *b) {
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+        uint32_t v = (uint32_t(b[0]) << 24) | (uint32_t(b[1]) << 16) |
+            (uint32_t(b[2]) << 8);
+#else
+        uint32_t v = (uint32_t(b[2]) << 24) | (uint32_t(b[1]) << 16) |
+            (uint32_t(b[0]) << 8);
+#endif
+        return float(int32_t(v)) * (1.f / 0x80000000u);
+    }
+};
+
+struct RawPCM_32 {
+    static const int width = 4;
+    static float read(const unsigned char *b) {
+        int32_t v;
+        memcpy(&v, b, 4);
+        return float(v) * (1.f / 0x80000000u);
+    }
+};
+
+struct RawFloat {
+    static const int width = 4;
+    static float read(const unsigned char *b) {
+        float v;
+        memcpy(&v, b, 4);
+        return v;
+    }
+};
+
+// Convert only the channels that are wanted, mixing as we go
+template <typename Raw>
+static void
+convertMappedRaw(const unsigned char *buf, size_t frames, size_t channels,
+                 const std::vector<std::vector<int>> &map, float *out)
+{
+    size_t outChannels = map.size();
+    size_t frameBytes = channels * Raw::width;
+    for (size_t c = 0; c < outChannels; ++c) {
+        const std::vector<int> &sources = map[c];
+        float gain = (sources.empty() ? 0.f : 1.f / float(sources.size()));
+        for (size_t i = 0; i < frames; ++i) {
+            const unsigned char *frame = buf + i * frameBytes;
+            float sum = 0.f;
+            for (int src: sources) {
+                sum += Raw::read(frame + src * Raw::width);
+            }
+            out[i * outChannels + c] = sum * gain;
+        }
+    }
+}
+
+sf_count_t
+WavFileReadStream::getFramesRaw(size_t count, float *frames)
+{
+    int width = 0;
+    switch (m_rawSubtype) {
+    case SF_FORMAT_PCM_S8: case SF_FORMAT_PCM_U8: width = 1; break;
+    case SF_FORMAT_PCM_16: width = 2; break;
+    case SF_FORMAT_PCM_24: width = 3; break;
+    default: width = 4; break;
+    }
+    
+    // Read in blocks, so as to keep the scratch buffer small
+    const size_t blockFrames = 16384;
+    size_t frameBytes = width * m_channelCount;
+    if (m_rawBuffer.size() < blockFrames * frameBytes) {
+        m_rawBuffer.resize(blockFrames * frameBytes);
+        countBuffer(m_rawBuffer.size());
+    }
+    
+    size_t outChannels = m_channelCount;
+    if (!m_channelMap.empty()) {
+        outChannels = m_channelMap.size();
+    }
+    
+    sf_count_t total = 0;
+    
+    while (size_t(total) < count) {
+
+        size_t n = count - total;
+        if (n > blockFrames) n = blockFrames;
+        float *out = frames + total * outChannels;
+
+        // Float data of the right byte order goes straight into the
+        // output buffer, unless we're mapping channels
+        unsigned char *buf = &m_rawBuffer[0];
+        if (m_rawSubtype == SF_FORMAT_FLOAT && m_channelMap.empty()) {
+            buf = reinterpret_cast<unsigned char *>(out);
+        }
+        
+        sf_count_t got = sf_read_raw(m_file, buf, n * frameBytes);
+        countIO(got > 0 ? size_t(got) : 0);
+        if (got <= 0) break;
+        
+        AudioStreamStatistics::Timer timer
+            (m_statistics, &AudioStreamStatistics::conversionSeconds);
+        
+        size_t gotFrames = size_t(got) / frameBytes;
+        int samples = int(gotFrames * m_channelCount);
+
+        if (m_rawSwap && width > 1) {
+            swapBytes(buf, gotFrames * frameBytes, width);
+        }
+
+        if (!m_channelMap.empty()) {
+            switch (m_rawSubtype) {
+            case SF_FORMAT_PCM_S8:
+                convertMappedRaw<RawPCM_S8>
+                    (buf, gotFrames, m_channelCount, m_channelMap, out);
+                break;
+            case SF_FORMAT_PCM_U8:
+                convertMappedRaw<RawPCM_U8>
+                    (buf, gotFrames, m_channelCount, m_channelMap, out);
+                break;
+            case SF_FORMAT_PCM_16:
+                convertMappedRaw<RawPCM_16>
+                    (buf, gotFrames, m_channelCount, m_channelMap, out);
+                break;
+            case SF_FORMAT_PCM_24:
+                convertMappedRaw<RawPCM_24>
+                    (buf, gotFrames, m_channelCount, m_channelMap, out);
+                break;
+            case SF_FORMAT_PCM_32:
+                convertMappedRaw<RawPCM_32>
+                    (buf, gotFrames, m_channelCount, m_channelMap, out);
+                break;
+            case SF_FORMAT_FLOAT:
+                convertMappedRaw<RawFloat>
+                    (buf, gotFrames, m_channelCount, m_channelMap, out);
+                break;
+            }
+            total += gotFrames;
+            if (size_t(got) < n * frameBytes) break;
+            continue;
+        }
+
+        switch (m_rawSubtype) {
+        case SF_FORMAT_PCM_S8:
+            v_convert(out, reinterpret_cast<const int8_t *>(buf), samples);
+            v_scale(out, 1.f / 0x80, samples);
+            break;
+        case SF_FORMAT_PCM_U8:
+            for (int i = 0; i < samples; ++i) {
+                out[i] = RawPCM_U8::read(buf + i);
+            }
+            break;
+        case SF_FORMAT_PCM_16:
+            v_convert(out, reinterpret_cast<const int16_t *>(buf), samples);
+            v_scale(out, 1.f / 0x8000, samples);
+            break;
+        case SF_FORMAT_PCM_24:
+            // Byte order is little-endian here unless we're on a
+            // big-endian host, in which case it has been swapped to
+            // big-endian: either way it's now native, but we have to
+            // assemble the values ourselves
+            for (int i = 0; i < samples; ++i) {
+                out[i] = RawPCM_24::read(buf + i * 3);
+            }
+            break;
+        case SF_FORMAT_PCM_32:
+            v_convert(out, reinterpret_cast<const int32_t *>(buf), samples);
+            v_scale(out, 1.f / 0x80000000u, samples);
+            break;
+        case SF_FORMAT_FLOAT:
+            break;
+        }
+
+        total += gotFrames;
+        if (size_t(got) < n * frameBytes) break;
+    }
+
+    return total;
+}
+
 }
 
 #endif
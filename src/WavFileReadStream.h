@@ -63,6 +63,9 @@ public:
 protected:
     virtual size_t getFrames(size_t count, float *frames);
     virtual bool performSeek(size_t frame);
+    virtual bool performSetDecodeChannelMap(const std::vector<std::vector<int>> &);
+
+    sf_count_t getFramesRaw(size_t count, float *frames);
     
     SF_INFO m_fileInfo;
     SNDFILE *m_file;
@@ -73,6 +76,11 @@ protected:
     std::string m_artist;
 
     size_t m_offset;
+
+    int m_rawSubtype; // 0 if not reading raw
+    bool m_rawSwap;
+    std::vector<unsigned char> m_rawBuffer;
+    std::vector<std::vector<int>> m_channelMap; // applied if reading raw
 };
 
 }
@@ -35,18 +35,52 @@
 #if defined(HAVE_LIBSNDFILE) || defined(HAVE_SNDFILE)
 
 #include "WavFileWriteStream.h"
+#include "../bqaudiostream/AudioReadStreamFactory.h"
 #include "../bqaudiostream/Exceptions.h"
 
 #include <cstring>
+#include <iostream>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
 
 namespace breakfastquay
 {
 
+static int
+getWavWriterFormat(std::string extension)
+{
+    // FLAC can't store float samples, so we write 24-bit
+    if (extension == "flac") return SF_FORMAT_FLAC | SF_FORMAT_PCM_24;
+    if (extension == "aiff") return SF_FORMAT_AIFF | SF_FORMAT_FLOAT;
+    if (extension == "w64") return SF_FORMAT_W64 | SF_FORMAT_FLOAT;
+    if (extension == "rf64") return SF_FORMAT_RF64 | SF_FORMAT_FLOAT;
+    return SF_FORMAT_WAV | SF_FORMAT_FLOAT;
+}
+
 static std::vector<std::string>
 getWavWriterExtensions() {
+    std::vector<std::string> candidates;
+    candidates.push_back("wav");
+    candidates.push_back("aiff");
+    candidates.push_back("flac");
+    candidates.push_back("w64");
+    candidates.push_back("rf64");
+    // Only register those this build of libsndfile can write
     std::vector<std::string> ee;
-    ee.push_back("wav");
-    ee.push_back("aiff");
+    for (size_t i = 0; i < candidates.size(); ++i) {
+        SF_INFO info;
+        memset(&info, 0, sizeof(SF_INFO));
+        info.format = getWavWriterFormat(candidates[i]);
+        info.channels = 2;
+        info.samplerate = 44100;
+        if (sf_format_check(&info)) {
+            ee.push_back(candidates[i]);
+        }
+    }
     return ee;
 }
 
@@ -57,20 +91,21 @@ wavbuilder(
     getWavWriterExtensions()
     );
 
-size_t
-WavFileWriteStream::m_syncBlockSize = 4096;
-
 WavFileWriteStream::WavFileWriteStream(Target target) :
     AudioWriteStream(target),
     m_file(0),
-    m_sinceSync(0)
+    m_fd(-1),
+    m_writebackFrom(0),
+    m_preallocated(false)
 {
     memset(&m_fileInfo, 0, sizeof(SF_INFO));
-    m_fileInfo.format = SF_FORMAT_WAV | SF_FORMAT_FLOAT;
+    auto path = getPath();
+
+    m_fileInfo.format =
+        getWavWriterFormat(AudioReadStreamFactory::extensionOf(path));
     m_fileInfo.channels = getChannelCount();
     m_fileInfo.samplerate = getSampleRate();
 
-    auto path = getPath();
 #ifdef _WIN32
     int wlen = MultiByteToWideChar
         (CP_UTF8, 0, path.c_str(), path.length(), 0, 0);
@@ -83,7 +118,24 @@ WavFileWriteStream::WavFileWriteStream(Target target) :
         delete[] buf;
     }
 #else
-    m_file = sf_open(path.c_str(), SFM_WRITE, &m_fileInfo);
+    if (getOptions().durability != Options::SyncNever ||
+        getOptions().backgroundWriteback ||
+        getOptions().expectedDurationSeconds > 0.0) {
+        // We need the file descriptor to sync the file after
+        // libsndfile has closed it, for sync_file_range, and to
+        // preallocate and later release space, so we open the file
+        // ourselves and keep it open until then
+        m_fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0666);
+        if (m_fd >= 0) {
+            m_file = sf_open_fd(m_fd, SFM_WRITE, &m_fileInfo, SF_FALSE);
+            if (!m_file) {
+                ::close(m_fd);
+                m_fd = -1;
+            }
+        }
+    } else {
+        m_file = sf_open(path.c_str(), SFM_WRITE, &m_fileInfo);
+    }
 #endif
 
     if (!m_file) {
@@ -91,11 +143,83 @@ WavFileWriteStream::WavFileWriteStream(Target target) :
             path + "' for writing";
         throw FailedToWriteFile(path);
     }
+
+    int major = (m_fileInfo.format & SF_FORMAT_TYPEMASK);
+
+#ifdef __linux__
+    double duration = getOptions().expectedDurationSeconds;
+    if (m_fd >= 0 && duration > 0.0) {
+        // Samples are 24-bit for FLAC (for which this is an upper
+        // bound) and float otherwise; allow a page for the header
+        int bytes = ((m_fileInfo.format & SF_FORMAT_SUBMASK) ==
+                     SF_FORMAT_PCM_24 ? 3 : 4);
+        off_t expectedSize = 4096 +
+            off_t(duration * double(getSampleRate())) *
+            getChannelCount() * bytes;
+        if (fallocate(m_fd, FALLOC_FL_KEEP_SIZE, 0, expectedSize)) {
+            std::cerr << "WARNING: WavFileWriteStream: Failed to preallocate space for file "" << path << """ << std::endl;
+        } else {
+            m_preallocated = true;
+        }
+    }
+#endif
+    
+    if (major == SF_FORMAT_FLAC) {
+        // Clip out-of-range floats rather than letting them wrap
+        sf_command(m_file, SFC_SET_CLIPPING, 0, SF_TRUE);
+        double level = getOptions().compressionLevel;
+        if (level >= 0.0) {
+            if (level > 1.0) level = 1.0;
+            if (!sf_command(m_file, SFC_SET_COMPRESSION_LEVEL,
+                            &level, sizeof(level))) {
+                std::cerr << "WARNING: WavFileWriteStream: Failed to set compression level " << level << std::endl;
+            }
+        }
+    }
+
+    if (major == SF_FORMAT_RF64) {
+        // Write a plain WAV header if the file turns out to be small
+        // enough for one
+        sf_command(m_file, SFC_RF64_AUTO_DOWNGRADE, 0, SF_TRUE);
+    }
 }
 
 WavFileWriteStream::~WavFileWriteStream()
 {
-    if (m_file) sf_close(m_file);
+    bool shouldSync = (getOptions().durability != Options::SyncNever);
+    
+    if (m_file) {
+#ifdef _WIN32
+        if (shouldSync) {
+            // We have no descriptor to sync once libsndfile has
+            // closed the file, so sync what we can beforehand
+            sf_command(m_file, SFC_UPDATE_HEADER_NOW, 0, 0);
+            sf_write_sync(m_file);
+        }
+#endif
+        sf_close(m_file);
+    }
+
+#ifndef _WIN32
+    if (m_fd >= 0) {
+#ifdef __linux__
+        if (m_preallocated) {
+            // Release any space preallocated beyond the real end
+            struct stat st;
+            if (fstat(m_fd, &st) || ftruncate(m_fd, st.st_size)) {
+                std::cerr << "WARNING: WavFileWriteStream: Failed to release preallocated space for "" << getPath() << """ << std::endl;
+            }
+        }
+#endif
+        // libsndfile writes the final header (and for FLAC the last
+        // frames and stream info) on closing, so sync after that
+        if (shouldSync && fsync(m_fd)) {
+            std::cerr << "WARNING: WavFileWriteStream: Failed to sync file \""
+                      << getPath() << "\" on close" << std::endl;
+        }
+        ::close(m_fd);
+    }
+#endif
 }
 
 void
@@ -103,25 +227,63 @@ WavFileWriteStream::putInterleavedFrames(size_t count, const float *frames)
 {
     if (count == 0) return;
 
+    AudioStreamStatistics::Timer timer
+        (m_statistics, &AudioStreamStatistics::codecSeconds);
+    
     sf_count_t written = sf_writef_float(m_file, frames, count);
+    countFrames(count);
 
     if (written != sf_count_t(count)) {
         throw FileOperationFailed(getPath(), "write sf data");
     }
 
-    m_sinceSync += count;
-    if (m_sinceSync > m_syncBlockSize) {
-        flush();
+    if (isSyncDue(count)) {
+        sync(getOptions().backgroundWriteback);
     }
 }
 
 void
 WavFileWriteStream::flush()
 {
-    if (m_file) {
-        sf_write_sync(m_file);
-        m_sinceSync = 0;
+    if (!m_file) return;
+    
+    if (shouldSyncOnFlush()) {
+        sync(false);
+    } else {
+        // Make the header consistent for any concurrent reader, but
+        // don't force anything to disc
+        sf_command(m_file, SFC_UPDATE_HEADER_NOW, 0, 0);
+    }
+}
+
+void
+WavFileWriteStream::sync(bool background)
+{
+    if (!m_file) return;
+
+    // A synced file should be one a reader can make sense of
+    sf_command(m_file, SFC_UPDATE_HEADER_NOW, 0, 0);
+
+#ifdef __linux__
+    if (background && m_fd >= 0) {
+        // Start writeback of everything written since last time,
+        // and return without waiting for it
+        struct stat st;
+        if (fstat(m_fd, &st) == 0 && st.st_size > m_writebackFrom) {
+            sync_file_range(m_fd, m_writebackFrom,
+                            st.st_size - m_writebackFrom,
+                            SYNC_FILE_RANGE_WRITE);
+            m_writebackFrom = st.st_size;
+        }
+        syncDone();
+        return;
     }
+#else
+    (void)background;
+#endif
+
+    sf_write_sync(m_file);
+    syncDone();
 }
 
 }
@@ -64,9 +64,12 @@ protected:
     SF_INFO m_fileInfo;
     SNDFILE *m_file;
 
-    size_t m_sinceSync;
-    static size_t m_syncBlockSize;
+    int m_fd; // if we opened the file ourselves (to sync), otherwise -1
+    long long m_writebackFrom;
+    bool m_preallocated; // space beyond the end, to release on close
     std::string m_error;
+
+    void sync(bool background);
 };
 
 }
@@ -0,0 +1,129 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/* Copyright Chris Cannam - All Rights Reserved */
+
+#include "AllocationCounter.h"
+
+#include <new>
+#include <cstdlib>
+
+namespace {
+
+thread_local bool tracking = false;
+thread_local int count = 0;
+
+void counted() {
+    if (tracking) ++count;
+}
+
+}
+
+#ifdef BQ_WRAP_MALLOC
+
+// With -Wl,--wrap=malloc etc, calls to malloc from the objects being
+// linked come here instead, and __real_malloc is the C library's
+
+extern "C" {
+
+void *__real_malloc(size_t);
+void *__real_calloc(size_t, size_t);
+void *__real_realloc(void *, size_t);
+int __real_posix_memalign(void **, size_t, size_t);
+
+void *__wrap_malloc(size_t n) {
+    counted();
+    return __real_malloc(n);
+}
+
+void *__wrap_calloc(size_t n, size_t sz) {
+    counted();
+    return __real_calloc(n, sz);
+}
+
+void *__wrap_realloc(void *p, size_t n) {
+    counted();
+    return __real_realloc(p, n);
+}
+
+int __wrap_posix_memalign(void **p, size_t alignment, size_t n) {
+    counted();
+    return __real_posix_memalign(p, alignment, n);
+}
+
+}
+
+static void *rawAllocate(size_t n) { return __real_malloc(n ? n : 1); }
+
+#else
+
+static void *rawAllocate(size_t n) { return malloc(n ? n : 1); }
+
+#endif
+
+void *operator new(size_t n)
+{
+    counted();
+    void *p = rawAllocate(n);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new[](size_t n)
+{
+    counted();
+    void *p = rawAllocate(n);
+    if (!p) throw std::bad_alloc();
+    return p;
+}
+
+void *operator new(size_t n, const std::nothrow_t &) noexcept
+{
+    counted();
+    return rawAllocate(n);
+}
+
+void *operator new[](size_t n, const std::nothrow_t &) noexcept
+{
+    counted();
+    return rawAllocate(n);
+}
+
+void operator delete(void *p) noexcept
+{
+    free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+    free(p);
+}
+
+namespace breakfastquay {
+
+AllocationCounter::AllocationCounter()
+{
+    count = 0;
+    tracking = true;
+}
+
+AllocationCounter::~AllocationCounter()
+{
+    tracking = false;
+}
+
+int
+AllocationCounter::getCount() const
+{
+    return count;
+}
+
+bool
+AllocationCounter::isTrackingMalloc()
+{
+#ifdef BQ_WRAP_MALLOC
+    return true;
+#else
+    return false;
+#endif
+}
+
+}
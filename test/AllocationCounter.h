@@ -0,0 +1,37 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/* Copyright Chris Cannam - All Rights Reserved */
+
+#ifndef TEST_ALLOCATION_COUNTER_H
+#define TEST_ALLOCATION_COUNTER_H
+
+namespace breakfastquay {
+
+/**
+ * Counts the heap allocations made by the calling thread for as long
+ * as it exists. Allocations through operator new are always seen;
+ * where the test program is linked with malloc, calloc, realloc and
+ * posix_memalign wrapped (see test.pro), so are direct allocations in
+ * this library and the other statically linked bq libraries,
+ * including bqvec's allocate(). Allocations made inside shared
+ * third-party libraries by their own calls to malloc are not seen.
+ *
+ * Counters do not nest.
+ */
+class AllocationCounter
+{
+public:
+    AllocationCounter();
+    ~AllocationCounter();
+
+    int getCount() const;
+
+    static bool isTrackingMalloc();
+
+private:
+    AllocationCounter(const AllocationCounter &) =delete;
+    AllocationCounter &operator=(const AllocationCounter &) =delete;
+};
+
+}
+
+#endif
@@ -17,7 +17,8 @@ namespace breakfastquay {
  * Class that generates a single fixed test pattern to a given sample
  * rate and number of channels.
  *
- * The test pattern is two seconds long and consists of:
+ * The test pattern is two seconds long by default (longer or shorter
+ * durations may be requested, for benchmarking) and consists of:
  *
  * -- in channel 0, a 600Hz sinusoid with peak amplitude 1.0
  *
@@ -30,9 +31,9 @@ namespace breakfastquay {
 class AudioStreamTestData
 {
 public:
-    AudioStreamTestData(float rate, int channels) :
+    AudioStreamTestData(float rate, int channels, float duration = 2.0) :
 	m_channelCount(channels),
-	m_duration(2.0),
+	m_duration(duration),
 	m_sampleRate(rate),
 	m_sinFreq(600.0),
 	m_pulseFreq(2)
@@ -0,0 +1,182 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/* Copyright Chris Cannam - All Rights Reserved */
+
+#ifndef TEST_ALLOCATIONS_H
+#define TEST_ALLOCATIONS_H
+
+#include "bqaudiostream/AudioReadStreamFactory.h"
+#include "bqaudiostream/AudioReadStream.h"
+#include "bqaudiostream/AudioWriteStreamFactory.h"
+#include "bqaudiostream/AudioWriteStream.h"
+#include "bqaudiostream/Exceptions.h"
+
+#include "AllocationCounter.h"
+#include "AudioStreamTestData.h"
+
+#include <vector>
+
+#include <QObject>
+#include <QtTest>
+#include <QDir>
+
+#if (QT_VERSION >= 0x050000)
+#define ALLOCATIONS_SKIP(msg) QSKIP(msg)
+#else
+#define ALLOCATIONS_SKIP(msg) QSKIP(msg, SkipSingle)
+#endif
+
+namespace breakfastquay {
+
+/**
+ * Checks that reading, seeking and writing in blocks of a steady
+ * size allocate nothing once the first few blocks have been
+ * handled, so that they can be used from real-time code.
+ */
+class TestAllocations : public QObject
+{
+    Q_OBJECT
+
+    static const char *strOf(QString s) {
+        return strdup(s.toLocal8Bit().data());
+    }
+
+    static std::string pathOf(QString audiofile) {
+        return ("testfiles/" + audiofile).toLocal8Bit().data();
+    }
+
+    static AudioReadStream *open(QString audiofile) {
+        try {
+            return AudioReadStreamFactory::createReadStream(pathOf(audiofile));
+        } catch (UnknownFileType &) {
+            return 0;
+        }
+    }
+
+    static const int block = 256;
+    static const int warmup = 10;
+    static const int measured = 20;
+
+    void checkSteadyRead(AudioReadStream *stream) {
+        std::vector<float> buffer(block * stream->getRetrievalChannelCount());
+        for (int i = 0; i < warmup; ++i) {
+            stream->getInterleavedFrames(block, buffer.data());
+        }
+        AllocationCounter counter;
+        for (int i = 0; i < measured; ++i) {
+            stream->getInterleavedFrames(block, buffer.data());
+        }
+        QCOMPARE(counter.getCount(), 0);
+    }
+
+private slots:
+    void steadyRead_data() {
+        QTest::addColumn<QString>("audiofile");
+        QStringList files = QDir("testfiles").entryList(QDir::Files);
+        foreach (QString filename, files) {
+            // Only those named RATE-CHANNELS[-BITDEPTH].ext, which
+            // are two seconds long
+            QStringList fileAndExt = filename.split(".");
+            QStringList bits = fileAndExt[0].split("-");
+            if (bits.size() < 2 || bits.size() > 3) continue;
+            QTest::newRow(strOf(filename)) << filename;
+        }
+    }
+
+    void steadyRead() {
+        QFETCH(QString, audiofile);
+        AudioReadStream *stream = open(audiofile);
+        if (!stream) {
+            ALLOCATIONS_SKIP("File format not supported, skipping");
+        }
+        checkSteadyRead(stream);
+        delete stream;
+    }
+
+    void steadyResampledRead_data() {
+        steadyRead_data();
+    }
+
+    void steadyResampledRead() {
+        QFETCH(QString, audiofile);
+        AudioReadStream *stream = open(audiofile);
+        if (!stream) {
+            ALLOCATIONS_SKIP("File format not supported, skipping");
+        }
+        stream->setRetrievalSampleRate
+            (stream->getSampleRate() == 48000 ? 44100 : 48000);
+        checkSteadyRead(stream);
+        delete stream;
+    }
+
+    void steadySeek_data() {
+        steadyRead_data();
+    }
+
+    void steadySeek() {
+        QFETCH(QString, audiofile);
+        AudioReadStream *stream = open(audiofile);
+        if (!stream) {
+            ALLOCATIONS_SKIP("File format not supported, skipping");
+        }
+        if (!stream->isSeekable()) {
+            delete stream;
+            ALLOCATIONS_SKIP("Stream is not seekable, skipping");
+        }
+
+        // Seek about within the file, visiting every position once
+        // before counting, as some readers build seek indexes as
+        // they go
+        int n = int(stream->getEstimatedFrameCount()) - block;
+        int positions[] = { n * 4 / 5, n / 20, n / 3, n * 3 / 5, n / 7 };
+        std::vector<float> buffer(block * stream->getChannelCount());
+        for (int p: positions) {
+            QVERIFY(stream->seek(p));
+            stream->getInterleavedFrames(block, buffer.data());
+        }
+        AllocationCounter counter;
+        for (int p: positions) {
+            stream->seek(p);
+            stream->getInterleavedFrames(block, buffer.data());
+        }
+        QCOMPARE(counter.getCount(), 0);
+        delete stream;
+    }
+
+    void steadyWrite_data() {
+        QTest::addColumn<QString>("extension");
+        std::vector<std::string> extensions =
+            AudioWriteStreamFactory::getSupportedFileExtensions();
+        for (std::string e: extensions) {
+            QTest::newRow(strOf(QString::fromStdString(e)))
+                << QString::fromStdString(e);
+        }
+    }
+
+    void steadyWrite() {
+        QFETCH(QString, extension);
+        int rate = 48000, channels = 2;
+        AudioStreamTestData td(rate, channels);
+        std::string path = std::string("test-allocations.") +
+            extension.toLocal8Bit().data();
+        AudioWriteStream *ws = AudioWriteStreamFactory::createWriteStream
+            (path, channels, rate);
+        QVERIFY(ws);
+        const float *data = td.getInterleavedData();
+        for (int i = 0; i < warmup; ++i) {
+            ws->putInterleavedFrames(block, data + i * block * channels);
+        }
+        {
+            AllocationCounter counter;
+            for (int i = warmup; i < warmup + measured; ++i) {
+                ws->putInterleavedFrames(block, data + i * block * channels);
+            }
+            QCOMPARE(counter.getCount(), 0);
+        }
+        delete ws;
+        QFile::remove(QString::fromStdString(path));
+    }
+};
+
+}
+
+#endif
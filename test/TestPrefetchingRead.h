@@ -0,0 +1,257 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/* Copyright Chris Cannam - All Rights Reserved */
+
+#ifndef TEST_PREFETCHING_READ_H
+#define TEST_PREFETCHING_READ_H
+
+#include <QObject>
+#include <QtTest>
+
+#include "bqaudiostream/AudioReadStreamFactory.h"
+#include "bqaudiostream/AudioReadStream.h"
+#include "bqaudiostream/PrefetchingAudioReadStream.h"
+
+#include "AllocationCounter.h"
+
+#include <vector>
+#include <cmath>
+#include <cstdlib>
+
+namespace breakfastquay {
+
+class TestPrefetchingRead : public QObject
+{
+    Q_OBJECT
+
+    static const char *testfile() { 
+	static const char *f = "testfiles/44100-2-16.wav";
+	return f;
+    }
+
+private slots:
+    void matchesDirect() {
+	AudioReadStream *rs = AudioReadStreamFactory::createReadStream(testfile());
+	QVERIFY(rs);
+        int cc = rs->getChannelCount();
+        int n = rs->getEstimatedFrameCount();
+        std::vector<float> direct(n * cc);
+        QCOMPARE(int(rs->getInterleavedFrames(n, direct.data())), n);
+        delete rs;
+
+        // Read in awkwardly-sized blocks with a short prefetch time,
+        // so as to wrap around the buffer many times
+        PrefetchingAudioReadStream ps
+            (AudioReadStreamFactory::createReadStream(testfile()), 0.05);
+        QCOMPARE(int(ps.getChannelCount()), cc);
+        std::vector<float> prefetched(n * cc + 1000 * cc);
+        int got = 0;
+        while (true) {
+            int r = int(ps.getInterleavedFrames(999, prefetched.data() + got * cc));
+            got += r;
+            if (r < 999) break;
+        }
+        QCOMPARE(got, n);
+        for (int i = 0; i < n * cc; ++i) {
+            QCOMPARE(prefetched[i], direct[i]);
+        }
+    }
+
+    void seek() {
+	AudioReadStream *rs = AudioReadStreamFactory::createReadStream(testfile());
+	QVERIFY(rs);
+        int cc = rs->getChannelCount();
+        std::vector<float> direct(20000 * cc);
+        QCOMPARE(int(rs->getInterleavedFrames(20000, direct.data())), 20000);
+        delete rs;
+
+        PrefetchingAudioReadStream ps
+            (AudioReadStreamFactory::createReadStream(testfile()));
+        QVERIFY(ps.isSeekable());
+        std::vector<float> frames(100 * cc);
+        QCOMPARE(int(ps.getInterleavedFrames(100, frames.data())), 100);
+        QVERIFY(ps.seek(15000));
+        QCOMPARE(int(ps.getInterleavedFrames(100, frames.data())), 100);
+        for (int i = 0; i < 100 * cc; ++i) {
+            QCOMPARE(frames[i], direct[15000 * cc + i]);
+        }
+    }
+
+    void wrapsRetrievalRate() {
+
+        // Wrapping a stream that already resamples should give a
+        // stream at the resampled rate, with the same audio, and
+        // should not resample it again
+	AudioReadStream *rs = AudioReadStreamFactory::createReadStream(testfile());
+	QVERIFY(rs);
+        int cc = rs->getChannelCount();
+        int n = rs->getEstimatedFrameCount();
+        int rate = rs->getSampleRate();
+        rs->setRetrievalSampleRate(rate / 2);
+        std::vector<float> direct(n * cc);
+        int expected = int(rs->getInterleavedFrames(n, direct.data()));
+        delete rs;
+
+        rs = AudioReadStreamFactory::createReadStream(testfile());
+        rs->setRetrievalSampleRate(rate / 2);
+        PrefetchingAudioReadStream ps(rs);
+        QCOMPARE(int(ps.getSampleRate()), rate / 2);
+        QCOMPARE(int(ps.getRetrievalSampleRate()), rate / 2);
+        QVERIFY(abs(int(ps.getEstimatedFrameCount()) - n / 2) <= 1);
+
+        std::vector<float> prefetched(n * cc);
+        int got = int(ps.getInterleavedFrames(n, prefetched.data()));
+        QCOMPARE(got, expected);
+        for (int i = 0; i < got * cc; ++i) {
+            QVERIFY(fabsf(prefetched[i] - direct[i]) < 1e-4f);
+        }
+    }
+
+    void retrievalRateBeforeReading() {
+
+        // A retrieval rate set on the prefetching stream before the
+        // first read should lose nothing from the start of the audio
+	AudioReadStream *rs = AudioReadStreamFactory::createReadStream(testfile());
+	QVERIFY(rs);
+        int cc = rs->getChannelCount();
+        int n = rs->getEstimatedFrameCount();
+        int rate = rs->getSampleRate();
+        rs->setRetrievalSampleRate(rate / 2);
+        std::vector<float> direct(n * cc);
+        int expected = int(rs->getInterleavedFrames(n, direct.data()));
+        delete rs;
+
+        PrefetchingAudioReadStream ps
+            (AudioReadStreamFactory::createReadStream(testfile()));
+        QCOMPARE(int(ps.getBufferedFrameCount()), 0);
+        ps.setRetrievalSampleRate(rate / 2);
+        QCOMPARE(int(ps.getRetrievalSampleRate()), rate / 2);
+        QVERIFY(abs(int(ps.getEstimatedFrameCount()) - n / 2) <= 1);
+
+        std::vector<float> prefetched(n * cc);
+        int got = int(ps.getInterleavedFrames(n, prefetched.data()));
+        QCOMPARE(got, expected);
+        for (int i = 0; i < got * cc; ++i) {
+            QVERIFY(fabsf(prefetched[i] - direct[i]) < 1e-4f);
+        }
+    }
+
+    void realTime() {
+	AudioReadStream *rs = AudioReadStreamFactory::createReadStream(testfile());
+	QVERIFY(rs);
+        QVERIFY(!rs->isRealTimeSafe());
+        int cc = rs->getChannelCount();
+        std::vector<float> direct(20000 * cc);
+        QCOMPARE(int(rs->getInterleavedFrames(20000, direct.data())), 20000);
+        delete rs;
+
+        PrefetchingAudioReadStream ps
+            (AudioReadStreamFactory::createReadStream(testfile()));
+        QVERIFY(!ps.isRealTimeSafe());
+        ps.setRealTimeMode(true);
+        QVERIFY(ps.isRealTimeSafe());
+
+        // Posted seeks, each followed by a read once the audio from
+        // the new position has arrived. Neither reading nor seeking
+        // should allocate
+        std::vector<float> frames(100 * cc);
+        int positions[] = { 15000, 100, 9000 };
+        for (int p: positions) {
+            {
+                AllocationCounter counter;
+                QVERIFY(ps.seek(p));
+                QCOMPARE(counter.getCount(), 0);
+            }
+            while (ps.getBufferedFrameCount() < 100) {
+                QTest::qWait(10);
+            }
+            {
+                AllocationCounter counter;
+                QCOMPARE(int(ps.getInterleavedFrames(100, frames.data())), 100);
+                QCOMPARE(counter.getCount(), 0);
+            }
+            QCOMPARE(ps.getLastReadStatus(),
+                     PrefetchingAudioReadStream::ReadComplete);
+            for (int i = 0; i < 100 * cc; ++i) {
+                QCOMPARE(frames[i], direct[p * cc + i]);
+            }
+        }
+        QCOMPARE(int(ps.getUnderrunCount()), 0);
+
+        // The last 50 frames, once buffered, are read in full
+        int end = int(ps.getEstimatedFrameCount());
+        QVERIFY(ps.seek(end - 50));
+        while (ps.getBufferedFrameCount() < 50) {
+            QTest::qWait(10);
+        }
+        QCOMPARE(int(ps.getInterleavedFrames(50, frames.data())), 50);
+        QCOMPARE(ps.getLastReadStatus(),
+                 PrefetchingAudioReadStream::ReadComplete);
+
+        // Reading further is zero-filled and reported as an underrun,
+        // not waited for, until the background thread has found the
+        // end of the stream
+        int underruns = 0;
+        for (int i = 0; i < 100; ++i) {
+            int n = int(ps.getInterleavedFrames(100, frames.data()));
+            if (ps.getLastReadStatus() ==
+                PrefetchingAudioReadStream::ReadEnded) {
+                QCOMPARE(n, 0);
+                break;
+            }
+            QCOMPARE(ps.getLastReadStatus(),
+                     PrefetchingAudioReadStream::ReadUnderrun);
+            QCOMPARE(n, 100);
+            for (int j = 0; j < 100 * cc; ++j) {
+                QCOMPARE(frames[j], 0.f);
+            }
+            ++underruns;
+            QTest::qWait(10);
+        }
+        QCOMPARE(ps.getLastReadStatus(),
+                 PrefetchingAudioReadStream::ReadEnded);
+        QCOMPARE(int(ps.getUnderrunCount()), underruns);
+    }
+
+    void channelMap() {
+	AudioReadStream *rs = AudioReadStreamFactory::createReadStream(testfile());
+	QVERIFY(rs);
+        int n = rs->getEstimatedFrameCount();
+        std::vector<float> direct(n * 2);
+        QCOMPARE(int(rs->getInterleavedFrames(n, direct.data())), n);
+        delete rs;
+
+        // A map over a source that swaps its channels is composed
+        // with the source's own map, and read on the prefetch thread
+        rs = AudioReadStreamFactory::createReadStream(testfile());
+        rs->setRetrievalChannelMap({ { 1 }, { 0 } });
+        PrefetchingAudioReadStream swapped(rs);
+        swapped.setRetrievalChannelMap({ { 1 }, { 1 }, { 0 } });
+        QCOMPARE(int(swapped.getRetrievalChannelCount()), 3);
+        std::vector<float> frames(n * 3);
+        QCOMPARE(int(swapped.getInterleavedFrames(n, frames.data())), n);
+        for (int i = 0; i < n; ++i) {
+            QCOMPARE(frames[i * 3], direct[i * 2]);
+            QCOMPARE(frames[i * 3 + 1], direct[i * 2]);
+            QCOMPARE(frames[i * 3 + 2], direct[i * 2 + 1]);
+        }
+
+        // One over a source that mixes down can't be composed, but
+        // is still applied
+        rs = AudioReadStreamFactory::createReadStream(testfile());
+        rs->setRetrievalChannelMap({ { 0, 1 } });
+        PrefetchingAudioReadStream mixed(rs);
+        mixed.setRetrievalChannelMap({ { 0 }, { 0 } });
+        QCOMPARE(int(mixed.getRetrievalChannelCount()), 2);
+        QCOMPARE(int(mixed.getInterleavedFrames(n, frames.data())), n);
+        for (int i = 0; i < n; ++i) {
+            float mix = (direct[i * 2] + direct[i * 2 + 1]) / 2.f;
+            QVERIFY(fabsf(frames[i * 2] - mix) < 1e-6f);
+            QCOMPARE(frames[i * 2 + 1], frames[i * 2]);
+        }
+    }
+};
+
+}
+
+#endif
+
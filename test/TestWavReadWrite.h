@@ -11,9 +11,23 @@
 #include "bqaudiostream/AudioReadStream.h"
 #include "bqaudiostream/AudioWriteStreamFactory.h"
 #include "bqaudiostream/AudioWriteStream.h"
+#include "bqaudiostream/Exceptions.h"
+#include "bqaudiostream/AudioTranscoder.h"
+#include "bqaudiostream/AudioStreamPipeline.h"
+#include "bqaudiostream/AudioStreamSummary.h"
 
 #include "bqvec/Allocators.h"
 
+#include "AudioStreamTestData.h"
+
+#include <QFileInfo>
+
+#include <algorithm>
+
+#ifdef __linux__
+#include <sys/stat.h>
+#endif
+
 namespace breakfastquay {
 
 static const float DB_FLOOR = -1000.0;
@@ -50,6 +64,22 @@ class TestWavReadWrite : public QObject
 	static const char *f = "test-audiostream-out-origrate.wav";
 	return f;
     }
+    static const char *outfile_mono() { 
+	static const char *f = "test-audiostream-out-mono.wav";
+	return f;
+    }
+    static const char *outfile_flac() { 
+	static const char *f = "test-audiostream-out.flac";
+	return f;
+    }
+    static const char *outfile_opus() { 
+	static const char *f = "test-audiostream-out.opus";
+	return f;
+    }
+    static const char *outfile_summary() { 
+	static const char *f = "test-audiostream-out.summary";
+	return f;
+    }
 
 private slots:
     void readWriteResample() {
@@ -172,6 +202,621 @@ private slots:
             QWARN(message.toLocal8Bit().data());
         }	
     }
+
+    void transcodeMixdown() {
+
+        // Run two identical jobs at once, mixing our stereo test
+        // file down to mono, and check the result of one against the
+        // mean of the source channels
+        
+        AudioTranscoder::Job job(testfile(), outfile_mono());
+        job.channelMap.push_back({ 0, 1 });
+        std::vector<AudioTranscoder::Job> jobs;
+        jobs.push_back(job);
+        jobs.push_back(AudioTranscoder::Job("nonexistent.wav", "x.wav"));
+
+        AudioTranscoder transcoder(2);
+        std::vector<AudioTranscoder::Result> results = transcoder.run(jobs);
+        QCOMPARE(int(results.size()), 2);
+        QVERIFY2(results[0].succeeded, results[0].error.c_str());
+        QVERIFY(!results[1].succeeded);
+        QVERIFY(results[0].realTimeFactor > 0.0);
+
+	AudioReadStream *rs = AudioReadStreamFactory::createReadStream(testfile());
+        int n = rs->getEstimatedFrameCount();
+        QCOMPARE(int(results[0].frames), n);
+        std::vector<float> stereo(n * 2);
+        QCOMPARE(int(rs->getInterleavedFrames(n, stereo.data())), n);
+        delete rs;
+
+	rs = AudioReadStreamFactory::createReadStream(outfile_mono());
+        QCOMPARE(int(rs->getChannelCount()), 1);
+        std::vector<float> mono(n);
+        QCOMPARE(int(rs->getInterleavedFrames(n, mono.data())), n);
+        delete rs;
+
+        for (int i = 0; i < n; ++i) {
+            float expected = (stereo[i*2] + stereo[i*2+1]) / 2.f;
+            QVERIFY(fabsf(mono[i] - expected) < 1e-5f);
+        }
+    }
+
+    void pipelineCopy() {
+
+        // Copy the test file through the pipeline at its own rate
+        // (no resampling stage) and check it comes out unchanged
+        
+	AudioReadStream *rs = AudioReadStreamFactory::createReadStream(testfile());
+	int cc = rs->getChannelCount();
+	int rate = rs->getSampleRate();
+        int n = rs->getEstimatedFrameCount();
+
+	AudioWriteStream *ws = AudioWriteStreamFactory::createWriteStream
+	    (outfile_origrate(), cc, rate);
+        AudioStreamPipeline pipeline(rs, ws, 1000, 3);
+        QCOMPARE(int(pipeline.run()), n);
+        delete ws;
+        delete rs;
+
+	rs = AudioReadStreamFactory::createReadStream(testfile());
+        std::vector<float> original(n * cc);
+        QCOMPARE(int(rs->getInterleavedFrames(n, original.data())), n);
+        delete rs;
+        
+	rs = AudioReadStreamFactory::createReadStream(outfile_origrate());
+        std::vector<float> copied(n * cc);
+        QCOMPARE(int(rs->getInterleavedFrames(n, copied.data())), n);
+        delete rs;
+
+        for (int i = 0; i < n * cc; ++i) {
+            QVERIFY(fabsf(copied[i] - original[i]) < 1e-5f);
+        }
+    }
+    
+    void summaryDuringRead() {
+
+        // Summarise the test file while reading it, check the
+        // coarsest level against the audio we read, and check the
+        // summary survives a round trip through its sidecar file
+        
+	AudioReadStream *rs = AudioReadStreamFactory::createReadStream(testfile());
+        AudioStreamSummary summary(64, 4, 3);
+        rs->setSummarySink(&summary);
+
+	int cc = rs->getChannelCount();
+        int n = rs->getEstimatedFrameCount();
+        std::vector<float> audio((n + 1000) * cc);
+        int got = 0;
+        while (true) {
+            int here = rs->getInterleavedFrames(1000, audio.data() + got * cc);
+            got += here;
+            if (here < 1000) {
+                // Not complete until a read finds nothing left
+                QVERIFY(here == 0 || !summary.isComplete());
+            }
+            if (here == 0) break;
+        }
+        delete rs;
+        QCOMPARE(got, n);
+        QVERIFY(summary.isComplete());
+        QCOMPARE(int(summary.getFrameCount()), n);
+
+        int top = summary.getLevelCount() - 1;
+        int binFrames = summary.getBinFrames(top);
+        QCOMPARE(int(summary.getBinCount(top)), (n + binFrames - 1) / binFrames);
+        for (int b = 0; b < int(summary.getBinCount(top)); ++b) {
+            for (int c = 0; c < cc; ++c) {
+                float mn = 1.f, mx = -1.f;
+                for (int i = b * binFrames; i < n && i < (b+1) * binFrames; ++i) {
+                    mn = std::min(mn, audio[i * cc + c]);
+                    mx = std::max(mx, audio[i * cc + c]);
+                }
+                AudioStreamSummary::Bin bin = summary.getBin(top, c, b);
+                QCOMPARE(bin.min, mn);
+                QCOMPARE(bin.max, mx);
+                QVERIFY(bin.rms >= 0.f && bin.rms <= std::max(-mn, mx));
+            }
+        }
+
+        summary.save(outfile_summary());
+        AudioStreamSummary loaded = AudioStreamSummary::load(outfile_summary());
+        QCOMPARE(loaded.getChannelCount(), cc);
+        for (int level = 0; level <= top; ++level) {
+            QCOMPARE(loaded.getBinCount(level), summary.getBinCount(level));
+            for (int b = 0; b < int(summary.getBinCount(level)); ++b) {
+                for (int c = 0; c < cc; ++c) {
+                    AudioStreamSummary::Bin a = summary.getBin(level, c, b);
+                    AudioStreamSummary::Bin l = loaded.getBin(level, c, b);
+                    QVERIFY(l.min <= a.min && a.min - l.min < 1e-4f);
+                    QVERIFY(l.max >= a.max && l.max - a.max < 1e-4f);
+                    QVERIFY(fabsf(l.rms - a.rms) < 1e-4f);
+                }
+            }
+        }
+    }
+
+    void summaryOverRange() {
+
+        // Values beyond +/-1 (as from a float file) should survive
+        // the sidecar file without being clipped
+        
+        AudioStreamSummary summary(4, 2, 2);
+        summary.reset(1, 44100);
+        float frames[] = { 0.5f, -3.5f, 2.25f, 0.f, 0.1f, 0.2f, -0.3f, 0.4f };
+        summary.addInterleavedFrames(frames, 8);
+        summary.finish();
+
+        summary.save(outfile_summary());
+        AudioStreamSummary loaded = AudioStreamSummary::load(outfile_summary());
+        for (int level = 0; level < 2; ++level) {
+            QCOMPARE(loaded.getBinCount(level), summary.getBinCount(level));
+            for (int b = 0; b < int(summary.getBinCount(level)); ++b) {
+                AudioStreamSummary::Bin a = summary.getBin(level, 0, b);
+                AudioStreamSummary::Bin l = loaded.getBin(level, 0, b);
+                QVERIFY(l.min <= a.min && a.min - l.min < 1e-3f);
+                QVERIFY(l.max >= a.max && l.max - a.max < 1e-3f);
+                QVERIFY(fabsf(l.rms - a.rms) < 1e-3f);
+            }
+        }
+        QCOMPARE(loaded.getBin(1, 0, 0).min, -3.5f);
+
+        // A channel count the file has no room for is rejected
+        // rather than allocated for
+        QFile file(outfile_summary());
+        QVERIFY(file.open(QIODevice::ReadWrite));
+        QVERIFY(file.seek(8));
+        const char channels[] = { '\xff', '\xff', '\xff', '\x7f' };
+        QCOMPARE(int(file.write(channels, 4)), 4);
+        file.close();
+        bool rejected = false;
+        try {
+            (void)AudioStreamSummary::load(outfile_summary());
+        } catch (InvalidFileFormat &) {
+            rejected = true;
+        }
+        QVERIFY(rejected);
+    }
+
+    void summaryDetachedOnRateChange() {
+
+        // A summary reset for one retrieval rate should not go on
+        // to collect audio at another
+        
+	AudioReadStream *rs = AudioReadStreamFactory::createReadStream(testfile());
+        AudioStreamSummary summary(64, 4, 3);
+        rs->setSummarySink(&summary);
+        QCOMPARE(summary.getSampleRate(), int(rs->getSampleRate()));
+        rs->setRetrievalSampleRate(rs->getSampleRate() / 2);
+        std::vector<float> buffer(1000 * rs->getChannelCount());
+        rs->getInterleavedFrames(1000, buffer.data());
+        delete rs;
+        QCOMPARE(int(summary.getFrameCount()), 0);
+    }
+
+    void statistics() {
+
+        // Statistics are off by default, and when switched on
+        // should at least account for the frames passing through
+        
+	AudioReadStream *rs = AudioReadStreamFactory::createReadStream(testfile());
+	int cc = rs->getChannelCount();
+	int rate = rs->getSampleRate();
+        std::vector<float> buffer(1000 * cc);
+        QCOMPARE(int(rs->getInterleavedFrames(1000, buffer.data())), 1000);
+        QCOMPARE(int(rs->getStatistics().frames), 0);
+
+        rs->setStatisticsEnabled(true);
+        QCOMPARE(int(rs->getInterleavedFrames(1000, buffer.data())), 1000);
+        QVERIFY(rs->seek(0));
+        AudioStreamStatistics rstats = rs->getStatistics();
+        QCOMPARE(int(rstats.frames), 1000);
+        QCOMPARE(int(rstats.seeks), 1);
+        QVERIFY(rstats.codecSeconds > 0.0);
+        rs->resetStatistics();
+        QCOMPARE(int(rs->getStatistics().frames), 0);
+        delete rs;
+
+	AudioWriteStream *ws = AudioWriteStreamFactory::createWriteStream
+	    (outfile_origrate(), cc, rate);
+        ws->setStatisticsEnabled(true);
+        ws->putInterleavedFrames(1000, buffer.data());
+        QCOMPARE(int(ws->getStatistics().frames), 1000);
+        delete ws;
+    }
+
+    void writeFlac() {
+
+        // Write the test file to FLAC (which we write at 24-bit) and
+        // check it reads back the same, to within that precision
+        
+	AudioReadStream *rs = AudioReadStreamFactory::createReadStream(testfile());
+	QVERIFY(rs);
+
+	int cc = rs->getChannelCount();
+	int rate = rs->getSampleRate();
+        int n = rs->getEstimatedFrameCount();
+        QVERIFY(n > 0);
+        
+        std::vector<float> original(n * cc);
+        QCOMPARE(int(rs->getInterleavedFrames(n, original.data())), n);
+        delete rs;
+
+        AudioWriteStream::Options options;
+        options.compressionLevel = 1.0;
+        
+        AudioWriteStream *ws = 0;
+        try {
+            ws = AudioWriteStreamFactory::createWriteStream
+                (outfile_flac(), cc, rate, options);
+        } catch (const UnknownFileType &) {
+#if (QT_VERSION >= 0x050000)
+            QSKIP("FLAC writing not supported, skipping");
+#else
+            QSKIP("FLAC writing not supported, skipping", SkipSingle);
+#endif
+        }
+        QVERIFY(ws);
+        ws->putInterleavedFrames(n, original.data());
+        delete ws;
+
+        rs = AudioReadStreamFactory::createReadStream(outfile_flac());
+        QVERIFY(rs);
+        QCOMPARE(int(rs->getChannelCount()), cc);
+        QCOMPARE(int(rs->getSampleRate()), rate);
+
+        std::vector<float> readback(n * cc + cc);
+        QCOMPARE(int(rs->getInterleavedFrames(n + 1, readback.data())), n);
+        delete rs;
+        
+        for (int i = 0; i < n * cc; ++i) {
+            QVERIFY(fabsf(readback[i] - original[i]) < 1e-6f);
+        }
+    }
+
+    void durability_data() {
+        QTest::addColumn<int>("policy");
+        QTest::addColumn<double>("intervalMs");
+        QTest::addColumn<bool>("background");
+        QTest::addColumn<int>("syncsWhileWriting");
+
+        // Ten blocks of 1000 frames each, with syncFrameCount 4096,
+        // sync after the 5th and 10th blocks
+        QTest::newRow("frame count")
+            << int(AudioWriteStream::Options::SyncByFrameCount)
+            << 0.0 << false << 2;
+        QTest::newRow("frame count, background writeback")
+            << int(AudioWriteStream::Options::SyncByFrameCount)
+            << 0.0 << true << 2;
+        QTest::newRow("time, long interval")
+            << int(AudioWriteStream::Options::SyncByTime)
+            << 1.0e9 << false << 0;
+        QTest::newRow("time, zero interval")
+            << int(AudioWriteStream::Options::SyncByTime)
+            << 0.0 << false << 10;
+        QTest::newRow("flush only")
+            << int(AudioWriteStream::Options::SyncOnFlushOnly)
+            << 0.0 << false << 0;
+        QTest::newRow("never")
+            << int(AudioWriteStream::Options::SyncNever)
+            << 0.0 << false << 0;
+    }
+
+    void durability() {
+
+        // Each durability policy should sync as often as it says,
+        // flush() should sync for every policy but SyncNever, and
+        // the file should be complete for a reader both after a
+        // flush and after closing
+
+        QFETCH(int, policy);
+        QFETCH(double, intervalMs);
+        QFETCH(bool, background);
+        QFETCH(int, syncsWhileWriting);
+        
+        int rate = 44100, channels = 2, block = 1000, blocks = 10;
+        AudioStreamTestData td(rate, channels);
+
+        AudioWriteStream::Options options;
+        options.durability =
+            AudioWriteStream::Options::DurabilityPolicy(policy);
+        options.syncFrameCount = 4096;
+        options.syncIntervalMs = intervalMs;
+        options.backgroundWriteback = background;
+
+	AudioWriteStream *ws = AudioWriteStreamFactory::createWriteStream
+	    (outfile(), channels, rate, options);
+        QVERIFY(ws);
+        ws->setStatisticsEnabled(true);
+        for (int i = 0; i < blocks; ++i) {
+            ws->putInterleavedFrames
+                (block, td.getInterleavedData() + i * block * channels);
+        }
+        QCOMPARE(int(ws->getStatistics().syncs), syncsWhileWriting);
+
+        ws->flush();
+        if (policy != int(AudioWriteStream::Options::SyncNever)) {
+            QCOMPARE(int(ws->getStatistics().syncs), syncsWhileWriting + 1);
+        }
+
+	AudioReadStream *rs = AudioReadStreamFactory::createReadStream(outfile());
+        QVERIFY(rs);
+        std::vector<float> readback((block * blocks + 1) * channels);
+        QCOMPARE(int(rs->getInterleavedFrames(block * blocks + 1,
+                                              readback.data())),
+                 block * blocks);
+        delete rs;
+        delete ws;
+
+        rs = AudioReadStreamFactory::createReadStream(outfile());
+        QVERIFY(rs);
+        QCOMPARE(int(rs->getInterleavedFrames(block * blocks + 1,
+                                              readback.data())),
+                 block * blocks);
+        delete rs;
+
+        const float *original = td.getInterleavedData();
+        for (int i = 0; i < block * blocks * channels; ++i) {
+            QVERIFY(fabsf(readback[i] - original[i]) < 1e-4f);
+        }
+    }
+
+    void preallocation_data() {
+        QTest::addColumn<bool>("directIO");
+        QTest::newRow("buffered") << false;
+        QTest::newRow("direct") << true;
+    }
+    
+    void preallocation() {
+
+        // Asking for a minute of space and writing a fraction of a
+        // second of it should give a complete file with the unused
+        // space released, and syncs should happen as the durability
+        // policy says whether or not we are writing with O_DIRECT
+
+        QFETCH(bool, directIO);
+        
+        int rate = 44100, channels = 2, block = 1000, blocks = 10;
+        AudioStreamTestData td(rate, channels);
+
+        AudioWriteStream::Options options;
+        options.expectedDurationSeconds = 60.0;
+        options.directIO = directIO;
+        options.durability = AudioWriteStream::Options::SyncByFrameCount;
+        options.syncFrameCount = 4096;
+
+	AudioWriteStream *ws = AudioWriteStreamFactory::createWriteStream
+	    (outfile(), channels, rate, options);
+        QVERIFY(ws);
+        ws->setStatisticsEnabled(true);
+        for (int i = 0; i < blocks; ++i) {
+            ws->putInterleavedFrames
+                (block, td.getInterleavedData() + i * block * channels);
+        }
+        QCOMPARE(int(ws->getStatistics().syncs), 2);
+        ws->flush();
+        QCOMPARE(int(ws->getStatistics().syncs), 3);
+        delete ws;
+
+	AudioReadStream *rs = AudioReadStreamFactory::createReadStream(outfile());
+        QVERIFY(rs);
+        std::vector<float> readback((block * blocks + 1) * channels);
+        QCOMPARE(int(rs->getInterleavedFrames(block * blocks + 1,
+                                              readback.data())),
+                 block * blocks);
+        delete rs;
+
+#ifdef __linux__
+        struct stat st;
+        QCOMPARE(stat(outfile(), &st), 0);
+        QVERIFY(off_t(st.st_blocks) * 512 < 4 * 1024 * 1024);
+#endif
+    }
+
+    void writeOpusOptions() {
+
+        // Write our test signal to Opus at a low and a high constant
+        // bitrate, check the file sizes show that the bitrate
+        // reached the encoder, and check an invalid option is
+        // refused rather than ignored
+
+        AudioStreamTestData td(48000, 1);
+        int n = td.getFrameCount();
+        int bitrates[] = { 16000, 128000 };
+        qint64 sizes[2];
+
+        for (int i = 0; i < 2; ++i) {
+            AudioWriteStream::Options options;
+            options.bitrate = bitrates[i];
+            options.bitrateMode = AudioWriteStream::Options::ConstantBitrate;
+            options.complexity = 5;
+            options.frameDurationMs = 40.0;
+            AudioWriteStream *ws = 0;
+            try {
+                ws = AudioWriteStreamFactory::createWriteStream
+                    (outfile_opus(), 1, 48000, options);
+            } catch (const UnknownFileType &) {
+#if (QT_VERSION >= 0x050000)
+                QSKIP("Opus writing not supported, skipping");
+#else
+                QSKIP("Opus writing not supported, skipping", SkipSingle);
+#endif
+            }
+            QVERIFY(ws);
+            ws->putInterleavedFrames(n, td.getInterleavedData());
+            delete ws;
+            sizes[i] = QFileInfo(outfile_opus()).size();
+
+            AudioReadStream *rs =
+                AudioReadStreamFactory::createReadStream(outfile_opus());
+            QVERIFY(rs);
+            std::vector<float> readback(n + 1);
+            QCOMPARE(int(rs->getInterleavedFrames(n + 1, readback.data())), n);
+            delete rs;
+        }
+
+        // Two seconds at a constant 16kbps and 128kbps come to about
+        // 4KB and 32KB plus headers
+        QVERIFY(sizes[0] < 8000);
+        QVERIFY(sizes[1] > 24000);
+
+        AudioWriteStream::Options invalid;
+        invalid.frameDurationMs = 7.0;
+        bool thrown = false;
+        try {
+            delete AudioWriteStreamFactory::createWriteStream
+                (outfile_opus(), 1, 48000, invalid);
+        } catch (const FileOperationFailed &) {
+            thrown = true;
+        }
+        QVERIFY(thrown);
+        QVERIFY(!QFileInfo(outfile_opus()).exists());
+    }
+
+    void writeOpusParallel() {
+
+        // Encode three seconds of sinusoid with three threads in
+        // half-second segments, giving a chained file of six links.
+        // It should decode to exactly the input length, aligned with
+        // the input, and with no more error around the joins between
+        // segments than anywhere else
+
+        AudioStreamTestData td(48000, 1, 3.0);
+        int n = td.getFrameCount();
+        const float *original = td.getInterleavedData();
+
+        AudioWriteStream::Options options;
+        options.bitrate = 128000;
+        options.encodeThreads = 3;
+        options.segmentDurationSeconds = 0.5;
+
+        AudioWriteStream *ws = 0;
+        try {
+            ws = AudioWriteStreamFactory::createWriteStream
+                (outfile_opus(), 1, 48000, options);
+        } catch (const UnknownFileType &) {
+#if (QT_VERSION >= 0x050000)
+            QSKIP("Opus writing not supported, skipping");
+#else
+            QSKIP("Opus writing not supported, skipping", SkipSingle);
+#endif
+        }
+        QVERIFY(ws);
+        // In uneven blocks, so that segments don't line up with them
+        for (int i = 0; i < n; ) {
+            int here = std::min(7919, n - i);
+            ws->putInterleavedFrames(here, original + i);
+            i += here;
+        }
+        delete ws;
+
+        AudioReadStream *rs =
+            AudioReadStreamFactory::createReadStream(outfile_opus());
+        QVERIFY(rs);
+        std::vector<float> decoded(n + 1000);
+        int got = 0;
+        while (true) {
+            int here = rs->getInterleavedFrames(1000, decoded.data() + got);
+            got += here;
+            if (here < 1000) break;
+        }
+        delete rs;
+        QCOMPARE(got, n);
+
+        // RMS error in 10ms windows, skipping the first and last
+        // windows where the codec is still settling
+        int window = 480;
+        std::vector<float> errors;
+        for (int w = 1; w + 1 < n / window; ++w) {
+            double sum = 0.0;
+            for (int i = w * window; i < (w + 1) * window; ++i) {
+                double d = decoded[i] - original[i];
+                sum += d * d;
+            }
+            errors.push_back(float(sqrt(sum / window)));
+        }
+        std::vector<float> sorted(errors);
+        std::sort(sorted.begin(), sorted.end());
+        float median = sorted[sorted.size() / 2];
+        QVERIFY(median < 0.05f);
+
+        for (int join = 24000; join < n; join += 24000) {
+            for (int w = join / window - 2; w <= join / window + 1; ++w) {
+                QString message = QString
+                    ("Error %1 in window at frame %2 near join at %3 (median error %4)")
+                    .arg(errors[w - 1]).arg(w * window).arg(join).arg(median);
+                QVERIFY2(errors[w - 1] < std::max(median * 4.f, 0.02f),
+                         message.toLocal8Bit().data());
+            }
+        }
+
+        // Invalid options should be rejected at construction, as
+        // they are when encoding on one thread, rather than only
+        // when a segment comes to be encoded
+        AudioWriteStream::Options invalid;
+        invalid.encodeThreads = 3;
+        invalid.frameDurationMs = 7.0;
+        bool thrown = false;
+        try {
+            delete AudioWriteStreamFactory::createWriteStream
+                (outfile_opus(), 1, 48000, invalid);
+        } catch (const FileOperationFailed &) {
+            thrown = true;
+        }
+        QVERIFY(thrown);
+        QVERIFY(!QFileInfo(outfile_opus()).exists());
+    }
+
+    void writeOpusFlush() {
+
+        // Write half of our test signal to Opus with a short page
+        // latency, flush, and check that a reader opened while the
+        // writer is still open can decode most of what was written
+
+        AudioStreamTestData td(48000, 1);
+        int n = td.getFrameCount() / 2;
+
+        AudioWriteStream::Options options;
+        options.maxPageLatencyMs = 20.0;
+
+        AudioWriteStream *ws = 0;
+        try {
+            ws = AudioWriteStreamFactory::createWriteStream
+                (outfile_opus(), 1, 48000, options);
+        } catch (const UnknownFileType &) {
+#if (QT_VERSION >= 0x050000)
+            QSKIP("Opus writing not supported, skipping");
+#else
+            QSKIP("Opus writing not supported, skipping", SkipSingle);
+#endif
+        }
+        QVERIFY(ws);
+        ws->putInterleavedFrames(n, td.getInterleavedData());
+        ws->flush();
+
+        AudioReadStream *rs =
+            AudioReadStreamFactory::createReadStream(outfile_opus());
+        QVERIFY(rs);
+        std::vector<float> decoded(n);
+        int got = 0;
+        while (got < n) {
+            int here = rs->getInterleavedFrames(n - got, decoded.data() + got);
+            if (here == 0) break;
+            got += here;
+        }
+        delete rs;
+        delete ws;
+
+        // The encoder may hold back up to the page latency, plus a
+        // packet or two in progress
+        QVERIFY(got > n - 4800);
+
+        // What we did get should be our sinusoid, not silence
+        float peak = 0.f;
+        for (int i = 0; i < got; ++i) {
+            peak = std::max(peak, fabsf(decoded[i]));
+        }
+        QVERIFY(peak > 0.5f);
+    }
 };
 
 }
@@ -0,0 +1,433 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+/* Copyright Chris Cannam - All Rights Reserved */
+
+/*
+ * Throughput and latency benchmark for the readers and writers built
+ * into this copy of the library. Writes a synthetic test signal (see
+ * AudioStreamTestData) with every available writer, then reads each
+ * resulting file back, and prints the results as JSON on stdout for
+ * comparison between builds. Progress goes to stderr.
+ */
+
+#include "AudioStreamTestData.h"
+
+#include "bqaudiostream/AudioReadStreamFactory.h"
+#include "bqaudiostream/AudioReadStream.h"
+#include "bqaudiostream/AudioWriteStreamFactory.h"
+#include "bqaudiostream/AudioWriteStream.h"
+
+#include <iostream>
+#include <sstream>
+#include <fstream>
+#include <vector>
+#include <string>
+#include <algorithm>
+#include <chrono>
+#include <random>
+#include <stdexcept>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cstdint>
+
+using namespace breakfastquay;
+using namespace std;
+
+namespace {
+
+struct Config {
+    double duration = 30.0;
+    int rate = 44100;
+    int channels = 2;
+    int bits = 16;
+    bool isFloat = false;
+    int blockFrames = 4096;
+    int repeat = 3;
+    int opens = 20;
+    int seeks = 200;
+    int resampleRate = 0;
+    string dir = ".";
+    bool keep = false;
+};
+
+double now()
+{
+    return chrono::duration<double>
+        (chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+double percentile(vector<double> v, double p)
+{
+    if (v.empty()) return 0.0;
+    sort(v.begin(), v.end());
+    size_t ix = size_t(p * double(v.size() - 1) + 0.5);
+    return v[ix];
+}
+
+string quoted(string s)
+{
+    string out = "\"";
+    for (char c: s) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c == '\n') {
+            out += "\\n";
+        } else if ((unsigned char)c < 0x20) {
+            out += ' ';
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+string distribution(const vector<double> &v)
+{
+    ostringstream out;
+    out << "{ \"count\": " << v.size()
+        << ", \"min\": " << percentile(v, 0.0)
+        << ", \"median\": " << percentile(v, 0.5)
+        << ", \"p90\": " << percentile(v, 0.9)
+        << ", \"p99\": " << percentile(v, 0.99)
+        << ", \"max\": " << percentile(v, 1.0) << " }";
+    return out.str();
+}
+
+string statistics(const AudioStreamStatistics &s)
+{
+    ostringstream out;
+    out << "{ \"bytes\": " << s.bytes
+        << ", \"ioCalls\": " << s.ioCalls
+        << ", \"syncs\": " << s.syncs
+        << ", \"codecSeconds\": " << s.codecSeconds
+        << ", \"conversionSeconds\": " << s.conversionSeconds
+        << ", \"resampleSeconds\": " << s.resampleSeconds
+        << ", \"peakBufferBytes\": " << s.peakBufferBytes << " }";
+    return out.str();
+}
+
+void put(vector<char> &v, uint32_t x, int bytes)
+{
+    for (int i = 0; i < bytes; ++i) {
+        v.push_back(char((x >> (8 * i)) & 0xff));
+    }
+}
+
+// None of the writers lets us choose the sample format, so write the
+// WAV reading source ourselves, at the requested bit depth
+
+void writeWav(string path, const AudioStreamTestData &td, int bits, bool isFloat)
+{
+    int frames = td.getFrameCount();
+    int channels = td.getChannelCount();
+    int bytesPerSample = bits / 8;
+    uint32_t dataBytes = uint32_t(frames) * channels * bytesPerSample;
+
+    vector<char> v;
+    v.reserve(44 + dataBytes);
+    v.insert(v.end(), { 'R', 'I', 'F', 'F' });
+    put(v, 36 + dataBytes, 4);
+    v.insert(v.end(), { 'W', 'A', 'V', 'E', 'f', 'm', 't', ' ' });
+    put(v, 16, 4);
+    put(v, isFloat ? 3 : 1, 2);
+    put(v, channels, 2);
+    put(v, uint32_t(td.getSampleRate()), 4);
+    put(v, uint32_t(td.getSampleRate()) * channels * bytesPerSample, 4);
+    put(v, channels * bytesPerSample, 2);
+    put(v, bits, 2);
+    v.insert(v.end(), { 'd', 'a', 't', 'a' });
+    put(v, dataBytes, 4);
+
+    const float *data = td.getInterleavedData();
+    double scale = double((1u << (bits - 1)) - 1);
+    for (int i = 0; i < frames * channels; ++i) {
+        float f = data[i];
+        if (isFloat) {
+            uint32_t x;
+            memcpy(&x, &f, 4);
+            put(v, x, 4);
+        } else {
+            if (f > 1.f) f = 1.f;
+            if (f < -1.f) f = -1.f;
+            put(v, uint32_t(int32_t(lrint(f * scale))), bytesPerSample);
+        }
+    }
+
+    ofstream out(path.c_str(), ios::binary);
+    out.write(v.data(), v.size());
+    if (!out) {
+        throw runtime_error("failed to write " + path);
+    }
+}
+
+string writeBenchmark(const Config &config, const AudioStreamTestData &td,
+                      string path)
+{
+    int channels = td.getChannelCount();
+    const float *data = td.getInterleavedData();
+    int frames = td.getFrameCount();
+
+    vector<double> times;
+    AudioStreamStatistics stats;
+
+    for (int r = 0; r < config.repeat; ++r) {
+        double start = now();
+        AudioWriteStream *ws = AudioWriteStreamFactory::createWriteStream
+            (path, channels, config.rate);
+        ws->setStatisticsEnabled(true);
+        for (int i = 0; i < frames; i += config.blockFrames) {
+            int n = min(config.blockFrames, frames - i);
+            ws->putInterleavedFrames(n, data + size_t(i) * channels);
+        }
+        stats = ws->getStatistics();
+        delete ws;
+        times.push_back(now() - start);
+    }
+
+    double best = percentile(times, 0.0);
+    ostringstream out;
+    out << "{ \"seconds\": " << distribution(times)
+        << ", \"framesPerSecond\": " << double(frames) / best
+        << ", \"realtimeFactor\": " << config.duration / best
+        << ", \"statistics\": " << statistics(stats) << " }";
+    return out.str();
+}
+
+string openBenchmark(const Config &config, string path)
+{
+    vector<double> times;
+    for (int i = 0; i < config.opens; ++i) {
+        double start = now();
+        AudioReadStream *rs = AudioReadStreamFactory::createReadStream(path);
+        times.push_back(now() - start);
+        delete rs;
+    }
+    return distribution(times);
+}
+
+string decodeBenchmark(const Config &config, string path, int retrievalRate)
+{
+    vector<double> times;
+    vector<float> buffer;
+    size_t frames = 0;
+    AudioStreamStatistics stats;
+
+    for (int r = 0; r < config.repeat; ++r) {
+        AudioReadStream *rs = AudioReadStreamFactory::createReadStream(path);
+        if (retrievalRate != 0) {
+            rs->setRetrievalSampleRate(retrievalRate);
+        }
+        rs->setStatisticsEnabled(true);
+        buffer.resize(size_t(config.blockFrames) * rs->getChannelCount());
+        frames = 0;
+        double start = now();
+        while (true) {
+            size_t got = rs->getInterleavedFrames(config.blockFrames, buffer.data());
+            frames += got;
+            if (got < size_t(config.blockFrames)) break;
+        }
+        times.push_back(now() - start);
+        stats = rs->getStatistics();
+        delete rs;
+    }
+
+    double best = percentile(times, 0.0);
+    ostringstream out;
+    out << "{ \"frames\": " << frames
+        << ", \"seconds\": " << distribution(times)
+        << ", \"framesPerSecond\": " << double(frames) / best
+        << ", \"realtimeFactor\": " << config.duration / best
+        << ", \"statistics\": " << statistics(stats) << " }";
+    return out.str();
+}
+
+string seekBenchmark(const Config &config, string path)
+{
+    AudioReadStream *rs = AudioReadStreamFactory::createReadStream(path);
+    if (!rs->isSeekable()) {
+        delete rs;
+        return "null";
+    }
+
+    // Time each seek together with the first block read after it,
+    // since some readers defer the work of seeking until then
+
+    size_t total = rs->getEstimatedFrameCount();
+    int block = min(config.blockFrames, 1024);
+    vector<float> buffer(size_t(block) * rs->getChannelCount());
+    mt19937 rng(42);
+    uniform_int_distribution<size_t> dist(0, total > size_t(block) ?
+                                          total - block : 0);
+    vector<double> times;
+    int failures = 0;
+
+    for (int i = 0; i < config.seeks; ++i) {
+        size_t frame = dist(rng);
+        double start = now();
+        bool ok = rs->seek(frame);
+        if (ok) {
+            rs->getInterleavedFrames(block, buffer.data());
+            times.push_back(now() - start);
+        } else {
+            ++failures;
+        }
+    }
+
+    delete rs;
+
+    ostringstream out;
+    out << "{ \"seconds\": " << distribution(times)
+        << ", \"failures\": " << failures << " }";
+    return out.str();
+}
+
+void usage(const char *name)
+{
+    cerr << "Usage: " << name << " [options]\n\n"
+         << "  --duration <s>      Length of test signal in seconds (default 30)\n"
+         << "  --rate <hz>         Sample rate (default 44100)\n"
+         << "  --channels <n>      Channel count (default 2)\n"
+         << "  --bits <n>          Bit depth of the WAV source: 16, 24 or 32 (default 16)\n"
+         << "  --float             Write the WAV source as 32-bit float\n"
+         << "  --block <frames>    Frames per read or write call (default 4096)\n"
+         << "  --repeat <n>        Repetitions of each throughput run (default 3)\n"
+         << "  --opens <n>         Repetitions of the open latency test (default 20)\n"
+         << "  --seeks <n>         Seeks in the seek latency test (default 200)\n"
+         << "  --resample <hz>     Retrieval rate for the resampling test (default\n"
+         << "                      48000, or 44100 if the sample rate is 48000)\n"
+         << "  --dir <path>        Directory for the test files (default .)\n"
+         << "  --keep              Do not delete the test files afterwards\n"
+         << endl;
+}
+
+}
+
+int main(int argc, char **argv)
+{
+    Config config;
+
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        bool hasValue = (i + 1 < argc);
+        if (arg == "--float") {
+            config.isFloat = true;
+            config.bits = 32;
+        } else if (arg == "--keep") {
+            config.keep = true;
+        } else if (arg == "--duration" && hasValue) {
+            config.duration = atof(argv[++i]);
+        } else if (arg == "--rate" && hasValue) {
+            config.rate = atoi(argv[++i]);
+        } else if (arg == "--channels" && hasValue) {
+            config.channels = atoi(argv[++i]);
+        } else if (arg == "--bits" && hasValue) {
+            config.bits = atoi(argv[++i]);
+        } else if (arg == "--block" && hasValue) {
+            config.blockFrames = atoi(argv[++i]);
+        } else if (arg == "--repeat" && hasValue) {
+            config.repeat = atoi(argv[++i]);
+        } else if (arg == "--opens" && hasValue) {
+            config.opens = atoi(argv[++i]);
+        } else if (arg == "--seeks" && hasValue) {
+            config.seeks = atoi(argv[++i]);
+        } else if (arg == "--resample" && hasValue) {
+            config.resampleRate = atoi(argv[++i]);
+        } else if (arg == "--dir" && hasValue) {
+            config.dir = argv[++i];
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (config.duration <= 0.0 || config.rate < 1 || config.rate > 1000000 ||
+        config.channels < 1 || config.channels > 20 ||
+        (config.bits != 16 && config.bits != 24 && config.bits != 32) ||
+        config.blockFrames < 1 || config.repeat < 1 ||
+        config.opens < 1 || config.seeks < 0) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    if (config.resampleRate == 0) {
+        config.resampleRate = (config.rate == 48000 ? 44100 : 48000);
+    }
+
+    cerr << "Generating " << config.duration << " seconds of "
+         << config.channels << "-channel test signal at "
+         << config.rate << " Hz" << endl;
+
+    AudioStreamTestData td(float(config.rate), config.channels,
+                           float(config.duration));
+
+    vector<string> files, written;
+    string source = config.dir + "/bqaudiostream-benchmark-source.wav";
+    writeWav(source, td, config.bits, config.isFloat);
+    files.push_back(source);
+    written.push_back(source);
+
+    cout.precision(6);
+    cout << "{\n  \"config\": { \"duration\": " << config.duration
+         << ", \"rate\": " << config.rate
+         << ", \"channels\": " << config.channels
+         << ", \"bits\": " << config.bits
+         << ", \"float\": " << (config.isFloat ? "true" : "false")
+         << ", \"blockFrames\": " << config.blockFrames
+         << ", \"repeat\": " << config.repeat
+         << ", \"resampleRate\": " << config.resampleRate << " },\n";
+
+    cout << "  \"writers\": {";
+    bool first = true;
+    for (string ext: AudioWriteStreamFactory::getSupportedFileExtensions()) {
+        string path = config.dir + "/bqaudiostream-benchmark." + ext;
+        cerr << "Writing " << ext << endl;
+        cout << (first ? "\n" : ",\n") << "    " << quoted(ext) << ": ";
+        first = false;
+        written.push_back(path);
+        try {
+            cout << writeBenchmark(config, td, path);
+            if (AudioReadStreamFactory::isExtensionSupportedFor(path)) {
+                files.push_back(path);
+            }
+        } catch (const exception &e) {
+            cout << "{ \"error\": " << quoted(e.what()) << " }";
+        }
+    }
+    cout << "\n  },\n";
+
+    cout << "  \"readers\": {";
+    first = true;
+    for (string path: files) {
+        string label = AudioReadStreamFactory::extensionOf(path);
+        if (path == source) {
+            label = "wav-source";
+        }
+        cerr << "Reading " << label << endl;
+        cout << (first ? "\n" : ",\n") << "    " << quoted(label) << ": ";
+        first = false;
+        try {
+            string open = openBenchmark(config, path);
+            string decode = decodeBenchmark(config, path, 0);
+            string seek = seekBenchmark(config, path);
+            string resample = decodeBenchmark(config, path, config.resampleRate);
+            cout << "{\n      \"open\": " << open
+                 << ",\n      \"decode\": " << decode
+                 << ",\n      \"seek\": " << seek
+                 << ",\n      \"resample\": " << resample
+                 << "\n    }";
+        } catch (const exception &e) {
+            cout << "{ \"error\": " << quoted(e.what()) << " }";
+        }
+    }
+    cout << "\n  }\n}" << endl;
+
+    if (!config.keep) {
+        for (string path: written) {
+            remove(path.c_str());
+        }
+    }
+
+    return 0;
+}
@@ -6,6 +6,8 @@
 #include "TestAudioStreamRead.h"
 #include "TestWavReadWrite.h"
 #include "TestWavReadWhileWriting.h"
+#include "TestPrefetchingRead.h"
+#include "TestAllocations.h"
 #include <QtTest>
 
 #include <iostream>
@@ -48,6 +50,18 @@ int main(int argc, char *argv[])
 	else ++bad;
     }
 
+    {
+	breakfastquay::TestPrefetchingRead t;
+	if (QTest::qExec(&t, argc, argv) == 0) ++good;
+	else ++bad;
+    }
+
+    {
+	breakfastquay::TestAllocations t;
+	if (QTest::qExec(&t, argc, argv) == 0) ++good;
+	else ++bad;
+    }
+
     if (bad > 0) {
 	std::cerr << "\n********* " << bad << " test suite(s) failed!\n" << std::endl;
 	return 1;
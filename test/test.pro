@@ -15,9 +15,16 @@ LIBS += -L.. -lbqaudiostream -L../../bqresample -lbqresample -L../../bqvec -lbqv
 INCLUDEPATH += . .. ../../bqvec ../../bqresample ../../bqthingfactory
 DEPENDPATH += . .. ../../bqvec ../../bqresample ../../bqthingfactory
 
-HEADERS += AudioStreamTestData.h TestAudioStreamRead.h TestSimpleWavRead.h TestWavReadWrite.h TestWavSeek.h TestWavReadWhileWriting.h
+HEADERS += AudioStreamTestData.h AllocationCounter.h TestAudioStreamRead.h TestSimpleWavRead.h TestWavReadWrite.h TestWavSeek.h TestWavReadWhileWriting.h TestPrefetchingRead.h TestAllocations.h
 
-SOURCES += main.cpp
+SOURCES += main.cpp AllocationCounter.cpp
+
+# Route malloc and friends, as called from the statically linked bq
+# libraries, through the allocation counter
+linux* {
+    DEFINES += BQ_WRAP_MALLOC
+    QMAKE_LFLAGS += -Wl,--wrap=malloc -Wl,--wrap=calloc -Wl,--wrap=realloc -Wl,--wrap=posix_memalign
+}
 
 !win32 {
     !macx* {